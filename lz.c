@@ -0,0 +1,155 @@
+/*
+ * LZ77 codec in the way of LZ4, byte aligned and fast rather than small.
+ *
+ * A stream is a run of sequences, each is
+ *    token      literal length in the high 4 bits, match length - 4 in the low
+ *    [length]   255s and a last byte added to a length of 15
+ *    literals
+ *    offset     2 bytes little endian, back from the current position
+ *    [length]
+ * the last sequence has literals only.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <lz.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_SKIP_SHIFT 6  /* search faster in data that does not match */
+
+static inline uint32_t lz_hash(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_len(uint8_t *op, const uint8_t *oend, size_t len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op == oend) return 0;
+        *op++ = 255;
+    }
+    if (op == oend) return 0;
+    *op++ = len;
+    return op;
+}
+
+/* a sequence, nmatch 0 for the last one */
+static uint8_t *lz_put(uint8_t *op, const uint8_t *oend, const uint8_t *lit, size_t nlit,
+        size_t offset, size_t nmatch)
+{
+    if (op == oend) return 0;
+    uint8_t *token = op++;
+
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15 && !(op = lz_put_len(op, oend, nlit - 15))) return 0;
+    if ((size_t) (oend - op) < nlit) return 0;
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (!nmatch) return op;
+
+    if (oend - op < 2) return 0;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    nmatch -= LZ_MIN_MATCH;
+    *token |= nmatch < 15 ? nmatch : 15;
+    if (nmatch >= 15 && !(op = lz_put_len(op, oend, nmatch - 15))) return 0;
+    return op;
+}
+
+size_t lz_compress(const char *src, size_t n, char *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *in = (const uint8_t *) src;
+    const uint8_t *end = in + n;
+    const uint8_t *ip = in, *anchor = in;
+    uint8_t *op = (uint8_t *) dst;
+    const uint8_t *oend = op + cap;
+
+    memset(table, 0x00, sizeof(table));
+
+    while (n >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+        uint32_t h = lz_hash(ip);
+        const uint8_t *ref = in + table[h];
+        table[h] = ip - in;
+
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+            ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        const uint8_t *m = ip + LZ_MIN_MATCH, *r = ref + LZ_MIN_MATCH;
+        while (m < end && *m == *r) m++, r++;
+
+        op = lz_put(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+        if (!op) return 0;
+        ip = anchor = m;
+    }
+
+    op = lz_put(op, oend, anchor, end - anchor, 0, 0);
+    if (!op) return 0;
+    return op - (uint8_t *) dst;
+}
+
+static const uint8_t *lz_get_len(const uint8_t *ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t b;
+    do {
+        if (ip == iend) return 0;
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    return ip;
+}
+
+size_t lz_decompress(const char *src, size_t n, char *dst, size_t cap)
+{
+    const uint8_t *ip = (const uint8_t *) src;
+    const uint8_t *iend = ip + n;
+    uint8_t *op = (uint8_t *) dst;
+    uint8_t *oend = op + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+
+        size_t len = token >> 4;
+        if (len == 15 && !(ip = lz_get_len(ip, iend, &len))) return 0;
+        if ((size_t) (iend - ip) < len) return 0;
+        if ((size_t) (oend - op) < len) {
+            memcpy(op, ip, oend - op);
+            return cap;
+        }
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return 0;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - (uint8_t *) dst)) return 0;
+
+        len = token & 15;
+        if (len == 15 && !(ip = lz_get_len(ip, iend, &len))) return 0;
+        len += LZ_MIN_MATCH;
+
+        const uint8_t *m = op - offset;
+        if ((size_t) (oend - op) < len) len = oend - op;
+        if (offset >= len) {
+            memcpy(op, m, len);
+            op += len;
+        } else {
+            /* the match runs into itself */
+            while (len--) *op++ = *m++;
+        }
+        if (op == oend) return cap;
+    }
+    return op - (uint8_t *) dst;
+}
@@ -0,0 +1,18 @@
+#ifndef LZ_H
+#define    LZ_H
+
+#ifdef    __cplusplus
+extern "C" {
+#endif
+
+/* n bytes of src packed to dst, 0 if they do not fit in cap bytes */
+size_t lz_compress(const char *src, size_t n, char *dst, size_t cap);
+
+/* unpack up to cap bytes to dst, 0 if src is not a stream */
+size_t lz_decompress(const char *src, size_t n, char *dst, size_t cap);
+
+#ifdef    __cplusplus
+}
+#endif
+
+#endif    /* LZ_H */
@@ -30,6 +30,10 @@
 #define FILE_TOKEN 1
 #define NVAL_TOKEN 4
 #define FLAG_TOKEN 2
+#define EXPTIME_TOKEN 3
+
+/* items of each LRU list the crawler looks at every timer tick */
+#define CRAWL_ITEMS 256
 
 class McConn : public AbstractConn {
 public:
@@ -46,12 +50,18 @@ private:
 	static const char *stateTxt(ConnState state);
 
 	void doGet();
+	void doGat();
+	void doTouch();
 	void doIncr();
 	void doDecr();
 	void doDelete();
 	void doStats();
 	void doDump();
 	void doLoad();
+	void doMemlimit();
+	void doCompact();
+	void doFlushAll();
+	void doUse();
 	void doSet();
 	void doAdd();
 	void doReplace();
@@ -59,6 +69,7 @@ private:
 	void doAppend();
 
 	void outString(const char *fmt, ...);
+	const char *nsKey(const token_t &tok, size_t *nkey);
 
 	DmState onListening();
 	DmState onRead();
@@ -94,8 +105,12 @@ private:
 
 	CmdType ctype_;
 	uint32_t flags_;
+	uint32_t exptime_;
 	token_t tokens_[MAX_TOKENS];
 	size_t ntokens_;
+
+	char *key_;    /* "ns:" of use, the key is put after it */
+	size_t nns_;
 };
 
 const char *McConn::stateTxt(ConnState state)
@@ -132,12 +147,16 @@ McConn::McConn(int fd, shmc_t *shmc, EventMgr *em, ConnState state, stats_t *sta
 	resBodySize_ = resBodyBytes_ = 0;
 
 	resTailBytes_ = 0;
+
+	key_ = new char[SHMC_NS_NAME + REQ_HEADER_SIZE];
+	nns_ = 0;
 }
 
 McConn::~McConn()
 {
 	delete reqHeader_;
 	delete resHeader_;
+	delete[] key_;
 
 	if (reqBody_) free(reqBody_);
 	if (resBody_) free(resBody_);
@@ -179,6 +198,16 @@ void McConn::outString(const char *fmt, ...)
 	va_end(ap);
 }
 
+/* the key of tok in the namespace the connection uses */
+const char *McConn::nsKey(const token_t &tok, size_t *nkey)
+{
+	*nkey = nns_ + tok.length;
+	if (!nns_) return tok.value;
+
+	memcpy(key_ + nns_, tok.value, tok.length);
+	return key_;
+}
+
 void McConn::doGet()
 {
 	char    *val;
@@ -187,7 +216,9 @@ void McConn::doGet()
 
 	stats_->get_cnts++;
 
-	SHMC_RC rc = shmc_get(shmc_, tokens_[KEY_TOKEN].value, tokens_[KEY_TOKEN].length, &val, &nval, &flags);
+	size_t nkey;
+	const char *key = nsKey(tokens_[KEY_TOKEN], &nkey);
+	SHMC_RC rc = shmc_get(shmc_, key, nkey, &val, &nval, &flags);
 	if (rc == SHMC_OK) {
 		outString("VALUE %s %"PRIu32" %d\r\n", tokens_[KEY_TOKEN].value, flags, (int) nval);	
 		resBody_ = val;
@@ -201,6 +232,57 @@ void McConn::doGet()
 	}
 }
 
+/* a negative exptime is a unix time long past, the item expires at once */
+static uint32_t parseExptime(const char *value)
+{
+	long exptime = strtol(value, 0, 10);
+	return exptime < 0 ? SHMC_EXPTIME_REL + 1 : (uint32_t) exptime;
+}
+
+/* gat exptime key, the item is touched and read under one write lock */
+void McConn::doGat()
+{
+	char    *val;
+	size_t   nval;
+	uint32_t flags;
+
+	stats_->get_cnts++;
+
+	size_t nkey;
+	const char *key = nsKey(tokens_[KEY_TOKEN+1], &nkey);
+	int stripe = shmc_wrlock_key(shmc_, key, nkey);
+	SHMC_RC rc = shmc_touch_nolock(shmc_, key, nkey, parseExptime(tokens_[KEY_TOKEN].value));
+	if (rc == SHMC_OK) rc = shmc_get_nolock(shmc_, key, nkey, &val, &nval, &flags);
+	shmc_unlock_stripe(shmc_, stripe);
+
+	if (rc == SHMC_OK) {
+		outString("VALUE %s %"PRIu32" %d\r\n", tokens_[KEY_TOKEN+1].value, flags, (int) nval);
+		resBody_ = val;
+		resBodySize_ = nval;
+	} else if (rc == SHMC_NOTFOUND) {
+		stats_->get_misses++;
+		outString("END\r\n");
+	} else {
+		stats_->err_cnts++;
+		outString("SERVER_ERROR %s\r\n", shmc_error(rc));
+	}
+}
+
+void McConn::doTouch()
+{
+	size_t nkey;
+	const char *key = nsKey(tokens_[KEY_TOKEN], &nkey);
+	SHMC_RC rc = shmc_touch(shmc_, key, nkey, parseExptime(tokens_[KEY_TOKEN+1].value));
+	if (rc == SHMC_OK) {
+		outString("TOUCHED\r\n");
+	} else if (rc == SHMC_NOTFOUND) {
+		outString("NOT_FOUND\r\n");
+	} else {
+		stats_->err_cnts++;
+		outString("SERVER_ERROR %s\r\n", shmc_error(rc));
+	}
+}
+
 void McConn::doIncr()
 {
 	uint64_t newVal;
@@ -208,7 +290,9 @@ void McConn::doIncr()
 
 	stats_->incr_cnts++;
 
-	SHMC_RC rc = shmc_incr(shmc_, tokens_[KEY_TOKEN].value, tokens_[KEY_TOKEN].length, val, &newVal, 0);
+	size_t nkey;
+	const char *key = nsKey(tokens_[KEY_TOKEN], &nkey);
+	SHMC_RC rc = shmc_incr(shmc_, key, nkey, val, &newVal, 0);
 	if (rc == SHMC_OK) {
 		outString("%"PRIu64"\r\n", newVal);
 	} else if (rc == SHMC_NOTFOUND) {
@@ -227,7 +311,9 @@ void McConn::doDecr()
 
 	stats_->decr_cnts++;
 
-	SHMC_RC rc = shmc_decr(shmc_, tokens_[KEY_TOKEN].value, tokens_[KEY_TOKEN].length, val, &newVal, 0);
+	size_t nkey;
+	const char *key = nsKey(tokens_[KEY_TOKEN], &nkey);
+	SHMC_RC rc = shmc_decr(shmc_, key, nkey, val, &newVal, 0);
 	if (rc == SHMC_OK) {
 		outString("%"PRIu64"\r\n", newVal);	
 	} else if (rc == SHMC_NOTFOUND) {
@@ -243,7 +329,9 @@ void McConn::doDelete()
 {
 	stats_->del_cnts++;
 
-	SHMC_RC rc = shmc_del(shmc_, tokens_[KEY_TOKEN].value, tokens_[KEY_TOKEN].length);
+	size_t nkey;
+	const char *key = nsKey(tokens_[KEY_TOKEN], &nkey);
+	SHMC_RC rc = shmc_del(shmc_, key, nkey);
 	if (rc == SHMC_OK) {
 		outString("DELETED\r\n");
 	} else if (rc == SHMC_NOTFOUND) {
@@ -255,12 +343,22 @@ void McConn::doDelete()
 	}
 }
 
+static const char *evictPolicyName(int policy)
+{
+	switch (policy) {
+		case SHMC_EVICT_CLOCK: return "clock";
+		case SHMC_EVICT_SLRU: return "slru";
+		case SHMC_EVICT_SAMPLED: return "sampled";
+		default: return "lru";
+	}
+}
+
 void McConn::doStats()
 {
 	/* uint64 18446744073709551615, length 20
-	 * 1024 is enough
+	 * 2560 is enough, and 160 for each slab class, 200 for each namespace
 	 */
-	const size_t STATS_SIZE = 1024;
+	const size_t STATS_SIZE = 2560 + 160 * shmc_->attr->slabs_count + 200 * shmc_->attr->nspaces;
 	resBody_ = (char *) malloc(STATS_SIZE);
 	if (!resBody_) {
 		outString("SERVER_ERROR out of memory\r\n");	
@@ -330,6 +428,14 @@ void McConn::doStats()
 			"STAT evict_free %d\r\n", shmc_->attr->evict_to_free);
 	resBodySize_ += n;
 
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT evict_policy %s\r\n", evictPolicyName(shmc_->attr->evict_policy));
+	resBodySize_ += n;
+
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT use_tinylfu %d\r\n", shmc_->attr->use_tinylfu);
+	resBodySize_ += n;
+
 	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
 			"STAT default_counter %d\r\n", shmc_->attr->default_counter);
 	resBodySize_ += n;
@@ -338,6 +444,18 @@ void McConn::doStats()
 			"STAT use_flock %d\r\n", shmc_->attr->use_flock);
 	resBodySize_ += n;
 
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT use_futex %d\r\n", shmc_->attr->use_futex);
+	resBodySize_ += n;
+
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT use_seqlock %d\r\n", shmc_->attr->seqlock_read);
+	resBodySize_ += n;
+
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT lock_stripes %d\r\n", shmc_->attr->nstripes);
+	resBodySize_ += n;
+
 	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
 			"STAT bytes %lu\r\n", (unsigned long) shmc_->attr->mem_used);
 	resBodySize_ += n;
@@ -350,6 +468,75 @@ void McConn::doStats()
 			"STAT total_items %lu\r\n", (unsigned long) shmc_->attr->nitems);
 	resBodySize_ += n;
 
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT hash_buckets %d\r\n", shmc_->attr->hash_nbuckets);
+	resBodySize_ += n;
+
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT hash_is_expanding %d\r\n", shmc_->attr->hash_old_nbuckets ? 1 : 0);
+	resBodySize_ += n;
+
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT hash_resizes %lu\r\n", (unsigned long) shmc_->attr->hash_resizes);
+	resBodySize_ += n;
+
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT slabs_moved %lu\r\n", (unsigned long) shmc_->attr->slabs_moved);
+	resBodySize_ += n;
+
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT pages_free %lu\r\n", (unsigned long) shmc_->attr->pages_free);
+	resBodySize_ += n;
+
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT dedup_values %lu\r\n", (unsigned long) shmc_->attr->dedup_values);
+	resBodySize_ += n;
+
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT reclaimed %lu\r\n", (unsigned long) shmc_->attr->reclaimed);
+	resBodySize_ += n;
+
+	if (shmc_->attr->use_hit_stats) {
+		uint64_t hits, misses;
+		shmc_hit_stats(shmc_, &hits, &misses);
+		n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+				"STAT table_hits %"PRIu64"\r\nSTAT table_misses %"PRIu64"\r\nSTAT hit_ratio %.4f\r\n",
+				hits, misses, hits + misses ? (double) hits / (hits + misses) : 0.0);
+		resBodySize_ += n;
+	}
+
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT lfu_rejected %lu\r\n", (unsigned long) shmc_->attr->lfu_rejected);
+	resBodySize_ += n;
+
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT free_watermark %d\r\nSTAT evicted_ahead %lu\r\n",
+			shmc_->attr->free_watermark, (unsigned long) shmc_->attr->evicted_ahead);
+	resBodySize_ += n;
+
+	for (int i = 0; i < shmc_->attr->slabs_count; ++i) {
+		const shmc_slab_t *slab = &shmc_->slabs[i];
+		n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+				"STAT slab_%d_size %lu\r\nSTAT slab_%d_pages %u\r\n"
+				"STAT slab_%d_free %u\r\nSTAT slab_%d_evicted %"PRIu64"\r\n",
+				i, (unsigned long) slab->size, i, slab->pages, i, slab->nfree, i, slab->evicted);
+		resBodySize_ += n;
+	}
+
+	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+			"STAT namespaces %d\r\n", shmc_->attr->nspaces);
+	resBodySize_ += n;
+
+	for (int i = 0; i <= shmc_->attr->ns_open; ++i) {
+		const shmc_ns_t *ns = &shmc_->spaces[i];
+		n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
+				"STAT ns_%d_name %s\r\nSTAT ns_%d_used %lu\r\n"
+				"STAT ns_%d_quota %lu\r\nSTAT ns_%d_evicted %"PRIu64"\r\n",
+				i, i ? ns->name : "-", i, (unsigned long) shmc_ns_used(shmc_, i),
+				i, (unsigned long) ns->quota, i, ns->evicted);
+		resBodySize_ += n;
+	}
+
 	n = snprintf(resBody_ + resBodySize_, STATS_SIZE - resBodySize_,
 			"STAT max_depth %d", shmc_->attr->max_depth);
 	resBodySize_ += n;
@@ -377,6 +564,63 @@ void McConn::doLoad()
 	}
 }
 
+void McConn::doMemlimit()
+{
+	size_t mb = strtoul(tokens_[KEY_TOKEN].value, 0, 10);
+	SHMC_RC rc = shmc_resize(shmc_, mb * 1024 * 1024);
+	if (rc == SHMC_OK) {
+		outString("OK\r\n");
+	} else {
+		stats_->err_cnts++;
+		outString("SERVER_ERROR %s\r\n", shmc_error(rc));
+	}
+}
+
+void McConn::doCompact()
+{
+	SHMC_RC rc = shmc_compact(shmc_);
+	if (rc == SHMC_OK) {
+		outString("OK\r\n");
+	} else {
+		stats_->err_cnts++;
+		outString("SERVER_ERROR %s\r\n", shmc_error(rc));
+	}
+}
+
+/* flush_all [delay], the items go at once or delay seconds from now */
+void McConn::doFlushAll()
+{
+	uint32_t delay = ntokens_ == 3 ? strtoul(tokens_[KEY_TOKEN].value, 0, 10) : 0;
+	shmc_flush(shmc_, delay);
+	outString("OK\r\n");
+}
+
+/* use [ns [mb]], the keys of the connection are in namespace ns from
+ * now, its quota is set to mb if given. use alone goes back to namespace 0
+ */
+void McConn::doUse()
+{
+	if (ntokens_ == 2) {
+		nns_ = 0;
+		outString("OK\r\n");
+		return;
+	}
+
+	const char *name = tokens_[KEY_TOKEN].value;
+	size_t quota = ntokens_ == 4 ? strtoul(tokens_[KEY_TOKEN+1].value, 0, 10) * 1024 * 1024 : 0;
+	int ns;
+	SHMC_RC rc = shmc_ns_open(shmc_, name, quota, &ns);
+	if (rc == SHMC_OK) {
+		nns_ = tokens_[KEY_TOKEN].length;
+		memcpy(key_, name, nns_);
+		key_[nns_++] = SHMC_NS_SEP;
+		outString("OK\r\n");
+	} else {
+		stats_->err_cnts++;
+		outString("SERVER_ERROR %s\r\n", shmc_error(rc));
+	}
+}
+
 McConn::DmState McConn::onRead()
 {
 	ssize_t nn;
@@ -424,14 +668,24 @@ McConn::DmState McConn::onRead()
 	ntokens_ = tokenize(reqHeader_, tokens_, MAX_TOKENS);
 
 	/* get key
+	 * gat exptime key
+	 * touch key exptime
 	 * set/add/replace/prepend/append key flags exptime bytes
 	 * incr/decr key value
 	 * delete key
+	 * flush_all [delay]
+	 * use [ns [mb]]
 	 * quit
 	 */
 	if (ntokens_ == 3 && strcmp("get", tokens_[CMD_TOKEN].value) == 0) {
 		stop = true;
 		doGet();
+	} else if (ntokens_ == 4 && strcmp("gat", tokens_[CMD_TOKEN].value) == 0) {
+		stop = true;
+		doGat();
+	} else if (ntokens_ == 4 && strcmp("touch", tokens_[CMD_TOKEN].value) == 0) {
+		stop = true;
+		doTouch();
 	} else if (ntokens_ == 6 && strcmp("set", tokens_[CMD_TOKEN].value) == 0) {
 		ctype_ = Set;
 	} else if (ntokens_ == 6 && strcmp("add", tokens_[CMD_TOKEN].value) == 0) {
@@ -460,6 +714,18 @@ McConn::DmState McConn::onRead()
 	} else if (ntokens_ == 3 && strcmp("load", tokens_[CMD_TOKEN].value) == 0) {
 		stop = true;
 		doLoad();
+	} else if (ntokens_ == 3 && strcmp("cache_memlimit", tokens_[CMD_TOKEN].value) == 0) {
+		stop = true;
+		doMemlimit();
+	} else if (ntokens_ == 2 && strcmp("compact", tokens_[CMD_TOKEN].value) == 0) {
+		stop = true;
+		doCompact();
+	} else if ((ntokens_ == 2 || ntokens_ == 3) && strcmp("flush_all", tokens_[CMD_TOKEN].value) == 0) {
+		stop = true;
+		doFlushAll();
+	} else if (ntokens_ >= 2 && ntokens_ <= 4 && strcmp("use", tokens_[CMD_TOKEN].value) == 0) {
+		stop = true;
+		doUse();
 	} else if (ntokens_ == 2 && strcmp("quit", tokens_[CMD_TOKEN].value) == 0) {
 		state_ = Close;
 		return DmGoOn;
@@ -511,8 +777,10 @@ void McConn::doSet()
 {
 	stats_->set_cnts++;
 
-	SHMC_RC rc = shmc_set(shmc_, tokens_[KEY_TOKEN].value, tokens_[KEY_TOKEN].length,
-			reqBody_, reqBodySize_ - 2, flags_);
+	size_t nkey;
+	const char *key = nsKey(tokens_[KEY_TOKEN], &nkey);
+	SHMC_RC rc = shmc_set_exp(shmc_, key, nkey,
+			reqBody_, reqBodySize_ - 2, flags_, exptime_);
 	if (rc == SHMC_OK) {
 		outString("STORED\r\n");	
 	} else {
@@ -525,8 +793,10 @@ void McConn::doAdd()
 {
 	stats_->set_cnts++;
 
-	SHMC_RC rc = shmc_add(shmc_, tokens_[KEY_TOKEN].value, tokens_[KEY_TOKEN].length,
-			reqBody_, reqBodySize_ - 2, flags_);
+	size_t nkey;
+	const char *key = nsKey(tokens_[KEY_TOKEN], &nkey);
+	SHMC_RC rc = shmc_add_exp(shmc_, key, nkey,
+			reqBody_, reqBodySize_ - 2, flags_, exptime_);
 	if (rc == SHMC_OK) {
 		outString("STORED\r\n");	
 	} else if (rc == SHMC_EXIST) {
@@ -541,8 +811,10 @@ void McConn::doReplace()
 {
 	stats_->set_cnts++;
 
-	SHMC_RC rc = shmc_replace(shmc_, tokens_[KEY_TOKEN].value, tokens_[KEY_TOKEN].length,
-			reqBody_, reqBodySize_ - 2, flags_);
+	size_t nkey;
+	const char *key = nsKey(tokens_[KEY_TOKEN], &nkey);
+	SHMC_RC rc = shmc_replace_exp(shmc_, key, nkey,
+			reqBody_, reqBodySize_ - 2, flags_, exptime_);
 	if (rc == SHMC_OK) {
 		outString("STORED\r\n");
 	} else if (rc == SHMC_NOTFOUND) {
@@ -557,7 +829,9 @@ void McConn::doPrepend()
 {
 	stats_->set_cnts++;
 
-	SHMC_RC rc = shmc_prepend(shmc_, tokens_[KEY_TOKEN].value, tokens_[KEY_TOKEN].length,
+	size_t nkey;
+	const char *key = nsKey(tokens_[KEY_TOKEN], &nkey);
+	SHMC_RC rc = shmc_prepend(shmc_, key, nkey,
 			reqBody_, reqBodySize_ - 2, flags_);
 	if (rc == SHMC_OK) {
 		outString("STORED\r\n");
@@ -573,7 +847,9 @@ void McConn::doAppend()
 {
 	stats_->set_cnts++;
 
-	SHMC_RC rc = shmc_append(shmc_, tokens_[KEY_TOKEN].value, tokens_[KEY_TOKEN].length,
+	size_t nkey;
+	const char *key = nsKey(tokens_[KEY_TOKEN], &nkey);
+	SHMC_RC rc = shmc_append(shmc_, key, nkey,
 			reqBody_, reqBodySize_ - 2, flags_);
 	if (rc == SHMC_OK) {
 		outString("STORED\r\n");
@@ -610,6 +886,7 @@ McConn::DmState McConn::onNRead()
 	}
 
 	flags_ = strtoul(tokens_[FLAG_TOKEN].value, 0, 10);
+	exptime_ = parseExptime(tokens_[EXPTIME_TOKEN].value);
 
 	switch (ctype_) {
 		case Set:     doSet();     break;
@@ -720,6 +997,12 @@ void McConn::driverMachine(int /* flags */)
 	}
 }
 
+/* expired items go back to the slabs a few at a time between requests */
+static void crawl(void *arg)
+{
+	shmc_crawl((shmc_t *) arg, CRAWL_ITEMS);
+}
+
 McShell::McShell(shmc_t *shmc, int port, const char *inter) : shmc_(shmc)
 {
 	int fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -763,7 +1046,7 @@ McShell::McShell(shmc_t *shmc, int port, const char *inter) : shmc_(shmc)
 
 	memset(&stats_, 0x00, sizeof(stats_));
 
-	em_ = new EventMgr(1024);
+	em_ = new EventMgr(1024, crawl, shmc_);
 
 	McConn *c = new McConn(fd, shmc_, em_, McConn::Listening, &stats_);
 	if (!em_->addEvent(c, EPOLLIN | EPOLLOUT)) {
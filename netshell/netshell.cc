@@ -8,12 +8,27 @@
 #include <signal.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <shmc/shmc.h>
 #include <mcshell.h>
 
 McShell *mcShell = 0;
 
+/* the maintainer evicts ahead for the writers of every process on the map */
+#define MAINTAIN_USEC 10000
+
+static volatile bool maintainStop = false;
+
+static void *maintain(void *arg)
+{
+	while (!maintainStop) {
+		shmc_maintain((shmc_t *) arg);
+		usleep(MAINTAIN_USEC);
+	}
+	return 0;
+}
+
 static void sigHandler(int signo)
 {
 	if (signo == SIGTERM || signo == SIGINT) {
@@ -29,18 +44,33 @@ static int usage(const char *error)
 			        "    -i interface to listen on (default: INADDR_ANY, all addresses)\n"
 			        "    -p listen port, default 11217\n"
 					"    -m max memory to use in megabytes (default: 64 MB)\n"
+					"    -X <mb> memory may grow up to mb while running (default: -m)\n"
 					"    -M return error on memory exhausted (rather than LRU)\n"
+					"    -e <policy> eviction policy, lru, clock, slru or sampled (default: lru)\n"
+					"    -A admit new keys by access frequency when memory is full (default: no)\n"
+					"    -W <pct> a thread keeps pct of each slab class free ahead of writes (default: no)\n"
 					"    -n <bytes>  minimum space allocated for key+value (default: 64)\n"
 					"    -f <factor> chunk size growth factor (default: 2)\n"
 					"    -P <file> save PID in <file>, only used with -d option\n"
-					"    -I Override the size of each slab page. Adjusts max item size\n"
+					"    -I max item size, items larger than a slab page are chained\n"
 					"       (default: 1mb, min: 1k, max: 128m)\n"
+					"    -g <bytes> size of each slab page (default: 1mb)\n"
+					"    -L try to use large memory pages (hugetlbfs token or shmem THP)\n"
+					"    -k lock down all paged memory, prefaulted at start\n"
+					"    -z <bytes> compress values of at least bytes (default: no)\n"
+					"    -D <bytes> store equal values of at least bytes once (default: no)\n"
 					"    -d run as daemon, default no\n\n"
-					"    -b max buckets number, set as max as enouth (default: 65536)\n"
+					"    -b buckets number, each bucket holds 11 items before chaining (default: 65536)\n"
+					"    -B <n> the index may grow up to n buckets while running (default: no)\n"
 					"    -t mmap file (default: /dev/shm/netshell.mmap)\n"
 					"    -u token's mode (default: 0644)\n"
 					"    -c use default counter, (default: no)\n"
 					"    -l use flock, (default: pthread)\n"
+					"    -F use futex lock for read mostly load, (default: pthread)\n"
+					"    -s readers use seqlock instead of read lock, (default: no)\n"
+					"    -S <n> lock stripes, writers of different stripes run in parallel (default: 1)\n"
+					"    -N <n> namespaces, each with its own stripes and quota, see use (default: 1)\n"
+					"    -H count table hits and misses for stats, a write on every get (default: no)\n"
 					"    -a afresh new map, unlink old map, default: use old\n");
 	return error ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -56,40 +86,80 @@ int main(int argc, char *argv[])
 	int daemonize = 0;
 
 	size_t memLimit = 64 * 1024 * 1024;
+	size_t memLimitMax = 0;
 	int nbuckets = 65536;
+	int nbucketsMax = 0;
 	int mode = 0644;
 
 	size_t minItem = 64;
 	size_t maxItem = 1024 * 1024;
+	size_t pageSize = 1024 * 1024;
 	float factor = 2;
 
 	int evictToFree = 1;
+	int evictPolicy = SHMC_EVICT_LRU;
+	int useTinylfu = 0;
+	int freeWatermark = 0;
 	int defaultCounter = 0;
 	int useFlock = 0;
+	int useFutex = 0;
+	int useSeqlock = 0;
+	int nstripes = 1;
+	int nspaces = 1;
+	int useHitStats = 0;
     int useNewMap = 0;
+	int useHugepage = 0;
+	int prefault = SHMC_PREFAULT_NONE;
+	size_t compressMin = 0;
+	size_t dedupMin = 0;
 
 	int c;
-	while ((c = getopt(argc, argv, "i:p:m:Mn:f:P:I:db:t:u:clah")) > 0) {
+	while ((c = getopt(argc, argv, "i:p:m:X:Me:AW:n:f:P:I:g:Lkz:D:db:B:t:u:clFsS:N:Hah")) > 0) {
 		switch (c) {
             case 'i': inter = optarg; break;
 			case 'p': port = atoi(optarg); break;
 			case 'm': memLimit = atoi(optarg) * 1024 * 1024; break;
+			case 'X': memLimitMax = (size_t) atoi(optarg) * 1024 * 1024; break;
 			case 'M': evictToFree = 0; break;
+			case 'e':
+				if (strcmp(optarg, "lru") == 0) evictPolicy = SHMC_EVICT_LRU;
+				else if (strcmp(optarg, "clock") == 0) evictPolicy = SHMC_EVICT_CLOCK;
+				else if (strcmp(optarg, "slru") == 0) evictPolicy = SHMC_EVICT_SLRU;
+				else if (strcmp(optarg, "sampled") == 0) evictPolicy = SHMC_EVICT_SAMPLED;
+				else exit(usage("invalid -e parameter"));
+				break;
+			case 'A': useTinylfu = 1; break;
+			case 'W': freeWatermark = atoi(optarg); break;
 			case 'n': minItem = atoi(optarg); break;
 			case 'f': factor = atof(optarg); break;
 			case 'P': pidfile = optarg; break;
 			case 'I': maxItem = atoi(optarg); break;
+			case 'g': pageSize = atoi(optarg); break;
+			case 'L': useHugepage = 1; break;
+			case 'k': prefault = SHMC_PREFAULT_MLOCK; break;
+			case 'z': compressMin = atoi(optarg); break;
+			case 'D': dedupMin = atoi(optarg); break;
 			case 'd': daemonize = 1; break;
 			case 'b': nbuckets = atoi(optarg); break;
+			case 'B': nbucketsMax = atoi(optarg); break;
 			case 't': token = optarg; break;
 			case 'u': mode = atoi(optarg); break;
 			case 'c': defaultCounter = 1; break;
 			case 'l': useFlock = 1; break;
+			case 'F': useFutex = 1; break;
+			case 's': useSeqlock = 1; break;
+			case 'S': nstripes = atoi(optarg); break;
+			case 'N': nspaces = atoi(optarg); break;
+			case 'H': useHitStats = 1; break;
 			case 'a': useNewMap = 1; break;
 			case 'h': exit(usage(0)); break;
 		}
 	}
 
+	if (freeWatermark && useFlock) {
+		exit(usage("-W needs a thread, it can not go with -l"));
+	}
+
 	if (maxItem < 1024 && maxItem > 128 * 1024 * 1024) {
 		exit(usage("invalid -I parameter"));
 	}
@@ -97,14 +167,29 @@ int main(int argc, char *argv[])
 	shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
 
 	shmc_attr_set_mem_limit(&attr, memLimit);	
+	shmc_attr_set_mem_limit_max(&attr, memLimitMax);
 	shmc_attr_set_nbuckets(&attr, nbuckets);
+	shmc_attr_set_nbuckets_max(&attr, nbucketsMax);
 	shmc_attr_set_mode(&attr, mode);
 	shmc_attr_set_item_size_min(&attr, minItem);
 	shmc_attr_set_item_size_max(&attr, maxItem);
 	shmc_attr_set_item_size_factor(&attr, factor);
+	shmc_attr_set_slab_page_size(&attr, pageSize);
 	shmc_attr_set_evict_to_free(&attr, evictToFree);
+	shmc_attr_set_evict_policy(&attr, evictPolicy);
+	shmc_attr_use_tinylfu(&attr, useTinylfu);
+	shmc_attr_set_free_watermark(&attr, freeWatermark);
 	shmc_attr_set_default_counter(&attr, defaultCounter);
 	shmc_attr_use_flock(&attr, useFlock);
+	shmc_attr_use_futex(&attr, useFutex);
+	shmc_attr_use_seqlock(&attr, useSeqlock);
+	shmc_attr_set_nstripes(&attr, nstripes);
+	shmc_attr_set_nspaces(&attr, nspaces);
+	shmc_attr_use_hit_stats(&attr, useHitStats);
+	shmc_attr_use_hugepage(&attr, useHugepage);
+	shmc_attr_set_prefault(&attr, prefault);
+	shmc_attr_set_compress_min(&attr, compressMin);
+	shmc_attr_set_dedup_min(&attr, dedupMin);
 
 	if (daemonize) {
 		daemon(1, 1);
@@ -134,6 +219,9 @@ int main(int argc, char *argv[])
 	signal(SIGINT, sigHandler);
 	signal(SIGPIPE, SIG_IGN);
 
+	pthread_t maintainer;
+	bool maintaining = shmc->attr->free_watermark && pthread_create(&maintainer, 0, maintain, shmc) == 0;
+
 	try {
 		mcShell = new McShell(shmc, port, inter);
 		mcShell->run();
@@ -141,6 +229,11 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "can't startup netshell, %d:%s\n", eno, strerror(eno));
 	}
 
+	if (maintaining) {
+		maintainStop = true;
+		pthread_join(maintainer, 0);
+	}
+
 	shmc_destroy(shmc);
 
 	unlink(pidfile);
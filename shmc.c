@@ -10,9 +10,19 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 #include <hash.h>
+#include <lz.h>
 #include <shmc.h>
 
 /* make sure the .h and .so are the same version */
@@ -21,122 +31,549 @@ uint32_t shmc_version() {
     return version;
 }
 
+/* links are 32 bit offsets, see A2R, key and val follow the header */
 struct shmc_item_s {
-	shmc_item_t *next;
-	shmc_item_t *prev;
-	shmc_item_t *h_next;
-
-    int          clsid;
-
+    uint32_t     next;
+    uint32_t     prev;
+    uint32_t     h_next;
+    uint32_t     hv;     /* hash of key, set when the item enters the index */
     uint32_t     flags;
-    char        *key;
-	size_t       nkey;
-    char        *val;
-	size_t       nval;
-    void        *end[];
+    uint32_t     exptime;  /* unix time it expires at, 0 never */
+    uint32_t     atime;    /* ms of the last link or hit, SHMC_EVICT_SAMPLED */
+    uint32_t     gen;      /* flush generation it was stored in */
+    uint8_t      clsid;
+    uint8_t      iflags;
+    uint16_t     nkey;
+    uint32_t     nval;
+    char         end[];
 };
 
-struct shmc_slab_s {
-    shmc_item_t *free_item;
-    size_t       size;
-    size_t       count;
-};
+#define item_key(item) ((item)->end)
+#define item_val(item) ((item)->end + (item)->nkey)
+
+/* a stripe guards the buckets hv % nstripes and its own LRU lists,
+ * the slabs are shared by all stripes under shmc->mutex
+ */
+#define CACHE_LINE 64
+
+/* futex rwlock for read mostly tables, readers count themselves in one of
+ * FUTEX_SHARDS cache lines picked by thread id, so readers on different
+ * cores do not share a counter. a writer takes the writer word, then waits
+ * until all shards drain, new readers back off while the writer word is set
+ */
+#define FUTEX_SHARDS 8
+#define FUTEX_SPIN   128
+
+typedef struct {
+    uint32_t writer;  /* 0 free, 1 locked, 2 locked and someone sleeps */
+    uint32_t drain;   /* bumped by the last reader of a shard while a writer waits */
+    pid_t    owner;   /* thread id of the writer, tells unlock which side we are */
+    struct {
+        uint32_t count;
+    } __attribute__((aligned(CACHE_LINE))) readers[FUTEX_SHARDS];
+} shmc_futex_t;
+
+struct shmc_stripe_s {
+    pthread_rwlock_t lock;
+    shmc_futex_t     futex;
+    pthread_mutex_t  mutex;  /* LRU lists of the stripe, for readers */
+    uint32_t         seq;
+    uint32_t         migrate;  /* next old bucket of the stripe to migrate */
+    size_t           used;     /* bytes of the items in its LRU lists */
+    /* counted by readers, off the line lock free readers poll */
+    uint64_t         hits __attribute__((aligned(CACHE_LINE)));
+    uint64_t         misses;
+    uint32_t         samples;  /* sketch counts since the sketch was aged */
+} __attribute__((aligned(CACHE_LINE)));
+
+/* a bucket is one cache line, a lookup compares the one byte tags of all
+ * the slots at once and only touches the items whose tag matches. items
+ * that do not fit in the slots are chained by h_next from overflow
+ */
+#define BUCKET_SLOTS 11
+
+struct shmc_bucket_s {
+    uint8_t      tags[16];  /* 0 is an empty slot, the last five are unused */
+    uint32_t     items[BUCKET_SLOTS];
+    uint32_t     overflow;
+} __attribute__((aligned(CACHE_LINE)));
+
+/* the index lives in one of two areas, a resize migrates it to the other */
+#define hash_area(attr) \
+    ((attr)->nbuckets_max > (attr)->nbuckets ? (attr)->nbuckets_max : (attr)->nbuckets)
+#define hash_areas(attr) ((attr)->nbuckets_max > (attr)->nbuckets ? 2 : 1)
+#define HASH_TABLE(shmc, t) ((shmc)->buckets + (size_t) (t) * hash_area((shmc)->attr))
+
+#define MIGRATE_STEP 4   /* old buckets migrated by each write */
+#define DEPTH_MAX    8   /* grow if an overflow chain gets this long */
+
+#define ALIGN_BYTES 8
+
+/* an item is linked by its offset from the start of the mapping in units
+ * of 1 << offset_shift bytes, 0 is null. the unit is ALIGN_BYTES, 32 bits
+ * of them cover a mapping of 32G, a larger mapping picks a larger unit
+ * when it is created. items are whole units
+ */
+#define OFFSET_SHIFT 3
+
+/* SHMC_FAST builds shift by a constant, they take no mapping of 32G */
+#ifdef SHMC_FAST
+# define item_shift(shmc) OFFSET_SHIFT
+#else
+# define item_shift(shmc) ((shmc)->shift)
+#endif
+#define offset_unit(attr) ((size_t) 1 << (attr)->offset_shift)
+#define mmap_max(attr) ((size_t) UINT32_MAX << (attr)->offset_shift)
+#define align_size(attr, size) (((size) % offset_unit(attr)) ? \
+   (size) + offset_unit(attr) - ((size) % offset_unit(attr)) : (size))
 
 #ifdef SHMC_VERBOSE
-# define a2r(shmc, p) printf("%04d a %p to r %p\n", __LINE__, (void *)(p), \
-        ((p) ? (void *) ((void *)(p) - (void *)((shmc)->version)) : (p))),
-# define r2a(shmc, p) printf("%04d r %p to a %p\n", __LINE__, (void *)(p), \
-        ((p) ? (void *) ((void *)((shmc)->version) + (size_t)(p)) : (p))),
+# define a2r(shmc, p) printf("%04d a %p to r %u\n", __LINE__, (void *)(p), \
+        ((p) ? (uint32_t) (((char *)(p) - (char *)((shmc)->version)) >> item_shift(shmc)) : 0)),
+# define r2a(shmc, r) printf("%04d r %u to a %p\n", __LINE__, (uint32_t)(r), \
+        ((r) ? (void *) ((char *)((shmc)->version) + ((size_t)(r) << item_shift(shmc))) : 0)),
 # define shmc_debug(fmt, arg...) printf(fmt, ##arg)
 #else
 # define a2r(shmc, p)
-# define r2a(shmc, p)
+# define r2a(shmc, r)
 # define shmc_debug(fmt, arg...)
 #endif
 
+#define A2R(shmc, p) (a2r(shmc, p) ((p) ? (uint32_t) (((char *)(p) - (char *)((shmc)->version)) >> item_shift(shmc)) : 0))
+#define R2A(shmc, r, type) (r2a(shmc, r) ((r) ? (type *) ((char *)((shmc)->version) + ((size_t)(r) << item_shift(shmc))) : (type *) 0))
 
-#ifdef SHMC_FAST
-# define A2R(shmc, p) (p)
-# define R2A(shmc, p, type) (p) 
-#else
-# define A2R(shmc, p) (a2r(shmc, p) ((p) ? (void *) ((void *)(p) - (void *)((shmc)->version)) : (p)))
-# define R2A(shmc, p, type) (r2a(shmc, p) ((p) ? (type *)((void *)((shmc)->version) + (size_t)(p)) : (p)))
-#endif
+#define align_ptr(p, a) ((void *) (((uintptr_t) (p) + (a) - 1) & ~((uintptr_t) (a) - 1)))
+
+#define stripe_of(shmc, hv) ((hv) % (shmc)->attr->nstripes)
+
+/* namespace i has the stripes from i * ns_stripes on, key_hash keeps the
+ * hash of a key in the stripes of its namespace
+ */
+#define ns_stripes(attr) ((attr)->nstripes / (attr)->nspaces)
+#define ns_of_stripe(shmc, s) ((s) / ns_stripes((shmc)->attr))
+
+/* the LRU heads and tails, the magazines, the crawler cursors and the
+ * SLRU segments of a stripe are one block of whole cache lines
+ */
+#define lru_stride(slabs_count) \
+    ((8 * (slabs_count) * sizeof(uint32_t) + CACHE_LINE - 1) / CACHE_LINE * (CACHE_LINE / sizeof(uint32_t)))
+
+#define LRU_HEAD(shmc, s, id) (shmc)->heads[(s) * lru_stride((shmc)->attr->slabs_count) + (id)]
+#define LRU_TAIL(shmc, s, id) (shmc)->tails[(s) * lru_stride((shmc)->attr->slabs_count) + (id)]
+
+/* free items a stripe keeps for itself, writers pop and push them under
+ * the stripe lock only and go to the slab in batches
+ */
+#define MAG_HEAD(shmc, s, id)  (shmc)->mags[(s) * lru_stride((shmc)->attr->slabs_count) + (id)]
+#define MAG_COUNT(shmc, s, id) (shmc)->nmags[(s) * lru_stride((shmc)->attr->slabs_count) + (id)]
+#define MAG_BATCH 8
+#define MAG_MAX   (2 * MAG_BATCH)
+
+/* the next item the crawler looks at in an LRU list, it walks from the
+ * tail to the head. an item leaving the list hands the cursor to its prev
+ */
+#define CRAWL_AT(shmc, s, id) (shmc)->crawls[(s) * lru_stride((shmc)->attr->slabs_count) + (id)]
+
+/* SHMC_EVICT_SLRU keeps both segments in the one list, protected items
+ * from the head down to mid, probation items from mid to the tail. a new
+ * item goes in at mid, a hit moves it to the head, protected. the
+ * protected segment is held to SLRU_PROT_PCT of the list by demoting its
+ * last items back to probation
+ */
+#define LRU_MID(shmc, s, id)   (shmc)->mids[(s) * lru_stride((shmc)->attr->slabs_count) + (id)]
+#define LRU_NPROT(shmc, s, id) (shmc)->nprots[(s) * lru_stride((shmc)->attr->slabs_count) + (id)]
+#define LRU_COUNT(shmc, s, id) (shmc)->counts[(s) * lru_stride((shmc)->attr->slabs_count) + (id)]
+#define SLRU_PROT_PCT 80
+
+/* SHMC_EVICT_SAMPLED compares the list tails of the own stripe and of up
+ * to SAMPLE_STRIPES others picked at random
+ */
+#define SAMPLE_STRIPES 4
+
+/* TinyLFU admission, LFU_ROWS rows of 4 bit counters indexed by the key
+ * hash, the estimate of a key is its smallest counter. every counter is
+ * halved after LFU_AGE samples per counter of a row, so old popularity
+ * fades
+ */
+#define LFU_ROWS 4
+#define LFU_MAX  15
+#define LFU_AGE  10
+
+/* iflags */
+#define ITEM_REF  0x01 /* hit since the clock hand passed it */
+#define ITEM_FREE 0x02 /* on the free list of its slab, or in a page being moved */
+#define ITEM_CHAIN 0x04 /* the value goes on in chunks */
+#define ITEM_MAG  0x08 /* in the magazine of a stripe */
+#define ITEM_LZ   0x10 /* the value is compressed, see val_pack */
+#define ITEM_DEDUP  0x20 /* the value is a slot of the shared store */
+#define ITEM_SHARED 0x40 /* a value of the shared store */
+#define ITEM_PROT   0x80 /* in the protected segment of SLRU */
+
+/* raw memory is cut in pages, every page belongs to one slab class or
+ * is back in the pool, released to the kernel
+ */
+#define slab_page_size(attr) ((attr)->slab_page_size)
+#define PAGE_FREE UINT8_MAX
+#define PAGE_NONE SIZE_MAX
+
+/* a value too big for the last class starts in a head item of that class
+ * and goes on in chunks linked by h_next, the last chunk is of the class
+ * that fits the rest. the first 4 bytes of the head's value area link the
+ * first chunk
+ */
+#define slab_last(shmc) (&(shmc)->slabs[(shmc)->attr->slabs_count - 1])
+
+#define item_needs_chain(shmc, nkey, nval) \
+    (sizeof(shmc_item_t) + (nkey) + (nval) > slab_last(shmc)->size)
+
+/* values of dedup_min bytes or more are stored once. their items keep a
+ * slot of the dedup table, the slot links an item with no key holding
+ * the value, whose next counts the users and prev is the slot. the
+ * table is changed under shmc->mutex, a slot never moves while it is used
+ */
+#define dedup_nslots(attr) ((attr)->dedup_min ? (size_t) (attr)->dedup_slots : 0)
+#define dedup_ok(shmc, vlen, nval) \
+    ((shmc)->attr->dedup_min && (vlen) >= (shmc)->attr->dedup_min && !item_needs_chain(shmc, 0, nval))
+#define DEDUP_DEAD UINT32_MAX
 
 #define item_size_ok(shmc, nkey, nval) \
-    ((sizeof(shmc_item_t) + (nkey) + (nval)) < ((shmc)->attr->item_size_max))
+    ((nkey) <= UINT16_MAX && (sizeof(shmc_item_t) + (nkey) + (nval)) < ((shmc)->attr->item_size_max) && \
+     sizeof(shmc_item_t) + (nkey) + sizeof(uint32_t) <= slab_last(shmc)->size)
+
+/* exptime up to SHMC_EXPTIME_REL is seconds from now, a unix time
+ * beyond. the coarse clock is a read of the vdso page, no syscall
+ */
+static inline uint32_t clock_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static inline uint32_t exptime_of(uint32_t exptime)
+{
+    if (exptime == 0 || exptime > SHMC_EXPTIME_REL) return exptime;
+    return clock_now() + exptime;
+}
+
+/* ms of the monotonic clock for LRU ages, it wraps in 49 days, ages are
+ * compared by their signed difference
+ */
+static inline uint32_t clock_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* shmc_flush stores the time it takes effect and the generation before
+ * it in one word, the live generation is one more once the time is due.
+ * an item of another generation is expired
+ */
+static inline uint32_t gen_of(uint64_t flush, uint32_t now)
+{
+    uint32_t at = flush >> 32;
+    return (uint32_t) flush + (at && at <= now);
+}
+
+#define flush_gen(shmc, now) gen_of(__atomic_load_n(&(shmc)->attr->flush, __ATOMIC_ACQUIRE), now)
+
+#define item_expired(shmc, item, now) \
+    (((item)->exptime && (item)->exptime <= (now)) || (item)->gen != flush_gen(shmc, now))
+
+/* an expired item is found again only by the crawler and by writers of
+ * the key, which reclaim it. the items at the LRU tail are looked at for
+ * an expired one before a live one is evicted
+ */
+#define EXPIRED_TRIES 5
+
+static shmc_item_t *assoc_find(shmc_t *shmc, const char *key, size_t nkey, uint32_t hv);
+static uint32_t *assoc_ref_live(shmc_t *shmc, shmc_bucket_t *bucket, const char *key, size_t nkey, uint32_t hv);
+static void item_reclaim(shmc_t *shmc, int stripe, shmc_bucket_t *bucket, uint32_t *ref, shmc_item_t *item);
+static void assoc_insert(shmc_t *shmc, uint32_t hv, shmc_item_t *item);
+static void assoc_delete(shmc_t *shmc, const char *key, size_t nkey, uint32_t hv);
+static uint32_t *assoc_ref(shmc_t *shmc, shmc_bucket_t *bucket, const char *key, size_t nkey, uint32_t hv);
+static void assoc_unlink(shmc_t *shmc, shmc_bucket_t *bucket, uint32_t *ref);
+static shmc_item_t *assoc_upsert(shmc_t *shmc, uint32_t hv, shmc_item_t *item, uint32_t *ref);
+static void assoc_migrate(shmc_t *shmc, int stripe);
+static void assoc_resize(shmc_t *shmc, int stripe);
+
+static void item_link(shmc_t *shmc, int stripe, shmc_item_t *item);
+static void item_unlink(shmc_t *shmc, int stripe, shmc_item_t *item);
+static void item_relink(shmc_t *shmc, int stripe, shmc_item_t *item);
+static void item_hit(shmc_t *shmc, int stripe, shmc_item_t *item);
+static shmc_item_t *item_victim(shmc_t *shmc, int stripe, int id);
+static int evict_from(shmc_t *shmc, int stripe, int from, int id);
+static int lfu_admit(shmc_t *shmc, int stripe, uint32_t hv, int id);
+static int ns_over(shmc_t *shmc, int stripe, int id);
+static void lfu_record(shmc_t *shmc, uint32_t hv);
+
+static shmc_item_t *item_alloc(shmc_t *shmc, int stripe, size_t nkey, size_t nval);
+static shmc_item_t *slab_pop(shmc_t *shmc, int stripe, int id);
+static void mag_push(shmc_t *shmc, int stripe, shmc_item_t *item);
+static void mag_drain_all(shmc_t *shmc);
+static void item_free(shmc_t *shmc, int stripe, shmc_item_t *item);
+static void item_read(shmc_t *shmc, shmc_item_t *item, size_t off, char *buf, size_t n);
+static void item_write(shmc_t *shmc, shmc_item_t *item, size_t off, const char *buf, size_t n);
+static size_t val_pack(shmc_t *shmc, const char *val, size_t nval, char **buf);
+static size_t item_nval(shmc_t *shmc, shmc_item_t *item);
+static shmc_item_t *item_body(shmc_t *shmc, shmc_item_t *item);
+static long dedup_find(shmc_t *shmc, uint32_t hv, const char *val, size_t nval, int lz);
+static long dedup_get(shmc_t *shmc, int stripe, const char *val, size_t nval, int lz);
+static void dedup_put(shmc_t *shmc, int stripe, uint32_t slot);
+static shmc_item_t *dedup_unref(shmc_t *shmc, uint32_t slot);
+static int item_value(shmc_t *shmc, shmc_item_t *item, char *buf, size_t n);
+static void slab_automove(shmc_t *shmc, int stripe);
+static void slab_shrink(shmc_t *shmc, size_t npages);
+static void slab_compact(shmc_t *shmc);
+
+static SHMC_RC do_get(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, char **val, size_t *nval, uint32_t *flags);
+static SHMC_RC do_set(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, const char *val, size_t nval,
+        uint32_t flags, uint32_t exptime);
+static SHMC_RC do_add(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, const char *val, size_t nval,
+        uint32_t flags, uint32_t exptime);
+static SHMC_RC do_store(shmc_t *shmc, uint32_t hv, shmc_bucket_t *bucket, uint32_t *ref,
+        const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags, uint32_t exptime);
+static SHMC_RC store_packed(shmc_t *shmc, uint32_t hv, shmc_bucket_t *bucket, uint32_t *ref,
+        const char *key, size_t nkey, const char *val, size_t nval, const char *lz, size_t nlz,
+        uint32_t flags, uint32_t exptime, int admit);
+static SHMC_RC do_replace(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, const char *val, size_t nval,
+        uint32_t flags, uint32_t exptime);
+static SHMC_RC do_prepend(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags);
+static SHMC_RC do_append(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags);
+static SHMC_RC do_del(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey);
+
+static void stripe_rdlock(shmc_t *shmc, int stripe);
+static int  stripe_trywrlock(shmc_t *shmc, int stripe);
+static void stripe_unlock(shmc_t *shmc, int stripe);
+
+static void futex_atfork();
+
+/* seqlock, writers make the seq of a stripe odd while they change it,
+ * lock free readers retry if seq is odd or changed under them
+ */
+#define SEQ_RETRY 64
 
-static shmc_item_t *assoc_find(shmc_t *shmc, const char *key, size_t nkey);
-static void assoc_insert(shmc_t *shmc, const char *key, size_t nkey, shmc_item_t *item);
-static void assoc_delete(shmc_t *shmc, const char *key, size_t nkey);        
+static inline void seq_write_begin(shmc_t *shmc, int stripe)
+{
+    __atomic_fetch_add(&shmc->stripes[stripe].seq, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seq_write_end(shmc_t *shmc, int stripe)
+{
+    __atomic_fetch_add(&shmc->stripes[stripe].seq, 1, __ATOMIC_RELEASE);
+}
+
+/* odd means a writer is in, the caller should back off and retry */
+static inline uint32_t seq_read_begin(const shmc_t *shmc, int stripe)
+{
+    return __atomic_load_n(&shmc->stripes[stripe].seq, __ATOMIC_ACQUIRE);
+}
 
-static void item_link(shmc_t *shmc, shmc_item_t *item);
-static void item_unlink(shmc_t *shmc, shmc_item_t *item);
-static void item_relink(shmc_t *shmc, shmc_item_t *item);
+static inline int seq_read_retry(const shmc_t *shmc, int stripe, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&shmc->stripes[stripe].seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* counters of a sketch row, a power of 2, one at least for each item of
+ * the smallest class in the whole of mem_limit_max
+ */
+static size_t lfu_width(const shmc_attr_t *attr)
+{
+    if (!attr->use_tinylfu) return 0;
 
-static shmc_item_t *item_alloc(shmc_t *shmc, size_t nkey, size_t nval);
-static void item_free(shmc_t *shmc, shmc_item_t *item);
+    size_t items = attr->mem_limit_max / (sizeof(shmc_item_t) + attr->item_size_min);
+    size_t width = 1024;
+    while (width < items) width <<= 1;
+    return width;
+}
 
 static size_t size_of_mmap(const shmc_attr_t *attr, const int slabs_count)
 {
     size_t size = 0;
 
-    /* version */
-    size += sizeof(uint32_t);    
+    /* version, the attribute after it is aligned for its atomic counters */
+    size += ALIGN_BYTES;
 
     /* shmc attribute */
     size += sizeof(shmc_attr_t);
 
-    /* shmc rwlock */
-    size += sizeof(pthread_rwlock_t);
+    /* slabs mutex, a cache line of its own */
+    size += CACHE_LINE;
     size += sizeof(pthread_mutex_t);
 
-    /* LRU list */
-    size += sizeof(shmc_item_t *) * slabs_count;
-    size += sizeof(shmc_item_t *) * slabs_count;
+    /* stripes, aligned to cache line */
+    size += CACHE_LINE;
+    size += sizeof(shmc_stripe_t) * attr->nstripes;
 
-    /* assoc */
-    size += sizeof(shmc_item_t *) * attr->nbuckets;
+    /* LRU list, the stripes end on a cache line */
+    size += sizeof(uint32_t) * lru_stride(slabs_count) * attr->nstripes;
+
+    /* assoc, aligned to cache line */
+    size += CACHE_LINE;
+    size += sizeof(shmc_bucket_t) * hash_area(attr) * hash_areas(attr);
 
     /* slabs */
     size += sizeof(shmc_slab_t) * slabs_count;
 
-    /* raw memory */
-    size += attr->mem_limit;
+    /* owner of each page */
+    size += attr->mem_limit_max / slab_page_size(attr);
+
+    /* dedup table */
+    size += sizeof(uint32_t);
+    size += sizeof(uint32_t) * dedup_nslots(attr);
+
+    /* admission sketch, aligned for its counters to be aged by words */
+    size += sizeof(uint64_t);
+    size += LFU_ROWS * lfu_width(attr);
+
+    /* namespaces */
+    size += sizeof(uint64_t);
+    size += sizeof(shmc_ns_t) * attr->nspaces;
+
+    /* raw memory, items are linked in offset units */
+    size += offset_unit(attr);
+    size += attr->mem_limit_max;
+
+    return size;
+}
+
+/* the mapping reserves room for mem_limit_max, the file only backs
+ * mem_limit of raw memory
+ */
+static size_t size_of_file(const shmc_attr_t *attr, const int slabs_count, size_t mem_limit)
+{
+    return size_of_mmap(attr, slabs_count) - (attr->mem_limit_max - mem_limit);
+}
 
+/* files on hugetlbfs are mapped in whole huge pages of f_bsize bytes */
+#define HUGETLBFS_MAGIC 0x958458f6
+
+static size_t mmap_round(int fd, size_t size)
+{
+    struct statfs fs;
+    if (fstatfs(fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC) {
+        size = (size + fs.f_bsize - 1) / fs.f_bsize * fs.f_bsize;
+    }
     return size;
 }
 
-static void format_mmap(shmc_t *shmc, void *raw, const int nbuckets, const int slabs_count)
+/* fault every page in now, so the first queries take no minor fault */
+static void mmap_prefault(void *raw, size_t size)
+{
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(raw, size, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    size_t off, psize = sysconf(_SC_PAGESIZE);
+    for (off = 0; off < size; off += psize) {
+        (void) ((volatile char *) raw)[off];
+    }
+}
+
+/* the first live bytes are backed by the file, the rest is touched
+ * only after the file grows
+ */
+static void *mmap_map(shmc_t *shmc, size_t size, size_t live, int hugepage, int prefault)
+{
+    void *raw = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmc->fd, 0);
+    if (raw == MAP_FAILED) return raw;
+
+#ifdef MADV_HUGEPAGE
+    /* shmem THP only takes the advice, hugetlbfs needs none */
+    if (hugepage) madvise(raw, size, MADV_HUGEPAGE);
+#endif
+
+    if (prefault == SHMC_PREFAULT_MLOCK) {
+        if (mlock(raw, live) == -1) {
+            munmap(raw, size);
+            return MAP_FAILED;
+        }
+    } else if (prefault == SHMC_PREFAULT_POPULATE) {
+        mmap_prefault(raw, live);
+    }
+
+    shmc->size = size;
+    return raw;
+}
+
+/* another process changed mem_limit, prefault what the file got since */
+static inline void mmap_follow(shmc_t *shmc)
+{
+    size_t resizes = __atomic_load_n(&shmc->attr->mem_resizes, __ATOMIC_ACQUIRE);
+    if (resizes == shmc->resizes) return;
+    shmc->resizes = resizes;
+
+    const shmc_attr_t *attr = shmc->attr;
+    size_t live = mmap_round(shmc->fd, size_of_file(attr, attr->slabs_count, attr->mem_limit));
+    if (attr->prefault == SHMC_PREFAULT_MLOCK) {
+        mlock((void *) shmc->version, live);
+    } else if (attr->prefault == SHMC_PREFAULT_POPULATE) {
+        mmap_prefault((void *) shmc->version, live);
+    }
+}
+
+/* hand the whole pages inside [p, p + len) back to the kernel, reading
+ * them later gets zeros
+ */
+static void mmap_release(void *p, size_t len)
+{
+    size_t psize = sysconf(_SC_PAGESIZE);
+    char *low  = align_ptr(p, psize);
+    char *high = (char *) ((uintptr_t) ((char *) p + len) & ~(psize - 1));
+    if (low < high) madvise(low, high - low, MADV_REMOVE);
+}
+
+static void format_mmap(shmc_t *shmc, void *raw, const int nbuckets, const int nstripes, const int slabs_count,
+        const size_t npages, const size_t ndedup, const size_t nsketch, const int nspaces, const int shift)
 {
+    shmc->shift = shift;
+
     /* version */
     shmc->version = raw;
 
     /* shmc attribute */
-    shmc->attr = (void *) shmc->version + sizeof(uint32_t);
+    shmc->attr = (void *) shmc->version + ALIGN_BYTES;
 
-    /* shmc rwlock */
-    shmc->lock  = (void *) shmc->attr + sizeof(shmc_attr_t);
-    shmc->mutex = (void *) shmc->lock + sizeof(pthread_rwlock_t);
+    /* slabs mutex */
+    shmc->mutex = align_ptr((void *) shmc->attr + sizeof(shmc_attr_t), CACHE_LINE);
+
+    /* stripes */
+    shmc->stripes = align_ptr((void *) shmc->mutex + sizeof(pthread_mutex_t), CACHE_LINE);
 
     /* LRU list */
-    shmc->heads = (void *) shmc->mutex + sizeof(pthread_mutex_t);
-    shmc->tails = (void *) shmc->heads + sizeof(shmc_item_t *) * slabs_count;
+    shmc->heads = (void *) shmc->stripes + sizeof(shmc_stripe_t) * nstripes;
+    shmc->tails = shmc->heads + slabs_count;
+    shmc->mags  = shmc->heads + 2 * slabs_count;
+    shmc->nmags = shmc->heads + 3 * slabs_count;
+    shmc->crawls = shmc->heads + 4 * slabs_count;
+    shmc->mids   = shmc->heads + 5 * slabs_count;
+    shmc->nprots = shmc->heads + 6 * slabs_count;
+    shmc->counts = shmc->heads + 7 * slabs_count;
 
     /* assoc */
-    shmc->buckets = (void *) shmc->tails + sizeof(shmc_item_t *) * slabs_count;
+    shmc->buckets = align_ptr(shmc->heads + lru_stride(slabs_count) * nstripes, CACHE_LINE);
 
     /* slabs */
-    shmc->slabs = (void *) shmc->buckets + sizeof(shmc_item_t *) * nbuckets;
+    shmc->slabs = (void *) shmc->buckets + sizeof(shmc_bucket_t) * nbuckets;
+
+    /* owner of each page */
+    shmc->pages = (void *) shmc->slabs + sizeof(shmc_slab_t) * slabs_count;
+
+    /* dedup table */
+    shmc->dedup = align_ptr((void *) shmc->pages + npages, sizeof(uint32_t));
+
+    /* admission sketch */
+    shmc->sketch = align_ptr(shmc->dedup + ndedup, sizeof(uint64_t));
+
+    /* namespaces */
+    shmc->spaces = align_ptr(shmc->sketch + nsketch, sizeof(uint64_t));
 
     /* raw memory */
-    shmc->raw = (void *) shmc->slabs + sizeof(shmc_slab_t) * slabs_count;
+    shmc->raw = align_ptr(shmc->spaces + nspaces, (size_t) 1 << shift);
 }
 
-#define ALIGN_BYTES 8
-#define align_size(size) (((size) % ALIGN_BYTES) ? \
-   (size) + ALIGN_BYTES - (size % ALIGN_BYTES) : (size))
-
 /* size   2       4       8       16
  * clsid  0       1       2       3
  * layout [x, 2), [2, 4), [4, 8), [8, 16)
@@ -152,19 +589,79 @@ static int item_clsid(const shmc_t *shmc, size_t nkey, size_t nval)
     return id;
 }
 
+/* the value can be rewritten in the item itself */
+static inline int item_fits(const shmc_t *shmc, const shmc_item_t *item, size_t nkey, size_t nval)
+{
+    return !(item->iflags & ITEM_CHAIN) && !item_needs_chain(shmc, nkey, nval) &&
+        item->clsid == item_clsid(shmc, nkey, nval);
+}
+
 static int count_of_slabs(const shmc_attr_t *attr)
 {
     size_t size = sizeof(shmc_item_t) + attr->item_size_min;
 
     int count = 0;
-    while (size < attr->item_size_max) {
-        size = align_size(size);
+    while (size < attr->slab_page_size) {
+        size = align_size(attr, size);
         size *= attr->item_size_factor;
         count++;
     }
     return count;
 }
 
+/* give page to slab id, the caller holds shmc->mutex. the items are
+ * handed out by bumping end_item, none of them is written here
+ */
+static void slab_carve(shmc_t *shmc, int id, size_t page)
+{
+    shmc_slab_t *slab = &shmc->slabs[id];
+    void *raw = shmc->raw + page * slab_page_size(shmc->attr);
+
+    shmc->pages[page] = id;
+    slab->pages++;
+
+    /* what is left of the last page goes to the free list */
+    while (slab->nend) {
+        shmc_item_t *item = R2A(shmc, slab->end_item, shmc_item_t);
+        item->clsid = id;
+        item->iflags = ITEM_FREE;
+        item->next = slab->free_item;
+        slab->free_item = slab->end_item;
+        slab->end_item += slab->size >> item_shift(shmc);
+        slab->nend--;
+    }
+
+    slab->end_item = A2R(shmc, raw);
+    slab->nend = slab->count;
+    slab->nfree += slab->count;
+}
+
+/* a free item of slab id, freed ones first, the caller holds shmc->mutex */
+static shmc_item_t *slab_take(shmc_t *shmc, int id)
+{
+    shmc_slab_t *slab = &shmc->slabs[id];
+    shmc_item_t *item = 0;
+
+    if (slab->free_item) {
+        item = R2A(shmc, slab->free_item, shmc_item_t);
+        slab->free_item = item->next;  /* both of them are R addr */
+    } else if (slab->nend) {
+        item = R2A(shmc, slab->end_item, shmc_item_t);
+        slab->end_item += slab->size >> item_shift(shmc);
+        slab->nend--;
+    } else {
+        return item;
+    }
+
+    /* a drain must not take it for free before the caller sets it up */
+    item->clsid  = id;
+    item->iflags = 0;
+
+    slab->nfree--;
+    shmc_debug("slabs[%02d] remove %u, next %u\n", id, A2R(shmc, item), slab->free_item);
+    return item;
+}
+
 static void format_slabs(shmc_t *shmc, const int slabs_count)
 {
     size_t size = sizeof(shmc_item_t) + shmc->attr->item_size_min;
@@ -172,27 +669,19 @@ static void format_slabs(shmc_t *shmc, const int slabs_count)
     shmc_slab_t *slabs = shmc->slabs;
     int id;
     for (id = 0; id < slabs_count; ++id) {
-        size = align_size(size);
+        size = align_size(shmc->attr, size);
         slabs[id].size = size;
-        slabs[id].count = shmc->attr->item_size_max / size;
-
-        size_t len = slabs[id].size * slabs[id].count;
+        slabs[id].count = slab_page_size(shmc->attr) / size;
 
         slabs[id].free_item = 0; 
-        void *raw = shmc->raw + shmc->attr->mem_used;
-        shmc->attr->mem_used += len;
-
-        assert(shmc->attr->mem_used < shmc->attr->mem_limit);
-
-        size_t i;
-        for (i = 0; i < slabs[id].count; ++i) {
-            shmc_item_t *item = raw;
-            item->next = slabs[id].free_item;
-            slabs[id].free_item = A2R(shmc, item);
-            raw += slabs[id].size;
-            shmc_debug("slabs[%02d] add    %p, next %p\n", id, slabs[id].free_item, item->next);
-        }
-
+        slabs[id].nfree = 0;
+        slabs[id].end_item = 0;
+        slabs[id].nend = 0;
+        slabs[id].pages = 0;
+        slabs[id].pressure = 0;
+        slabs[id].evicted = 0;
+
+        /* pages are given on the first alloc of the class */
         size *= shmc->attr->item_size_factor;
     }
 }
@@ -212,15 +701,18 @@ static SHMC_RC mmap_create(shmc_t *shmc, const char *token, const shmc_attr_t *a
     }
 
     const int slabs_count = count_of_slabs(attr);
-    size_t size = size_of_mmap(attr, slabs_count);
+    size_t size = mmap_round(shmc->fd, size_of_mmap(attr, slabs_count));
+    size_t live = mmap_round(shmc->fd, size_of_file(attr, slabs_count, attr->mem_limit));
 
-    /* truncate file to mmap size */
-    if (ftruncate(shmc->fd, size) == -1) return SHMC_SYSTEM;
+    /* truncate file to what mem_limit needs, it grows by shmc_resize */
+    if (ftruncate(shmc->fd, live) == -1) return SHMC_SYSTEM;
 
-    void *raw = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmc->fd, 0);
+    void *raw = mmap_map(shmc, size, live, attr->use_hugepage, attr->prefault);
     if (raw == MAP_FAILED) return SHMC_SYSTEM;
 
-    format_mmap(shmc, raw, attr->nbuckets, slabs_count);
+    format_mmap(shmc, raw, hash_area(attr) * hash_areas(attr), attr->nstripes, slabs_count,
+            attr->mem_limit_max / slab_page_size(attr), dedup_nslots(attr), LFU_ROWS * lfu_width(attr),
+            attr->nspaces, attr->offset_shift);
 
     *(shmc->version) = SHMC_VERSION;
     memcpy(shmc->attr, attr, sizeof(shmc_attr_t));
@@ -231,21 +723,38 @@ static SHMC_RC mmap_create(shmc_t *shmc, const char *token, const shmc_attr_t *a
     pthread_rwlockattr_t lock_attr;
     pthread_rwlockattr_init(&lock_attr); 
     pthread_rwlockattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
-    pthread_rwlock_init(shmc->lock, &lock_attr);
-    pthread_rwlockattr_destroy(&lock_attr);
 
     pthread_mutexattr_t mutex_attr;
     pthread_mutexattr_init(&mutex_attr);
     pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+
     pthread_mutex_init(shmc->mutex, &mutex_attr);
+
+    int i;
+    for (i = 0; i < attr->nstripes; ++i) {
+        pthread_rwlock_init(&shmc->stripes[i].lock, &lock_attr);
+        pthread_mutex_init(&shmc->stripes[i].mutex, &mutex_attr);
+        memset(&shmc->stripes[i].futex, 0x00, sizeof(shmc_futex_t));
+        shmc->stripes[i].seq = 0;
+        shmc->stripes[i].migrate = 0;
+        shmc->stripes[i].used = 0;
+        shmc->stripes[i].samples = 0;
+        shmc->stripes[i].hits = 0;
+        shmc->stripes[i].misses = 0;
+    }
+
+    pthread_rwlockattr_destroy(&lock_attr);
     pthread_mutexattr_destroy(&mutex_attr);
 
     /* LRU list */
-    memset(shmc->heads, 0x00, sizeof(shmc_item_t *) * shmc->attr->slabs_count);
-    memset(shmc->tails, 0x00, sizeof(shmc_item_t *) * shmc->attr->slabs_count);
+    memset(shmc->heads, 0x00, sizeof(uint32_t) * lru_stride(slabs_count) * attr->nstripes);
 
     /* assoc subsystem */
-    memset(shmc->buckets, 0x00, sizeof(shmc_item_t *) * shmc->attr->nbuckets);
+    memset(shmc->buckets, 0x00, sizeof(shmc_bucket_t) * shmc->attr->nbuckets);
+    memset(shmc->dedup, 0x00, sizeof(uint32_t) * dedup_nslots(attr));
+    memset(shmc->sketch, 0x00, LFU_ROWS * lfu_width(attr));
+    memset(shmc->spaces, 0x00, sizeof(shmc_ns_t) * attr->nspaces);
+    shmc->attr->hash_nbuckets = shmc->attr->nbuckets;
 
     /* slabs subsystem */
     format_slabs(shmc, slabs_count);
@@ -263,7 +772,7 @@ static SHMC_RC mmap_attach(shmc_t *shmc, const char *token)
     }
 
     /* first map get the attr */
-    size_t size = sizeof(uint32_t) + sizeof(shmc_attr_t);
+    size_t size = ALIGN_BYTES + sizeof(shmc_attr_t);
     void *raw = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmc->fd, 0);
     if (raw == MAP_FAILED) return SHMC_SYSTEM;
 
@@ -275,27 +784,50 @@ static SHMC_RC mmap_attach(shmc_t *shmc, const char *token)
     }
 
     /* get the mmap's size */
-    shmc->attr = raw + sizeof(uint32_t);
+    shmc->attr = raw + ALIGN_BYTES;
+    const int shift = shmc->attr->offset_shift;
+#ifdef SHMC_FAST
+    /* a fast lib takes only the ALIGN_BYTES unit */
+    if (shift != OFFSET_SHIFT) {
+        munmap(raw, size);
+        return SHMC_EVERSION;
+    }
+#endif
     const int slabs_count = count_of_slabs(shmc->attr);
-    const int nbuckets = shmc->attr->nbuckets;
-    size_t total_size = size_of_mmap(shmc->attr, slabs_count);
+    const int nbuckets = hash_area(shmc->attr) * hash_areas(shmc->attr);
+    const int nstripes = shmc->attr->nstripes;
+    const size_t npages = shmc->attr->mem_limit_max / slab_page_size(shmc->attr);
+    const int hugepage = shmc->attr->use_hugepage;
+    const int prefault = shmc->attr->prefault;
+    const size_t ndedup = dedup_nslots(shmc->attr);
+    const size_t nsketch = LFU_ROWS * lfu_width(shmc->attr);
+    const int nspaces = shmc->attr->nspaces;
+    size_t total_size = mmap_round(shmc->fd, size_of_mmap(shmc->attr, slabs_count));
+    size_t live = mmap_round(shmc->fd, size_of_file(shmc->attr, slabs_count, shmc->attr->mem_limit));
 
     /* munmap */
     munmap(raw, size);
 
-    /* remmap the total space */
-    raw = mmap(0, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, shmc->fd, 0);
+    /* remmap the total space, every process follows the creator's
+     * huge page and prefault setting
+     */
+    raw = mmap_map(shmc, total_size, live, hugepage, prefault);
     if (raw == MAP_FAILED) return SHMC_SYSTEM;
 
-    format_mmap(shmc, raw, nbuckets, slabs_count); 
+    format_mmap(shmc, raw, nbuckets, nstripes, slabs_count, npages, ndedup, nsketch, nspaces, shift);
+    shmc->resizes = shmc->attr->mem_resizes;
 
     return SHMC_OK;
 }
 
 SHMC_RC shmc_init(const char *token, shmc_attr_t *attr, shmc_t **shmc)
 {
-    *shmc = malloc(sizeof(shmc_t));
+    static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+    pthread_once(&atfork_once, futex_atfork);
+
+    *shmc = calloc(1, sizeof(shmc_t));
     if (!*shmc) return SHMC_SYSTEM;
+    (*shmc)->fd = -1;
 
     /* init runtime attr, fix invalid attr */
     if (attr) {
@@ -303,10 +835,78 @@ SHMC_RC shmc_init(const char *token, shmc_attr_t *attr, shmc_t **shmc)
         attr->slabs_count = 0;
         attr->max_depth = 0;
         attr->nitems = 0;
+        attr->hash_nbuckets = 0;
+        attr->hash_old_nbuckets = 0;
+        attr->hash_table = 0;
+        attr->hash_pending = 0;
+        attr->hash_resizes = 0;
+        attr->slabs_starving = 0;
+        attr->slabs_moved = 0;
+        attr->mem_resizes = 0;
+        attr->pages_free = 0;
+        attr->dedup_values = 0;
+        attr->dedup_dead = 0;
+        attr->reclaimed = 0;
+        attr->lfu_rejected = 0;
+        attr->lfu_aged = 0;
+        attr->evicted_ahead = 0;
+        attr->flush = 0;
+        attr->ns_open = 0;
+        attr->offset_shift = OFFSET_SHIFT;
+
+        if (attr->mem_limit_max < attr->mem_limit) attr->mem_limit_max = attr->mem_limit;
 
         if (attr->item_size_factor <= 1.5) {
             attr->item_size_factor = 1.5; 
         }
+
+        if (attr->load_factor <= 0) attr->load_factor = 0.75;
+
+        if (attr->slab_page_size == 0) attr->slab_page_size = 1024 * 1024;
+
+        if (attr->dedup_slots < 1) attr->dedup_min = 0;
+
+        if (attr->free_watermark < 0 || attr->free_watermark > 100) attr->free_watermark = 0;
+
+        if (attr->evict_policy < SHMC_EVICT_LRU || attr->evict_policy > SHMC_EVICT_SAMPLED) {
+            attr->evict_policy = SHMC_EVICT_LRU;
+        }
+
+        if (attr->prefault < SHMC_PREFAULT_NONE || attr->prefault > SHMC_PREFAULT_MLOCK) {
+            attr->prefault = SHMC_PREFAULT_NONE;
+        }
+
+        /* a namespace has stripes of its own, a bucket belongs to one
+         * stripe only
+         */
+        if (attr->nspaces < 1) attr->nspaces = 1;
+        if (attr->nstripes < 1) attr->nstripes = 1;
+        if (attr->nstripes % attr->nspaces) {
+            attr->nstripes += attr->nspaces - attr->nstripes % attr->nspaces;
+        }
+        if (attr->nbuckets % attr->nstripes) {
+            attr->nbuckets += attr->nstripes - attr->nbuckets % attr->nstripes;
+        }
+
+        /* items link by 32 bit offsets, a mapping they do not cover
+         * takes a larger unit. pages are whole units and hold one item of
+         * the smallest class at least, items keep clsid in a byte
+         */
+        int slabs_count;
+        for (;;) {
+            attr->slab_page_size -= attr->slab_page_size % offset_unit(attr);
+            slabs_count = count_of_slabs(attr);
+            if (slabs_count > UINT8_MAX || attr->slab_page_size < sizeof(shmc_item_t) + attr->item_size_min) {
+                free(*shmc);
+                return SHMC_ESIZE;
+            }
+            if (size_of_mmap(attr, slabs_count) <= mmap_max(attr)) break;
+#ifdef SHMC_FAST
+            free(*shmc);
+            return SHMC_ESIZE;
+#endif
+            attr->offset_shift++;
+        }
     }
 
     SHMC_RC rc;
@@ -330,9 +930,7 @@ destroy:
 
 void shmc_destroy(shmc_t *shmc)
 {
-    shmc_wrlock(shmc);
-    size_t size = size_of_mmap(shmc->attr, shmc->attr->slabs_count);
-    shmc_unlock(shmc);
+    size_t size = shmc->size;
 
     /* never destroy pthread lock
      * pthread_rwlock_destroy(shmc->lock);
@@ -360,167 +958,810 @@ const char *shmc_error(SHMC_RC rc)
         case SHMC_ECREATE: error = "shmc already created"; break;
         case SHMC_EVERSION: error = "shmc version conflict"; break;
         case SHMC_SYSTEM: error = strerror(errno); break;
+        case SHMC_EABORT: error = "batch aborted, op not applied"; break;
         default: error = "unknow shmc error"; break;
     }
     return error;
 }
 
-SHMC_RC shmc_get_nolock(shmc_t *shmc, const char *key, size_t nkey, char **val, size_t *nval, uint32_t *flags)
+static inline uint8_t tag_of(uint32_t hv)
 {
-    shmc_item_t *item = assoc_find(shmc, key, nkey);
-    if (!item) return SHMC_NOTFOUND;
-
-    pthread_mutex_lock(shmc->mutex);
-    item_relink(shmc, item);
-    pthread_mutex_unlock(shmc->mutex);
+    uint8_t tag = hv >> 24;
+    return tag ? tag : 1;
+}
 
-    *val = malloc(item->nval);
-    if (*val) {
-        memcpy(*val, R2A(shmc, item->val, char), item->nval);
-        *nval = item->nval;
-        if (flags) *flags = item->flags;
-        return SHMC_OK;
-    } else {
-        return SHMC_SYSTEM;
+/* bit i is set if slot i may hold the tag */
+static inline unsigned bucket_match(const shmc_bucket_t *bucket, uint8_t tag)
+{
+#ifdef __SSE2__
+    __m128i tags = _mm_load_si128((const __m128i *) bucket->tags);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8(tag)));
+#else
+    unsigned mask = 0;
+    int i;
+    for (i = 0; i < BUCKET_SLOTS; ++i) {
+        if (bucket->tags[i] == tag) mask |= 1U << i;
     }
+#endif
+    return mask & ((1U << BUCKET_SLOTS) - 1);
 }
 
-SHMC_RC shmc_getf_nolock(shmc_t *shmc, const char *key, size_t nkey, char *val, size_t *nval, uint32_t *flags)
+/* while migrating, old buckets not reached by the cursor of their stripe
+ * are still in the old index
+ */
+static shmc_bucket_t *assoc_bucket(const shmc_t *shmc, uint32_t hv)
 {
-    shmc_item_t *item = assoc_find(shmc, key, nkey);
-    if (!item) return SHMC_NOTFOUND;
-
-    pthread_mutex_lock(shmc->mutex);
-    item_relink(shmc, item);
-    pthread_mutex_unlock(shmc->mutex);
-
-    if (*nval >= item->nval) {
-        memcpy(val, R2A(shmc, item->val, char), item->nval); 
-        *nval = item->nval;
-        if (flags) *flags = item->flags;
-        return SHMC_OK;
-    } else {
-        return SHMC_ESPACE;
+    const shmc_attr_t *attr = shmc->attr;
+    int table = attr->hash_table;
+    int old = attr->hash_old_nbuckets;
+
+    if (old) {
+        uint32_t ob = hv % old;
+        if (ob >= shmc->stripes[stripe_of(shmc, hv)].migrate) {
+            return HASH_TABLE(shmc, !table) + ob;
+        }
     }
+    return HASH_TABLE(shmc, table) + hv % attr->hash_nbuckets;
 }
 
-SHMC_RC shmc_set_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags)
+/* lock free lookup, 1 if item holds key, 0 if not, -1 if item is not an
+ * item at all. it is checked to be inside the slabs before it is touched,
+ * a torn read is caught by seq_read_retry later
+ */
+static int item_match_lockfree(shmc_t *shmc, shmc_item_t *item, const char *key, size_t nkey, uint32_t hv)
 {
-    if (!item_size_ok(shmc, nkey, nval)) return SHMC_ESIZE;
-
-    /* delete first */
-    shmc_del_nolock(shmc, key, nkey);
+    const void *low  = shmc->raw;
+    const void *high = shmc->raw + shmc->attr->mem_limit;
 
-    shmc_item_t *item = item_alloc(shmc, nkey, nval);
-    if (!item) return SHMC_NOMEMORY;
+    if ((void *) item < low || (void *) (item + 1) > high) return -1;
 
-    assoc_insert(shmc, key, nkey, item);
-    item_link(shmc, item);
+    int clsid = item->clsid;
+    size_t n = item->nkey;
+    if (clsid >= shmc->attr->slabs_count) return -1;
+    if (sizeof(shmc_item_t) + n > shmc->slabs[clsid].size) return -1;
 
-    item->flags = flags;
-    memcpy(R2A(shmc, item->key, char), key, nkey);
-    memcpy(R2A(shmc, item->val, char), val, nval);
-
-    return SHMC_OK;
+    return item->hv == hv && n == nkey && memcmp(key, item_key(item), nkey) == 0;
 }
 
-SHMC_RC shmc_add_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags)
+static shmc_item_t *assoc_find_lockfree(shmc_t *shmc, const char *key, size_t nkey, uint32_t hv)
 {
-    shmc_item_t *item = assoc_find(shmc, key, nkey);
-    if (item) return SHMC_EXIST;
+    size_t depth = shmc->attr->mem_limit / shmc->slabs[0].size;
+    shmc_bucket_t *bucket = assoc_bucket(shmc, hv);
+    shmc_item_t *item;
+
+    unsigned mask = bucket_match(bucket, tag_of(hv));
+    while (mask) {
+        item = R2A(shmc, bucket->items[__builtin_ctz(mask)], shmc_item_t);
+        mask &= mask - 1;
+        if (item && item_match_lockfree(shmc, item, key, nkey, hv) == 1) return item;
+    }
 
-    return shmc_set_nolock(shmc, key, nkey, val, nval, flags);
+    item = R2A(shmc, bucket->overflow, shmc_item_t);
+    while (item && depth--) {
+        int match = item_match_lockfree(shmc, item, key, nkey, hv);
+        if (match == 1) return item;
+        if (match == -1) return 0;
+        item = R2A(shmc, item->h_next, shmc_item_t);
+    }
+    return 0;
 }
 
-SHMC_RC shmc_replace_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags)
+/* 0 if the n bytes of the value are copied to buf, -1 if a link or size
+ * is off, the item changed under us
+ */
+static int item_read_lockfree(shmc_t *shmc, shmc_item_t *item, size_t nkey, char *buf, size_t n)
 {
-    shmc_item_t *item = assoc_find(shmc, key, nkey);
-    if (!item) return SHMC_NOTFOUND;
-
-    if (item->clsid == item_clsid(shmc, nkey, nval)) {
-        item_relink(shmc, item);
-        item->flags = flags;
-        memcpy(R2A(shmc, item->val, char), val, nval);
-        item->nval = nval;
-        return SHMC_OK;
+    const char *high = (char *) shmc->raw + shmc->attr->mem_limit;
+
+    int clsid = item->clsid;
+    size_t size = shmc->slabs[clsid].size;  /* clsid is checked by item_match_lockfree */
+    if (!(item->iflags & ITEM_CHAIN)) {
+        if (sizeof(shmc_item_t) + nkey + n > size) return -1;
+        memcpy(buf, item_key(item) + nkey, n);
+        return 0;
     }
 
-    assoc_delete(shmc, key, nkey);
-    item_unlink(shmc, item);
-    item_free(shmc, item);
+    if (sizeof(shmc_item_t) + nkey + sizeof(uint32_t) > size) return -1;
+    size_t len = size - sizeof(shmc_item_t) - nkey - sizeof(uint32_t);
+    if (len > n) len = n;
 
-    return shmc_set_nolock(shmc, key, nkey, val, nval, flags);
-}
+    uint32_t next;
+    memcpy(&next, item_key(item) + nkey, sizeof(uint32_t));
+    memcpy(buf, item_key(item) + nkey + sizeof(uint32_t), len);
 
-SHMC_RC shmc_prepend_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags)
-{
-    shmc_item_t *item = assoc_find(shmc, key, nkey);
-    if (!item) return SHMC_NOTFOUND;
+    for (buf += len, n -= len; n; buf += len, n -= len) {
+        shmc_item_t *chunk = R2A(shmc, next, shmc_item_t);
+        if ((void *) chunk < shmc->raw || (char *) (chunk + 1) > high) return -1;
 
-    if (item->clsid == item_clsid(shmc, nkey, (nval + item->nval))) {
-        item_relink(shmc, item);
-        item->flags = flags;
-        memmove(R2A(shmc, item->val, char) + nval, R2A(shmc, item->val, char), item->nval);
-        memcpy(R2A(shmc, item->val, char), val, nval);
-        item->nval += nval;
-        return SHMC_OK;
+        clsid = chunk->clsid;
+        len = chunk->nval;
+        if (clsid >= shmc->attr->slabs_count || len == 0 ||
+                sizeof(shmc_item_t) + len > shmc->slabs[clsid].size) return -1;
+        if (len > n) len = n;
+
+        memcpy(buf, chunk->end, len);
+        next = chunk->h_next;
     }
+    return 0;
+}
 
-    if (!item_size_ok(shmc, nkey, nval + item->nval)) return SHMC_ESIZE;
+/* the shared value of a deduped item, 0 if a link is off */
+static shmc_item_t *dedup_body_lockfree(shmc_t *shmc, shmc_item_t *item, size_t nkey)
+{
+    const void *low  = shmc->raw;
+    const void *high = shmc->raw + shmc->attr->mem_limit;
 
-    shmc_item_t *item_new = item_alloc(shmc, nkey, nval + item->nval);
-    if (!item_new) return SHMC_NOMEMORY;
+    uint32_t slot;
+    if (item_read_lockfree(shmc, item, nkey, (char *) &slot, sizeof(uint32_t)) != 0) return 0;
+    if (slot >= dedup_nslots(shmc->attr)) return 0;
 
-    assoc_delete(shmc, key, nkey);
-    item_unlink(shmc, item);
+    shmc_item_t *body = R2A(shmc, shmc->dedup[slot], shmc_item_t);
+    if ((void *) body < low || (void *) (body + 1) > high) return 0;
+    if (!(body->iflags & ITEM_SHARED) || body->clsid >= shmc->attr->slabs_count) return 0;
+    return body;
+}
 
-    assoc_insert(shmc, key, nkey, item_new);
-    item_link(shmc, item_new);
+/* copy the value to val if it fits, *nval is set to the value size */
+static SHMC_RC get_lockfree(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, char *val, size_t *nval, uint32_t *flags)
+{
+    int stripe = stripe_of(shmc, hv);
+    char *lz = 0;
+    size_t nlz = 0;
+
+    int retry;
+    for (retry = 0; retry < SEQ_RETRY; ++retry) {
+        uint32_t seq = seq_read_begin(shmc, stripe);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
 
-    item->flags = flags;
-    memcpy(R2A(shmc, item_new->key, char), key, nkey);
-    memcpy(R2A(shmc, item_new->val, char), val, nval);
-    memcpy(R2A(shmc, item_new->val, char) + nval, R2A(shmc, item->val, char), item->nval);
+        SHMC_RC rc = SHMC_NOTFOUND;
+        size_t n = 0, packed = 0;
+        uint32_t f = 0;
+
+        shmc_item_t *item = assoc_find_lockfree(shmc, key, nkey, hv);
+        if (item && item_expired(shmc, item, clock_now())) item = 0;
+        shmc_item_t *body = item;
+        size_t nbody = nkey;
+        if (item && (item->iflags & ITEM_DEDUP)) {
+            body = dedup_body_lockfree(shmc, item, nkey);
+            nbody = 0;
+            if (!body) continue;
+        }
 
-    item_free(shmc, item);
+        if (body && (body->iflags & ITEM_LZ)) {
+            /* the stream is copied out, and unpacked once it is known good */
+            packed = val ? body->nval : sizeof(uint32_t);
+            f = item->flags;
+            if (packed < sizeof(uint32_t) || packed > shmc->attr->item_size_max) continue;
+            if (packed > nlz) {
+                free(lz);
+                if (!(lz = malloc(packed))) return SHMC_SYSTEM;
+                nlz = packed;
+            }
+            if (item_read_lockfree(shmc, body, nbody, lz, packed) != 0) continue;
+        } else if (body) {
+            n = body->nval;
+            f = item->flags;
+            if (val && *nval >= n) {
+                if (item_read_lockfree(shmc, body, nbody, val, n) != 0) continue;
+                rc = SHMC_OK;
+            } else {
+                rc = SHMC_ESPACE;
+            }
+        }
 
-    return SHMC_OK;
-}
+        if (seq_read_retry(shmc, stripe, seq)) continue;
+
+        if (packed) {
+            uint32_t size;
+            memcpy(&size, lz, sizeof(uint32_t));
+            n = size;
+            if (val && *nval >= n) {
+                size_t m = lz_decompress(lz + sizeof(uint32_t), packed - sizeof(uint32_t), val, n);
+                rc = m == n ? SHMC_OK : SHMC_SYSTEM;
+            } else {
+                rc = SHMC_ESPACE;
+            }
+            free(lz);
+        }
 
-SHMC_RC shmc_append_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags)
+        /* the item may be gone now, a stray reference bit is harmless */
+        if (item && shmc->attr->evict_policy == SHMC_EVICT_CLOCK) {
+            item_hit(shmc, stripe, item);
+        }
+
+        if (rc != SHMC_NOTFOUND) {
+            *nval = n;
+            if (flags) *flags = f;
+        }
+        return rc;
+    }
+
+    free(lz);
+
+    /* writers keep coming, wait for them like a locked reader */
+    shmc_rdlock_key(shmc, key, nkey);
+    shmc_item_t *item = assoc_find(shmc, key, nkey, hv);
+    SHMC_RC rc = SHMC_NOTFOUND;
+    if (item) {
+        size_t n = item_nval(shmc, item);
+        if (val && *nval >= n) {
+            rc = item_value(shmc, item, val, n) == 0 ? SHMC_OK : SHMC_SYSTEM;
+        } else {
+            rc = SHMC_ESPACE;
+        }
+        *nval = n;
+        if (flags) *flags = item->flags;
+    }
+    shmc_unlock_stripe(shmc, stripe);
+    return rc;
+}
+
+int shmc_ns_of(const shmc_t *shmc, const char *key, size_t nkey)
+{
+    int open = __atomic_load_n(&shmc->attr->ns_open, __ATOMIC_ACQUIRE);
+    if (!open) return 0;
+
+    const char *sep = memchr(key, SHMC_NS_SEP, nkey < SHMC_NS_NAME ? nkey : SHMC_NS_NAME);
+    if (!sep) return 0;
+
+    size_t n = sep - key;
+    int i;
+    for (i = 1; i <= open; ++i) {
+        const char *name = shmc->spaces[i].name;
+        if (memcmp(name, key, n) == 0 && name[n] == '\0') return i;
+    }
+    return 0;
+}
+
+/* hv moved into the stripes of namespace ns, the high bits the bucket
+ * tags are cut from stay
+ */
+static uint32_t ns_hash(const shmc_attr_t *attr, uint32_t hv, int ns)
+{
+    if (attr->nspaces == 1) return hv;
+
+    uint32_t n = attr->nstripes, k = ns_stripes(attr);
+    uint64_t moved = (uint64_t) hv - hv % n + (uint64_t) ns * k + hv % k;
+    return moved > UINT32_MAX ? moved - n : moved;
+}
+
+static uint32_t key_hash(const shmc_t *shmc, const char *key, size_t nkey)
+{
+    return ns_hash(shmc->attr, hash(key, nkey, 0), shmc_ns_of(shmc, key, nkey));
+}
+
+/* count a lookup in the hit stats and in the admission sketch */
+static inline SHMC_RC lookup_count(shmc_t *shmc, uint32_t hv, SHMC_RC rc)
+{
+    if (shmc->attr->use_hit_stats) {
+        shmc_stripe_t *stripe = &shmc->stripes[stripe_of(shmc, hv)];
+        if (rc != SHMC_NOTFOUND) __atomic_add_fetch(&stripe->hits, 1, __ATOMIC_RELAXED);
+        else __atomic_add_fetch(&stripe->misses, 1, __ATOMIC_RELAXED);
+    }
+
+    if (shmc->attr->use_tinylfu) lfu_record(shmc, hv);
+    return rc;
+}
+
+SHMC_RC shmc_get_nolock(shmc_t *shmc, const char *key, size_t nkey, char **val, size_t *nval, uint32_t *flags)
 {
-    shmc_item_t *item = assoc_find(shmc, key, nkey);
+    uint32_t hv = key_hash(shmc, key, nkey);
+    return lookup_count(shmc, hv, do_get(shmc, hv, key, nkey, val, nval, flags));
+}
+
+static SHMC_RC do_get(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, char **val, size_t *nval, uint32_t *flags)
+{
+    if (shmc->attr->seqlock_read) {
+        size_t n = 0;
+        SHMC_RC rc = get_lockfree(shmc, hv, key, nkey, 0, &n, flags);
+        while (rc == SHMC_ESPACE) {
+            /* the value may grow between two tries */
+            size_t size = n;
+            *val = malloc(size ? size : 1);
+            if (!*val) return SHMC_SYSTEM;
+            rc = get_lockfree(shmc, hv, key, nkey, *val, &n, flags);
+            if (rc == SHMC_OK) {
+                *nval = n;
+            } else {
+                free(*val);
+            }
+        }
+        return rc;
+    }
+
+    shmc_item_t *item = assoc_find(shmc, key, nkey, hv);
     if (!item) return SHMC_NOTFOUND;
 
-    if (item->clsid == item_clsid(shmc, nkey, (nval + item->nval))) {
-        item_relink(shmc, item);
-        item->flags = flags;
-        memcpy(R2A(shmc, item->val, char) + item->nval, val, nval);
-        item->nval += nval;
+    item_hit(shmc, stripe_of(shmc, hv), item);
+
+    size_t n = item_nval(shmc, item);
+    *val = malloc(n);
+    if (*val && item_value(shmc, item, *val, n) == 0) {
+        *nval = n;
+        if (flags) *flags = item->flags;
+        return SHMC_OK;
+    } else {
+        free(*val);
+        return SHMC_SYSTEM;
+    }
+}
+
+static SHMC_RC do_getf(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, char *val, size_t *nval, uint32_t *flags)
+{
+    if (shmc->attr->seqlock_read) {
+        size_t n = *nval;
+        SHMC_RC rc = get_lockfree(shmc, hv, key, nkey, val, &n, flags);
+        if (rc != SHMC_NOTFOUND) *nval = n;
+        return rc;
+    }
+
+    shmc_item_t *item = assoc_find(shmc, key, nkey, hv);
+    if (!item) return SHMC_NOTFOUND;
+
+    item_hit(shmc, stripe_of(shmc, hv), item);
+
+    size_t n = item_nval(shmc, item);
+    if (*nval >= n) {
+        if (item_value(shmc, item, val, n) != 0) return SHMC_SYSTEM;
+        *nval = n;
+        if (flags) *flags = item->flags;
         return SHMC_OK;
+    } else {
+        *nval = n;
+        return SHMC_ESPACE;
     }
+}
 
-    if (!item_size_ok(shmc, nkey, nval + item->nval)) return SHMC_ESIZE;
+SHMC_RC shmc_getf_nolock(shmc_t *shmc, const char *key, size_t nkey, char *val, size_t *nval, uint32_t *flags)
+{
+    uint32_t hv = key_hash(shmc, key, nkey);
+    return lookup_count(shmc, hv, do_getf(shmc, hv, key, nkey, val, nval, flags));
+}
+
+/* keys are looked up MGET_BATCH at a time, hash all of them and prefetch
+ * the buckets, then prefetch the items whose tag matches, so the cache misses of
+ * different keys overlap, then walk the chains
+ */
+#define MGET_BATCH 16
+
+SHMC_RC shmc_mget_nolock(shmc_t *shmc, size_t n, const char **keys, const size_t *nkeys,
+        char **vals, size_t *nvals, uint32_t *flags, SHMC_RC *rcs)
+{
+    uint32_t hv[MGET_BATCH];
+    size_t i, j, m;
+
+    for (i = 0; i < n; i += m) {
+        m = (n - i < MGET_BATCH) ? n - i : MGET_BATCH;
+
+        for (j = 0; j < m; ++j) {
+            hv[j] = key_hash(shmc, keys[i + j], nkeys[i + j]);
+            __builtin_prefetch(assoc_bucket(shmc, hv[j]));
+        }
+
+        for (j = 0; j < m; ++j) {
+            /* a stale slot is fine, prefetch never faults */
+            shmc_bucket_t *bucket = assoc_bucket(shmc, hv[j]);
+            unsigned mask = bucket_match(bucket, tag_of(hv[j]));
+            while (mask) {
+                __builtin_prefetch(R2A(shmc, bucket->items[__builtin_ctz(mask)], shmc_item_t));
+                mask &= mask - 1;
+            }
+        }
+
+        for (j = 0; j < m; ++j) {
+            rcs[i + j] = lookup_count(shmc, hv[j], do_get(shmc, hv[j], keys[i + j], nkeys[i + j],
+                    &vals[i + j], &nvals[i + j], flags ? &flags[i + j] : 0));
+        }
+    }
+    return SHMC_OK;
+}
+
+/* the keys of a batch are looked up a stripe at a time, each stripe is
+ * read locked once for all its keys, writers of the others go on. the
+ * keys are hashed again if a namespace was named meanwhile, as
+ * stripe_lock_key does
+ */
+SHMC_RC shmc_mget(shmc_t *shmc, size_t n, const char **keys, const size_t *nkeys,
+                  char **vals, size_t *nvals, uint32_t *flags, SHMC_RC *rcs)
+{
+    if (shmc_lockfree(shmc)) return shmc_mget_nolock(shmc, n, keys, nkeys, vals, nvals, flags, rcs);
+
+    uint32_t hv[MGET_BATCH];
+    int left[MGET_BATCH];
+    size_t i, j, k, m;
+
+    for (i = 0; i < n; i += m) {
+        m = (n - i < MGET_BATCH) ? n - i : MGET_BATCH;
+
+        int open = __atomic_load_n(&shmc->attr->ns_open, __ATOMIC_ACQUIRE);
+        for (j = 0; j < m; ++j) {
+            hv[j] = key_hash(shmc, keys[i + j], nkeys[i + j]);
+            left[j] = 1;
+            __builtin_prefetch(assoc_bucket(shmc, hv[j]));
+        }
+
+        for (j = 0; j < m; ++j) {
+            if (!left[j]) continue;
+
+            int stripe = stripe_of(shmc, hv[j]);
+            stripe_rdlock(shmc, stripe);
+            int now = __atomic_load_n(&shmc->attr->ns_open, __ATOMIC_ACQUIRE);
+            if (now != open) {
+                stripe_unlock(shmc, stripe);
+                open = now;
+                for (k = j; k < m; ++k) {
+                    if (left[k]) hv[k] = key_hash(shmc, keys[i + k], nkeys[i + k]);
+                }
+                j--;
+                continue;
+            }
+            mmap_follow(shmc);
+
+            for (k = j; k < m; ++k) {
+                if (!left[k] || (int) stripe_of(shmc, hv[k]) != stripe) continue;
+                rcs[i + k] = lookup_count(shmc, hv[k], do_get(shmc, hv[k], keys[i + k], nkeys[i + k],
+                        &vals[i + k], &nvals[i + k], flags ? &flags[i + k] : 0));
+                left[k] = 0;
+            }
+            stripe_unlock(shmc, stripe);
+        }
+    }
+    return SHMC_OK;
+}
+
+SHMC_RC shmc_get_visit_nolock(shmc_t *shmc, const char *key, size_t nkey, shmc_visit_t visit, void *ctx)
+{
+    uint32_t hv = key_hash(shmc, key, nkey);
+    shmc_item_t *item = assoc_find(shmc, key, nkey, hv);
+    if (lookup_count(shmc, hv, item ? SHMC_OK : SHMC_NOTFOUND) == SHMC_NOTFOUND) return SHMC_NOTFOUND;
+
+    /* a chained value is not in one piece */
+    shmc_item_t *body = item_body(shmc, item);
+    if ((body->iflags & (ITEM_CHAIN | ITEM_LZ)) == ITEM_CHAIN) return SHMC_ESIZE;
+
+    item_hit(shmc, stripe_of(shmc, hv), item);
+
+    if (body->iflags & ITEM_LZ) {
+        size_t n = item_nval(shmc, item);
+        char *buf = malloc(n);
+        if (!buf || item_value(shmc, item, buf, n) != 0) {
+            free(buf);
+            return SHMC_SYSTEM;
+        }
+        visit(buf, n, item->flags, ctx);
+        free(buf);
+        return SHMC_OK;
+    }
+
+    visit(item_val(body), body->nval, item->flags, ctx);
+    return SHMC_OK;
+}
+
+SHMC_RC shmc_get_ref_nolock(shmc_t *shmc, const char *key, size_t nkey, shmc_ref_t *ref)
+{
+    uint32_t hv = key_hash(shmc, key, nkey);
+    shmc_item_t *item = assoc_find(shmc, key, nkey, hv);
+    if (lookup_count(shmc, hv, item ? SHMC_OK : SHMC_NOTFOUND) == SHMC_NOTFOUND) return SHMC_NOTFOUND;
+
+    shmc_item_t *body = item_body(shmc, item);
+    if (body->iflags & (ITEM_CHAIN | ITEM_LZ)) return SHMC_ESIZE;
+
+    item_hit(shmc, stripe_of(shmc, hv), item);
+
+    ref->val   = item_val(body);
+    ref->nval  = body->nval;
+    ref->flags = item->flags;
+    return SHMC_OK;
+}
+
+SHMC_RC shmc_set_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags)
+{
+    return shmc_set_exp_nolock(shmc, key, nkey, val, nval, flags, 0);
+}
+
+SHMC_RC shmc_set_exp_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval,
+        uint32_t flags, uint32_t exptime)
+{
+    uint32_t hv = key_hash(shmc, key, nkey);
+    int stripe = stripe_of(shmc, hv);
+
+    seq_write_begin(shmc, stripe);
+    slab_automove(shmc, stripe);
+    SHMC_RC rc = do_set(shmc, hv, key, nkey, val, nval, flags, exptime_of(exptime));
+    seq_write_end(shmc, stripe);
+    return rc;
+}
+
+static SHMC_RC do_set(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, const char *val, size_t nval,
+        uint32_t flags, uint32_t exptime)
+{
+    shmc_bucket_t *bucket = assoc_bucket(shmc, hv);
+    return do_store(shmc, hv, bucket, assoc_ref_live(shmc, bucket, key, nkey, hv), key, nkey, val, nval,
+            flags, exptime);
+}
+
+/* ref is the link to the old item of key, found by the caller, or 0.
+ * exptime is absolute here
+ */
+static SHMC_RC do_store(shmc_t *shmc, uint32_t hv, shmc_bucket_t *bucket, uint32_t *ref,
+        const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags, uint32_t exptime)
+{
+    if (!item_size_ok(shmc, nkey, nval)) return SHMC_ESIZE;
+
+    char *lz;
+    size_t nlz = val_pack(shmc, val, nval, &lz);
+    SHMC_RC rc = store_packed(shmc, hv, bucket, ref, key, nkey, val, nval, lz, nlz, flags, exptime, 1);
+    free(lz);
+    return rc;
+}
+
+/* do_store of a value val_pack has packed to lz already, nlz is 0 if it
+ * is stored as it is. a new key gets through TinyLFU only if admit
+ */
+static SHMC_RC store_packed(shmc_t *shmc, uint32_t hv, shmc_bucket_t *bucket, uint32_t *ref,
+        const char *key, size_t nkey, const char *val, size_t nval, const char *lz, size_t nlz,
+        uint32_t flags, uint32_t exptime, int admit)
+{
+    if (shmc->attr->use_tinylfu) lfu_record(shmc, hv);
+
+    int stripe = stripe_of(shmc, hv);
+    shmc_item_t *item = ref ? R2A(shmc, *ref, shmc_item_t) : 0;
 
-    shmc_item_t *item_new = item_alloc(shmc, nkey, nval + item->nval);
-    if (!item_new) return SHMC_NOMEMORY;
+    int dedup = dedup_ok(shmc, nval, nlz ? nlz : nval);
+    if (nlz) {
+        val  = lz;
+        nval = nlz;
+    }
+
+    /* same slab class, overwrite in place */
+    if (item && !dedup && !(item->iflags & ITEM_DEDUP) && item_fits(shmc, item, nkey, nval)) {
+        item_relink(shmc, stripe, item);
+        item->flags = flags;
+        item->exptime = exptime;
+        item->iflags = nlz ? (item->iflags | ITEM_LZ) : (item->iflags & ~ITEM_LZ);
+        memcpy(item_val(item), val, nval);
+        item->nval = nval;
+        return SHMC_OK;
+    }
+
+    /* delete first, the new item may reuse the memory */
+    if (item) {
+        assoc_unlink(shmc, bucket, ref);
+        item_unlink(shmc, stripe, item);
+        item_free(shmc, stripe, item);
+    }
 
-    assoc_delete(shmc, key, nkey);
-    item_unlink(shmc, item);
+    /* the item keeps the slot of a shared value instead */
+    uint32_t slot = 0;
+    long shared = dedup ? dedup_get(shmc, stripe, val, nval, nlz != 0) : -1;
+    if (shared >= 0) {
+        slot = shared;
+        val  = (const char *) &slot;
+        nval = sizeof(uint32_t);
+    }
 
-    assoc_insert(shmc, key, nkey, item_new);
-    item_link(shmc, item_new);
+    if (!ref && admit && shmc->attr->use_tinylfu && !item_needs_chain(shmc, nkey, nval) &&
+            !lfu_admit(shmc, stripe, hv, item_clsid(shmc, nkey, nval))) {
+        __atomic_add_fetch(&shmc->attr->lfu_rejected, 1, __ATOMIC_RELAXED);
+        item = 0;
+    } else {
+        item = item_alloc(shmc, stripe, nkey, nval);
+    }
+    if (!item) {
+        if (shared >= 0) dedup_put(shmc, stripe, slot);
+        return SHMC_NOMEMORY;
+    }
 
     item->flags = flags;
-    memcpy(R2A(shmc, item_new->key, char), key, nkey);
-    memcpy(R2A(shmc, item_new->val, char), R2A(shmc, item->val, char), item->nval);
-    memcpy(R2A(shmc, item_new->val, char) + item->nval, val, nval);
+    item->exptime = exptime;
+    if (shared >= 0) item->iflags |= ITEM_DEDUP;
+    else if (nlz) item->iflags |= ITEM_LZ;
+    memcpy(item_key(item), key, nkey);
+    item_write(shmc, item, 0, val, nval);
+
+    assoc_insert(shmc, hv, item);
+    item_link(shmc, stripe, item);
+
+    return SHMC_OK;
+}
+
+SHMC_RC shmc_add_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags)
+{
+    return shmc_add_exp_nolock(shmc, key, nkey, val, nval, flags, 0);
+}
+
+SHMC_RC shmc_add_exp_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval,
+        uint32_t flags, uint32_t exptime)
+{
+    uint32_t hv = key_hash(shmc, key, nkey);
+    int stripe = stripe_of(shmc, hv);
+
+    seq_write_begin(shmc, stripe);
+    slab_automove(shmc, stripe);
+    SHMC_RC rc = do_add(shmc, hv, key, nkey, val, nval, flags, exptime_of(exptime));
+    seq_write_end(shmc, stripe);
+    return rc;
+}
+
+static SHMC_RC do_add(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, const char *val, size_t nval,
+        uint32_t flags, uint32_t exptime)
+{
+    shmc_bucket_t *bucket = assoc_bucket(shmc, hv);
+    if (assoc_ref_live(shmc, bucket, key, nkey, hv)) return SHMC_EXIST;
+
+    return do_store(shmc, hv, bucket, 0, key, nkey, val, nval, flags, exptime);
+}
+
+SHMC_RC shmc_replace_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags)
+{
+    return shmc_replace_exp_nolock(shmc, key, nkey, val, nval, flags, 0);
+}
+
+SHMC_RC shmc_replace_exp_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval,
+        uint32_t flags, uint32_t exptime)
+{
+    uint32_t hv = key_hash(shmc, key, nkey);
+    int stripe = stripe_of(shmc, hv);
+
+    seq_write_begin(shmc, stripe);
+    slab_automove(shmc, stripe);
+    SHMC_RC rc = do_replace(shmc, hv, key, nkey, val, nval, flags, exptime_of(exptime));
+    seq_write_end(shmc, stripe);
+    return rc;
+}
+
+static SHMC_RC do_replace(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, const char *val, size_t nval,
+        uint32_t flags, uint32_t exptime)
+{
+    shmc_bucket_t *bucket = assoc_bucket(shmc, hv);
+    uint32_t *ref = assoc_ref_live(shmc, bucket, key, nkey, hv);
+    if (!ref) return SHMC_NOTFOUND;
+
+    return do_store(shmc, hv, bucket, ref, key, nkey, val, nval, flags, exptime);
+}
+
+SHMC_RC shmc_prepend_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags)
+{
+    uint32_t hv = key_hash(shmc, key, nkey);
+    int stripe = stripe_of(shmc, hv);
+
+    seq_write_begin(shmc, stripe);
+    slab_automove(shmc, stripe);
+    SHMC_RC rc = do_prepend(shmc, hv, key, nkey, val, nval, flags);
+    seq_write_end(shmc, stripe);
+    return rc;
+}
+
+/* take the place of old in the index and the LRU */
+static void item_swap(shmc_t *shmc, uint32_t hv, uint32_t *ref, shmc_item_t *item)
+{
+    int stripe = stripe_of(shmc, hv);
+
+    shmc_item_t *old = assoc_upsert(shmc, hv, item, ref);
+    if (old) {
+        item_unlink(shmc, stripe, old);
+        item_free(shmc, stripe, old);
+    }
+    item_link(shmc, stripe, item);
+}
+
+/* the old value and val end to end in a new item of another class, the
+ * old item is off the LRU meanwhile so the alloc can not evict it
+ */
+static SHMC_RC item_concat(shmc_t *shmc, uint32_t hv, uint32_t *ref, shmc_item_t *item,
+        const char *val, size_t nval, uint32_t flags, int prepend)
+{
+    size_t nkey = item->nkey;
+    if (!item_size_ok(shmc, nkey, nval + item->nval)) return SHMC_ESIZE;
+
+    int stripe = stripe_of(shmc, hv);
+    item_unlink(shmc, stripe, item);
+
+    shmc_item_t *item_new = item_alloc(shmc, stripe, nkey, nval + item->nval);
+    if (!item_new) {
+        item_link(shmc, stripe, item);
+        return SHMC_NOMEMORY;
+    }
+
+    item_new->flags = flags;
+    item_new->exptime = item->exptime;
+    memcpy(item_key(item_new), item_key(item), nkey);
+    item_write(shmc, item_new, prepend ? 0 : item->nval, val, nval);
+
+    /* the old value, a piece at a time */
+    char buf[4096];
+    size_t off, n;
+    for (off = 0; off < item->nval; off += n) {
+        n = item->nval - off < sizeof(buf) ? item->nval - off : sizeof(buf);
+        item_read(shmc, item, off, buf, n);
+        item_write(shmc, item_new, (prepend ? nval : 0) + off, buf, n);
+    }
 
-    item_free(shmc, item);
+    shmc_item_t *old = assoc_upsert(shmc, hv, item_new, ref);
+    assert(old == item);
+    item_free(shmc, stripe, old);
+    item_link(shmc, stripe, item_new);
 
     return SHMC_OK;
 }
 
+/* a compressed or shared value is copied out, joined with val and
+ * stored again
+ */
+static SHMC_RC item_rejoin(shmc_t *shmc, uint32_t hv, uint32_t *ref, shmc_item_t *item,
+        const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags, int prepend)
+{
+    size_t n = item_nval(shmc, item);
+    char *buf = malloc(n + nval);
+    if (!buf || item_value(shmc, item, buf + (prepend ? nval : 0), n) != 0) {
+        free(buf);
+        return SHMC_SYSTEM;
+    }
+    memcpy(buf + (prepend ? 0 : n), val, nval);
+
+    SHMC_RC rc = do_store(shmc, hv, assoc_bucket(shmc, hv), ref, key, nkey, buf, n + nval, flags, item->exptime);
+    free(buf);
+    return rc;
+}
+
+static SHMC_RC do_prepend(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags)
+{
+    uint32_t *ref = assoc_ref_live(shmc, assoc_bucket(shmc, hv), key, nkey, hv);
+    if (!ref) return SHMC_NOTFOUND;
+
+    shmc_item_t *item = R2A(shmc, *ref, shmc_item_t);
+    int stripe = stripe_of(shmc, hv);
+
+    if (item->iflags & (ITEM_LZ | ITEM_DEDUP)) return item_rejoin(shmc, hv, ref, item, key, nkey, val, nval, flags, 1);
+
+    if (item_fits(shmc, item, nkey, nval + item->nval)) {
+        item_relink(shmc, stripe, item);
+        item->flags = flags;
+        memmove(item_val(item) + nval, item_val(item), item->nval);
+        memcpy(item_val(item), val, nval);
+        item->nval += nval;
+        return SHMC_OK;
+    }
+
+    return item_concat(shmc, hv, ref, item, val, nval, flags, 1);
+}
+
+SHMC_RC shmc_append_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags)
+{
+    uint32_t hv = key_hash(shmc, key, nkey);
+    int stripe = stripe_of(shmc, hv);
+
+    seq_write_begin(shmc, stripe);
+    slab_automove(shmc, stripe);
+    SHMC_RC rc = do_append(shmc, hv, key, nkey, val, nval, flags);
+    seq_write_end(shmc, stripe);
+    return rc;
+}
+
+static SHMC_RC do_append(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags)
+{
+    uint32_t *ref = assoc_ref_live(shmc, assoc_bucket(shmc, hv), key, nkey, hv);
+    if (!ref) return SHMC_NOTFOUND;
+
+    shmc_item_t *item = R2A(shmc, *ref, shmc_item_t);
+    int stripe = stripe_of(shmc, hv);
+
+    if (item->iflags & (ITEM_LZ | ITEM_DEDUP)) return item_rejoin(shmc, hv, ref, item, key, nkey, val, nval, flags, 0);
+
+    if (item_fits(shmc, item, nkey, nval + item->nval)) {
+        item_relink(shmc, stripe, item);
+        item->flags = flags;
+        memcpy(item_val(item) + item->nval, val, nval);
+        item->nval += nval;
+        return SHMC_OK;
+    }
+
+    return item_concat(shmc, hv, ref, item, val, nval, flags, 0);
+}
+
 #define UINT64_SIZE sizeof("18446744073709551616")
 static uint64_t safe_strtoull(const char *val, size_t nval)
 {
@@ -529,389 +1770,2587 @@ static uint64_t safe_strtoull(const char *val, size_t nval)
 
     if (nval > UINT64_SIZE-1) nval = UINT64_SIZE-1;
 
-    for (i = 0; i < nval; ++i) {
-        if (val[i] < '0' || val[i] > '9') break;
-        value = value * 10 + (val[i] - '0');
+    for (i = 0; i < nval; ++i) {
+        if (val[i] < '0' || val[i] > '9') break;
+        value = value * 10 + (val[i] - '0');
+    }
+    return value;
+}
+
+static SHMC_RC shmc_arithmetic(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey, uint64_t val, int incr,
+        uint64_t *new_val, uint32_t *flags)
+{
+    uint64_t old_val;
+    uint32_t old_flags = 0, old_exptime = 0;
+    shmc_item_t *new_item;
+    shmc_item_t *old_item = 0;
+    int stripe = stripe_of(shmc, hv);
+    
+    uint32_t *ref = assoc_ref_live(shmc, assoc_bucket(shmc, hv), key, nkey, hv);
+
+    if (ref) {
+        old_item = R2A(shmc, *ref, shmc_item_t);
+        char digits[UINT64_SIZE];
+        size_t ndigits = item_nval(shmc, old_item);
+        if (ndigits > UINT64_SIZE) ndigits = UINT64_SIZE;
+        if (item_value(shmc, old_item, digits, ndigits) != 0) return SHMC_SYSTEM;
+        old_val = safe_strtoull(digits, ndigits);
+        old_flags = old_item->flags;
+        old_exptime = old_item->exptime;
+
+        if (old_item->nval == UINT64_SIZE && !(old_item->iflags & (ITEM_CHAIN | ITEM_LZ | ITEM_DEDUP))) {
+            new_item = old_item;
+        } else {
+            /* the old item is off the LRU meanwhile so the alloc can not
+             * evict it and get it back
+             */
+            item_unlink(shmc, stripe, old_item);
+            new_item = item_alloc(shmc, stripe, nkey, UINT64_SIZE);
+            if (!new_item) {
+                item_link(shmc, stripe, old_item);
+                return SHMC_NOMEMORY;
+            }
+        }
+    } else {
+        if (shmc->attr->default_counter) {
+            old_val = 0;
+            new_item = item_alloc(shmc, stripe, nkey, UINT64_SIZE);
+        } else {
+            return SHMC_NOTFOUND;
+        }
+    }
+
+    if (!new_item) return SHMC_NOMEMORY;
+
+    /* if new item, initialize */
+    if (new_item != old_item) {
+        new_item->flags = old_flags; 
+        if (flags) new_item->flags = *flags;
+        new_item->exptime = old_exptime;
+
+        memcpy(item_key(new_item), key, nkey);
+        memset(item_val(new_item), ' ', UINT64_SIZE);
+
+        if (old_item) {
+            shmc_item_t *old = assoc_upsert(shmc, hv, new_item, ref);
+            assert(old == old_item);
+            item_free(shmc, stripe, old);
+            item_link(shmc, stripe, new_item);
+        } else {
+            item_swap(shmc, hv, ref, new_item);
+        }
+    }
+
+    if (flags) *flags = new_item->flags;
+
+    if (incr) {
+        *new_val = old_val + val; 
+    } else {
+        if (old_val < val) {
+            *new_val = 0;
+        } else {
+            *new_val = old_val - val;
+        }
+    }
+    sprintf(item_val(new_item), "%"PRIu64, *new_val);
+
+    return SHMC_OK;
+}
+
+SHMC_RC shmc_incr_nolock(shmc_t *shmc, const char *key, size_t nkey, uint64_t val, uint64_t *new_val, uint32_t *flags)
+{
+    uint32_t hv = key_hash(shmc, key, nkey);
+    int stripe = stripe_of(shmc, hv);
+
+    seq_write_begin(shmc, stripe);
+    slab_automove(shmc, stripe);
+    SHMC_RC rc = shmc_arithmetic(shmc, hv, key, nkey, val, 1, new_val, flags);
+    seq_write_end(shmc, stripe);
+    return rc;
+}
+
+SHMC_RC shmc_decr_nolock(shmc_t *shmc, const char *key, size_t nkey, uint64_t val, uint64_t *new_val, uint32_t *flags)
+{
+    uint32_t hv = key_hash(shmc, key, nkey);
+    int stripe = stripe_of(shmc, hv);
+
+    seq_write_begin(shmc, stripe);
+    slab_automove(shmc, stripe);
+    SHMC_RC rc = shmc_arithmetic(shmc, hv, key, nkey, val, 0, new_val, flags);
+    seq_write_end(shmc, stripe);
+    return rc;
+}
+
+SHMC_RC shmc_del_nolock(shmc_t *shmc, const char *key, size_t nkey)
+{
+    uint32_t hv = key_hash(shmc, key, nkey);
+    int stripe = stripe_of(shmc, hv);
+
+    seq_write_begin(shmc, stripe);
+    SHMC_RC rc = do_del(shmc, hv, key, nkey);
+    seq_write_end(shmc, stripe);
+    return rc;
+}
+
+static SHMC_RC do_del(shmc_t *shmc, uint32_t hv, const char *key, size_t nkey)
+{
+    shmc_bucket_t *bucket = assoc_bucket(shmc, hv);
+    uint32_t *ref = assoc_ref_live(shmc, bucket, key, nkey, hv);
+    if (!ref) return SHMC_NOTFOUND;
+
+    int stripe = stripe_of(shmc, hv);
+    shmc_item_t *item = R2A(shmc, *ref, shmc_item_t);
+    assoc_unlink(shmc, bucket, ref);
+    item_unlink(shmc, stripe, item);
+
+    item_free(shmc, stripe, item);
+
+    /* a set of a live key may not insert, deletes keep the shrink going */
+    assoc_migrate(shmc, stripe);
+    assoc_resize(shmc, stripe);
+    return SHMC_OK;
+}
+
+SHMC_RC shmc_touch_nolock(shmc_t *shmc, const char *key, size_t nkey, uint32_t exptime)
+{
+    uint32_t hv = key_hash(shmc, key, nkey);
+    int stripe = stripe_of(shmc, hv);
+
+    seq_write_begin(shmc, stripe);
+    uint32_t *ref = assoc_ref_live(shmc, assoc_bucket(shmc, hv), key, nkey, hv);
+    if (ref) R2A(shmc, *ref, shmc_item_t)->exptime = exptime_of(exptime);
+    seq_write_end(shmc, stripe);
+    return ref ? SHMC_OK : SHMC_NOTFOUND;
+}
+
+/* count n items of class id, return the bytes they hold of a quota */
+static size_t batch_need(shmc_t *shmc, size_t *need, int id, size_t n)
+{
+    need[id] += n;
+    return n * shmc->slabs[id].size;
+}
+
+/* the items of each class the slabs, the magazines and the pages not
+ * carved yet are short of into lack, the bytes each namespace is over its
+ * quota into over. SHMC_NOMEMORY if anything is short
+ */
+static SHMC_RC batch_room(shmc_t *shmc, const size_t *need, const size_t *bytes, size_t *lack, size_t *over)
+{
+    shmc_attr_t *attr = shmc->attr;
+    SHMC_RC rc = SHMC_OK;
+    int id, ns;
+
+    /* the magazines back to the slabs first, so a class carves a page
+     * only when it has no free item left anywhere
+     */
+    pthread_mutex_lock(shmc->mutex);
+    mag_drain_all(shmc);
+
+    size_t len = slab_page_size(attr);
+    size_t pages = attr->pages_free +
+        (attr->mem_limit > attr->mem_used ? (attr->mem_limit - attr->mem_used - 1) / len : 0);
+    for (id = 0; id < attr->slabs_count; ++id) {
+        shmc_slab_t *slab = &shmc->slabs[id];
+        lack[id] = 0;
+        if (need[id] <= slab->nfree) continue;
+
+        size_t left = need[id] - slab->nfree;
+        size_t carve = (left + slab->count - 1) / slab->count;
+        if (carve > pages) carve = pages;
+        pages -= carve;
+        if (left > carve * slab->count) {
+            lack[id] = left - carve * slab->count;
+            rc = SHMC_NOMEMORY;
+        }
+    }
+    pthread_mutex_unlock(shmc->mutex);
+
+    for (ns = 0; ns < attr->nspaces; ++ns) {
+        size_t quota = shmc->spaces[ns].quota, used = shmc_ns_used(shmc, ns) + bytes[ns];
+        over[ns] = quota && used > quota ? used - quota : 0;
+        if (over[ns]) rc = SHMC_NOMEMORY;
+    }
+    return rc;
+}
+
+/* the items the ops find leave their LRU lists while the batch evicts,
+ * so it does not evict its own keys. a key twice in the batch is left
+ * once, an item off its list has no prev and is not the head
+ */
+static size_t batch_hide(shmc_t *shmc, shmc_batch_t *batch, uint32_t *hidden)
+{
+    size_t n = 0, i;
+    for (i = 0; i < batch->nops; ++i) {
+        shmc_op_t *o = &batch->ops[i];
+        uint32_t hv = key_hash(shmc, o->key, o->nkey);
+        uint32_t *ref = assoc_ref_live(shmc, assoc_bucket(shmc, hv), o->key, o->nkey, hv);
+        if (!ref) continue;
+
+        shmc_item_t *item = R2A(shmc, *ref, shmc_item_t);
+        int stripe = stripe_of(shmc, hv);
+        if (!item->prev && LRU_HEAD(shmc, stripe, item->clsid) != *ref) continue;
+
+        item_unlink(shmc, stripe, item);
+        item->next = item->prev = 0;
+        hidden[n++] = *ref;
+    }
+    return n;
+}
+
+/* evict up to n items of class id from the stripes of namespace ns in
+ * turn, return how many
+ */
+static size_t batch_evict(shmc_t *shmc, int ns, int id, size_t n)
+{
+    const int k = ns_stripes(shmc->attr);
+    size_t done = 0;
+    int s, idle;
+
+    for (s = 0, idle = 0; done < n && idle < k; s = (s + 1) % k) {
+        int stripe = ns * k + s;
+        seq_write_begin(shmc, stripe);
+        int evicted = evict_from(shmc, stripe, stripe, id);
+        seq_write_end(shmc, stripe);
+
+        if (evicted) {
+            done++;
+            idle = 0;
+        } else {
+            idle++;
+        }
+    }
+    return done;
+}
+
+/* a namespace over its quota evicts its own items, the largest first as
+ * ns_room does, then the classes short of items evict from the
+ * namespaces of the batch
+ */
+static void batch_make_room(shmc_t *shmc, const size_t *bytes, size_t *lack, const size_t *over)
+{
+    shmc_attr_t *attr = shmc->attr;
+    int id, ns;
+
+    for (ns = 0; ns < attr->nspaces; ++ns) {
+        size_t used = shmc_ns_used(shmc, ns);
+        while (over[ns] && used - shmc_ns_used(shmc, ns) < over[ns]) {
+            for (id = attr->slabs_count - 1; id >= 0 && !batch_evict(shmc, ns, id, 1); --id);
+            if (id < 0) break;
+            __atomic_add_fetch(&shmc->spaces[ns].evicted, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    for (id = 0; id < attr->slabs_count; ++id) {
+        for (ns = 0; ns < attr->nspaces && lack[id]; ++ns) {
+            if (bytes[ns]) lack[id] -= batch_evict(shmc, ns, id, lack[id]);
+        }
+    }
+}
+
+/* the items of the ops of an atomic batch are counted first, they come
+ * from what is free: the slabs, the magazines and the pages not carved
+ * yet. if that is short the batch evicts, but not its own keys, as much
+ * as it needs and checks again. no page is moved, the namespaces stay
+ * under their quota. the caller holds all the stripes so nobody else
+ * allocates meanwhile. the values are packed here once, into lz[i] and
+ * nlz[i] for the op to store
+ */
+static SHMC_RC batch_reserve(shmc_t *shmc, shmc_batch_t *batch, char **lz, size_t *nlz)
+{
+    shmc_attr_t *attr = shmc->attr;
+    int nclass = attr->slabs_count, ns;
+    size_t *need = calloc(2 * nclass + 2 * attr->nspaces, sizeof(size_t));
+    if (!need) return SHMC_SYSTEM;
+
+    size_t *lack  = need + nclass;
+    size_t *bytes = lack + nclass;   /* of each namespace */
+    size_t *over  = bytes + attr->nspaces;
+    size_t cap = slab_last(shmc)->size - sizeof(shmc_item_t);
+    size_t ndedup = 0, i;
+    SHMC_RC rc = SHMC_OK;
+
+    for (i = 0; i < batch->nops; ++i) {
+        shmc_op_t *o = &batch->ops[i];
+        int counter = o->op == SHMC_OP_INCR || o->op == SHMC_OP_DECR;
+        if (o->op == SHMC_OP_DEL) continue;
+
+        size_t nval = counter ? UINT64_SIZE : o->nval;
+        if (!item_size_ok(shmc, o->nkey, nval)) {
+            o->rc = rc = SHMC_ESIZE;
+            break;
+        }
+
+        size_t n = nval;
+        int dedup = 0;
+        if (!counter) {
+            nlz[i] = val_pack(shmc, o->val, nval, &lz[i]);
+            if (nlz[i]) n = nlz[i];
+            /* a full table stores the value in the item itself */
+            dedup = dedup_ok(shmc, nval, n) && attr->dedup_values + ndedup < dedup_nslots(attr) / 4 * 3;
+            if (dedup) {
+                /* nor does one with no slot in reach */
+                const char *v = nlz[i] ? lz[i] : o->val;
+                pthread_mutex_lock(shmc->mutex);
+                dedup = dedup_find(shmc, hash(v, n, 0), v, n, nlz[i] != 0) >= 0;
+                pthread_mutex_unlock(shmc->mutex);
+            }
+        }
+
+        ns = ns_of_stripe(shmc, stripe_of(shmc, key_hash(shmc, o->key, o->nkey)));
+        if (dedup) {
+            /* the item of the slot and the shared value, if it is new */
+            ndedup++;
+            bytes[ns] += batch_need(shmc, need, item_clsid(shmc, o->nkey, sizeof(uint32_t)), 1);
+            bytes[ns] += batch_need(shmc, need, item_clsid(shmc, 0, n), 1);
+        } else if (item_needs_chain(shmc, o->nkey, n)) {
+            /* the head and the full chunks of the last class, the tail of
+             * its best fit, as chain_alloc takes them
+             */
+            size_t left = n - (cap - o->nkey - sizeof(uint32_t));
+            size_t full = (left - 1) / cap;
+            bytes[ns] += batch_need(shmc, need, nclass - 1, 1 + full);
+            bytes[ns] += batch_need(shmc, need, item_clsid(shmc, 0, left - full * cap), 1);
+        } else {
+            bytes[ns] += batch_need(shmc, need, item_clsid(shmc, o->nkey, n), 1);
+        }
+    }
+
+    if (rc == SHMC_OK) rc = batch_room(shmc, need, bytes, lack, over);
+
+    uint32_t *hidden = 0;
+    if (rc == SHMC_NOMEMORY && attr->evict_to_free &&
+            (hidden = malloc((batch->nops ? batch->nops : 1) * sizeof(uint32_t)))) {
+        size_t nhidden = batch_hide(shmc, batch, hidden);
+        batch_make_room(shmc, bytes, lack, over);
+        for (i = 0; i < nhidden; ++i) {
+            shmc_item_t *item = R2A(shmc, hidden[i], shmc_item_t);
+            item_link(shmc, stripe_of(shmc, item->hv), item);
+        }
+        rc = batch_room(shmc, need, bytes, lack, over);
+    }
+
+    free(hidden);
+    free(need);
+    return rc;
+}
+
+/* an op of an atomic batch. it takes only the items batch_reserve found,
+ * so no page is moved and TinyLFU does not turn a new key away
+ */
+static SHMC_RC batch_op(shmc_t *shmc, shmc_op_t *o, const char *lz, size_t nlz)
+{
+    if (o->op == SHMC_OP_DEL) return shmc_del_nolock(shmc, o->key, o->nkey);
+    if (o->op > SHMC_OP_DECR) return SHMC_SYSTEM;
+
+    uint32_t hv = key_hash(shmc, o->key, o->nkey);
+    int stripe = stripe_of(shmc, hv);
+    SHMC_RC rc;
+
+    seq_write_begin(shmc, stripe);
+    if (o->op == SHMC_OP_INCR || o->op == SHMC_OP_DECR) {
+        rc = shmc_arithmetic(shmc, hv, o->key, o->nkey, o->num, o->op == SHMC_OP_INCR, &o->num, 0);
+    } else {
+        shmc_bucket_t *bucket = assoc_bucket(shmc, hv);
+        uint32_t *ref = assoc_ref_live(shmc, bucket, o->key, o->nkey, hv);
+        if (o->op == SHMC_OP_ADD && ref) rc = SHMC_EXIST;
+        else if (o->op == SHMC_OP_REPLACE && !ref) rc = SHMC_NOTFOUND;
+        else rc = store_packed(shmc, hv, bucket, ref, o->key, o->nkey, o->val, o->nval, lz, nlz,
+                o->flags, exptime_of(o->exptime), 0);
+    }
+    seq_write_end(shmc, stripe);
+    return rc;
+}
+
+SHMC_RC shmc_batch_apply_nolock(shmc_t *shmc, shmc_batch_t *batch, int atomic)
+{
+    size_t i;
+    if (atomic) {
+        size_t n = batch->nops ? batch->nops : 1;
+        char **lz = calloc(n, sizeof(char *));
+        size_t *nlz = calloc(n, sizeof(size_t));
+
+        /* until an op is applied */
+        for (i = 0; i < batch->nops; ++i) batch->ops[i].rc = SHMC_EABORT;
+
+        SHMC_RC rc = lz && nlz ? batch_reserve(shmc, batch, lz, nlz) : SHMC_SYSTEM;
+        for (i = 0; i < batch->nops; ++i) {
+            if (rc == SHMC_OK) batch->ops[i].rc = batch_op(shmc, &batch->ops[i], lz[i], nlz[i]);
+            if (lz) free(lz[i]);
+        }
+        free(lz);
+        free(nlz);
+        return rc;
+    }
+
+    for (i = 0; i < batch->nops; ++i) {
+        shmc_op_t *o = &batch->ops[i];
+        switch (o->op) {
+            case SHMC_OP_SET:
+                o->rc = shmc_set_exp_nolock(shmc, o->key, o->nkey, o->val, o->nval, o->flags, o->exptime);
+                break;
+            case SHMC_OP_ADD:
+                o->rc = shmc_add_exp_nolock(shmc, o->key, o->nkey, o->val, o->nval, o->flags, o->exptime);
+                break;
+            case SHMC_OP_REPLACE:
+                o->rc = shmc_replace_exp_nolock(shmc, o->key, o->nkey, o->val, o->nval, o->flags, o->exptime);
+                break;
+            case SHMC_OP_DEL:
+                o->rc = shmc_del_nolock(shmc, o->key, o->nkey);
+                break;
+            case SHMC_OP_INCR:
+                o->rc = shmc_incr_nolock(shmc, o->key, o->nkey, o->num, &o->num, 0);
+                break;
+            case SHMC_OP_DECR:
+                o->rc = shmc_decr_nolock(shmc, o->key, o->nkey, o->num, &o->num, 0);
+                break;
+            default:
+                o->rc = SHMC_SYSTEM;
+                break;
+        }
+    }
+    return SHMC_OK;
+}
+
+SHMC_RC shmc_dump_nolock(shmc_t *shmc, const char *file)
+{
+    FILE *fp = fopen(file, "w");
+    if (!fp) {
+        return SHMC_SYSTEM; 
+    }
+
+    int i, s;
+    uint32_t item, next, now = clock_now();
+    for (s = 0; s < shmc->attr->nstripes; ++s) {
+        for (i = 0; i < shmc->attr->slabs_count; ++i) {
+            for (item = LRU_HEAD(shmc, s, i); item; item = next) {
+                shmc_item_t *it = R2A(shmc, item, shmc_item_t);
+                next = it->next;
+                if (item_expired(shmc, it, now)) continue;
+
+                char *val = item_val(it);
+                size_t nval = item_nval(shmc, it);
+                if (it->iflags & (ITEM_CHAIN | ITEM_LZ | ITEM_DEDUP)) {
+                    val = malloc(nval);
+                    if (!val || item_value(shmc, it, val, nval) != 0) {
+                        free(val);
+                        fclose(fp);
+                        return SHMC_SYSTEM;
+                    }
+                }
+                fprintf(fp, "%d %d %.*s %.*s\n", (int) it->nkey, (int) nval,
+                        (int) it->nkey, item_key(it), (int) nval, val);
+                if (val != item_val(it)) free(val);
+            }
+        }
+    }
+
+    fclose(fp);
+    return SHMC_OK;
+}
+SHMC_RC shmc_load_nolock(shmc_t *shmc, const char *file)
+{
+    FILE *fp = fopen(file, "r");
+    if (!fp) {
+        return SHMC_SYSTEM;
+    }
+
+    const size_t BUFFER_SIZE = shmc->attr->item_size_max + 1024;
+    char *buffer = malloc(BUFFER_SIZE);
+    if (!buffer) {
+        fclose(fp);
+        return SHMC_SYSTEM;
+    }
+
+    SHMC_RC rc = SHMC_OK;
+
+    size_t nbuffer, offset = 0;
+    while ((nbuffer = fread(buffer + offset, 1, BUFFER_SIZE - offset, fp))) {
+        nbuffer += offset;
+        offset = 0;
+        while (rc == SHMC_OK) {
+            /* nkey nval key val\n */
+            char *nkeyp = buffer + offset;
+
+            char *nvalp = memchr(nkeyp, ' ', nbuffer - (nkeyp - buffer));
+            if (!nvalp || nvalp + 1 == buffer + nbuffer) break;
+
+            *nvalp = '\0';
+            size_t nkey = atoi(nkeyp);
+            *nvalp = ' ';
+            nvalp += 1;
+
+            char *key = memchr(nvalp, ' ', nbuffer - (nvalp - buffer));
+            if (!key || key + 1 == buffer + nbuffer) break;
+
+            *key = '\0';
+            size_t nval = atoi(nvalp);
+            *key = ' ';
+            key += 1;
+
+            if (key + nkey + 1 + nval + 1 > buffer + nbuffer) break;
+            char *val = key + nkey + 1;
+
+            rc = shmc_set_nolock(shmc, key, nkey, val, nval, 0);
+            if (rc != SHMC_OK) break;
+
+            offset = (key + nkey + 1 + nval + 1) - buffer;
+        }
+
+        if (rc == SHMC_OK) {
+            if (offset == 0) {
+                rc = SHMC_ESIZE;
+                break;
+            } else if (nbuffer != offset) {
+                memmove(buffer, buffer + offset, nbuffer - offset);
+                offset = nbuffer - offset;
+            }
+        } else {
+            break;
+        }
+    }
+
+    free(buffer);
+    fclose(fp);
+    return rc;
+}
+
+/* the file grows or shrinks with mem_limit, inside the room reserved for
+ * mem_limit_max, so no process has to remap. pages above a smaller limit
+ * are emptied first, their items move down or are evicted
+ */
+SHMC_RC shmc_resize_nolock(shmc_t *shmc, size_t mem_limit)
+{
+    shmc_attr_t *attr = shmc->attr;
+    size_t page = slab_page_size(attr);
+    if (mem_limit > attr->mem_limit_max || mem_limit < page) return SHMC_ESIZE;
+
+    size_t live = mmap_round(shmc->fd, size_of_file(attr, attr->slabs_count, mem_limit));
+
+    if (mem_limit > attr->mem_limit) {
+        struct stat st;
+        if (fstat(shmc->fd, &st) == -1) return SHMC_SYSTEM;
+        if ((size_t) st.st_size < live && ftruncate(shmc->fd, live) == -1) return SHMC_SYSTEM;
+
+        pthread_mutex_lock(shmc->mutex);
+        attr->mem_limit = mem_limit;
+    } else {
+        size_t npages = mem_limit / page;
+        slab_shrink(shmc, npages);
+
+        pthread_mutex_lock(shmc->mutex);
+        size_t used = attr->mem_limit;
+        attr->mem_limit = mem_limit;
+
+        /* give the memory back, the file keeps its size so a late lock
+         * free reader of a moved item reads zeros instead of SIGBUS
+         */
+        if (used > npages * page) mmap_release(shmc->raw + npages * page, used - npages * page);
+    }
+
+    __atomic_add_fetch(&attr->mem_resizes, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(shmc->mutex);
+
+    mmap_follow(shmc);
+    return SHMC_OK;
+}
+
+SHMC_RC shmc_compact_nolock(shmc_t *shmc)
+{
+    slab_compact(shmc);
+    return SHMC_OK;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+# define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#else
+# define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static __thread pid_t futex_tid;
+
+/* the child of fork must not think it is the writer of its parent */
+static void futex_atfork_child()
+{
+    futex_tid = 0;
+}
+
+static void futex_atfork()
+{
+    pthread_atfork(0, 0, futex_atfork_child);
+}
+
+static inline pid_t futex_self()
+{
+    if (!futex_tid) futex_tid = syscall(SYS_gettid);
+    return futex_tid;
+}
+
+/* not FUTEX_PRIVATE, the words live in share memory */
+static inline void futex_wait(uint32_t *addr, uint32_t val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, 0, 0, 0);
+}
+
+static inline void futex_wake(uint32_t *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
+
+static uint32_t futex_readers(shmc_futex_t *f)
+{
+    uint32_t n = 0;
+    int i;
+    for (i = 0; i < FUTEX_SHARDS; ++i) {
+        n += __atomic_load_n(&f->readers[i].count, __ATOMIC_SEQ_CST);
+    }
+    return n;
+}
+
+static void futex_rdexit(shmc_futex_t *f, uint32_t *count)
+{
+    if (__atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST) == 0 &&
+            __atomic_load_n(&f->writer, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&f->drain, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&f->drain);
+    }
+}
+
+/* spin a while, then sleep on the writer word marked as contended */
+static void futex_wait_writer(shmc_futex_t *f)
+{
+    int spin;
+    for (spin = 0; spin < FUTEX_SPIN; ++spin) {
+        if (__atomic_load_n(&f->writer, __ATOMIC_SEQ_CST) == 0) return;
+        cpu_relax();
+    }
+
+    uint32_t w;
+    while ((w = __atomic_load_n(&f->writer, __ATOMIC_SEQ_CST)) != 0) {
+        if (w == 1 && !__atomic_compare_exchange_n(&f->writer, &w, 2, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) continue;
+        futex_wait(&f->writer, 2);
+    }
+}
+
+static void futex_rdlock(shmc_futex_t *f)
+{
+    uint32_t *count = &f->readers[futex_self() % FUTEX_SHARDS].count;
+    for (;;) {
+        __atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&f->writer, __ATOMIC_SEQ_CST) == 0) return;
+
+        /* writers first */
+        futex_rdexit(f, count);
+        futex_wait_writer(f);
+    }
+}
+
+static void futex_drain(shmc_futex_t *f)
+{
+    int spin = 0;
+    for (;;) {
+        uint32_t drain = __atomic_load_n(&f->drain, __ATOMIC_SEQ_CST);
+        if (futex_readers(f) == 0) break;
+        if (++spin < FUTEX_SPIN) {
+            cpu_relax();
+        } else {
+            futex_wait(&f->drain, drain);
+        }
+    }
+    f->owner = futex_self();
+}
+
+static void futex_wrlock(shmc_futex_t *f)
+{
+    int spin;
+    for (spin = 0; spin < FUTEX_SPIN; ++spin) {
+        uint32_t w = 0;
+        if (__atomic_compare_exchange_n(&f->writer, &w, 1, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            futex_drain(f);
+            return;
+        }
+        cpu_relax();
+    }
+
+    while (__atomic_exchange_n(&f->writer, 2, __ATOMIC_SEQ_CST) != 0) {
+        futex_wait(&f->writer, 2);
+    }
+    futex_drain(f);
+}
+
+static void futex_wrunlock(shmc_futex_t *f)
+{
+    f->owner = 0;
+    if (__atomic_exchange_n(&f->writer, 0, __ATOMIC_SEQ_CST) == 2) {
+        futex_wake(&f->writer);
+    }
+}
+
+/* 0 if locked, never waits for readers either */
+static int futex_trywrlock(shmc_futex_t *f)
+{
+    uint32_t w = 0;
+    if (!__atomic_compare_exchange_n(&f->writer, &w, 1, 0,
+                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return EBUSY;
+
+    if (futex_readers(f)) {
+        futex_wrunlock(f);
+        return EBUSY;
+    }
+    f->owner = futex_self();
+    return 0;
+}
+
+static void futex_unlock(shmc_futex_t *f)
+{
+    if (f->owner == futex_self()) {
+        futex_wrunlock(f);
+    } else {
+        futex_rdexit(f, &f->readers[futex_self() % FUTEX_SHARDS].count);
+    }
+}
+
+/* with flock, stripe i is the byte i of the token file */
+static int shmc_fcntl(shmc_t *shmc, int type, int start, int len, int wait)
+{
+    struct flock lock;
+    lock.l_type   = type;
+    lock.l_start  = start;
+    lock.l_whence = SEEK_SET;
+    lock.l_len    = len;
+
+    return fcntl(shmc->fd, wait ? F_SETLKW : F_SETLK, &lock);
+}
+
+static void stripe_rdlock(shmc_t *shmc, int stripe)
+{
+    if (shmc->attr->use_flock) {
+        shmc_fcntl(shmc, F_RDLCK, stripe, 1, 1);
+    } else if (shmc->attr->use_futex) {
+        futex_rdlock(&shmc->stripes[stripe].futex);
+    } else {
+        pthread_rwlock_rdlock(&shmc->stripes[stripe].lock);
+    }
+}
+
+static void stripe_wrlock(shmc_t *shmc, int stripe)
+{
+    if (shmc->attr->use_flock) {
+        shmc_fcntl(shmc, F_WRLCK, stripe, 1, 1);
+    } else if (shmc->attr->use_futex) {
+        futex_wrlock(&shmc->stripes[stripe].futex);
+    } else {
+        pthread_rwlock_wrlock(&shmc->stripes[stripe].lock);
+    }
+}
+
+/* 0 if locked */
+static int stripe_trywrlock(shmc_t *shmc, int stripe)
+{
+    if (shmc->attr->use_flock) {
+        return shmc_fcntl(shmc, F_WRLCK, stripe, 1, 0);
+    } else if (shmc->attr->use_futex) {
+        return futex_trywrlock(&shmc->stripes[stripe].futex);
+    } else {
+        return pthread_rwlock_trywrlock(&shmc->stripes[stripe].lock);
+    }
+}
+
+static void stripe_unlock(shmc_t *shmc, int stripe)
+{
+    if (shmc->attr->use_flock) {
+        shmc_fcntl(shmc, F_UNLCK, stripe, 1, 1);
+    } else if (shmc->attr->use_futex) {
+        futex_unlock(&shmc->stripes[stripe].futex);
+    } else {
+        pthread_rwlock_unlock(&shmc->stripes[stripe].lock);
+    }
+}
+
+/* the whole table, stripes are always taken in order */
+void shmc_rdlock(shmc_t *shmc)
+{
+    int i;
+    if (shmc->attr->use_flock) {
+        shmc_fcntl(shmc, F_RDLCK, 0, shmc->attr->nstripes, 1);
+    } else {
+        for (i = 0; i < shmc->attr->nstripes; ++i) {
+            stripe_rdlock(shmc, i);
+        }
+    }
+    mmap_follow(shmc);
+    shmc_debug("enter read lock\n");
+}
+
+void shmc_wrlock(shmc_t *shmc)
+{
+    int i;
+    if (shmc->attr->use_flock) {
+        shmc_fcntl(shmc, F_WRLCK, 0, shmc->attr->nstripes, 1);
+    } else {
+        for (i = 0; i < shmc->attr->nstripes; ++i) {
+            stripe_wrlock(shmc, i);
+        }
+    }
+    shmc->wrall = 1;
+    mmap_follow(shmc);
+    shmc_debug("enter write lock\n");
+}
+
+void shmc_unlock(shmc_t *shmc)
+{
+    int i;
+    shmc->wrall = 0;
+    if (shmc->attr->use_flock) {
+        shmc_fcntl(shmc, F_UNLCK, 0, shmc->attr->nstripes, 1);
+    } else {
+        for (i = shmc->attr->nstripes - 1; i >= 0; --i) {
+            stripe_unlock(shmc, i);
+        }
+    }
+    shmc_debug("leave lock\n");
+}
+
+/* lock the stripe of key. shmc_ns_open names a namespace only with every
+ * stripe write locked, so while the stripe is held the op hashes the key
+ * to it again. a name given before the lock was taken may have moved the
+ * key, then the lock is taken again
+ */
+static int stripe_lock_key(shmc_t *shmc, const char *key, size_t nkey, int write)
+{
+    uint32_t hv = hash(key, nkey, 0);
+    for (;;) {
+        int open = __atomic_load_n(&shmc->attr->ns_open, __ATOMIC_ACQUIRE);
+        int stripe = stripe_of(shmc, ns_hash(shmc->attr, hv, shmc_ns_of(shmc, key, nkey)));
+        if (write) stripe_wrlock(shmc, stripe);
+        else stripe_rdlock(shmc, stripe);
+
+        if (__atomic_load_n(&shmc->attr->ns_open, __ATOMIC_ACQUIRE) == open) return stripe;
+        stripe_unlock(shmc, stripe);
+    }
+}
+
+int shmc_rdlock_key(shmc_t *shmc, const char *key, size_t nkey)
+{
+    int stripe = stripe_lock_key(shmc, key, nkey, 0);
+    mmap_follow(shmc);
+    shmc_debug("enter read lock %d\n", stripe);
+    return stripe;
+}
+
+int shmc_wrlock_key(shmc_t *shmc, const char *key, size_t nkey)
+{
+    int stripe = stripe_lock_key(shmc, key, nkey, 1);
+    mmap_follow(shmc);
+    shmc_debug("enter write lock %d\n", stripe);
+    return stripe;
+}
+
+void shmc_unlock_stripe(shmc_t *shmc, int stripe)
+{
+    stripe_unlock(shmc, stripe);
+    shmc_debug("leave lock %d\n", stripe);
+}
+
+int shmc_lockfree(const shmc_t *shmc)
+{
+    return shmc->attr->seqlock_read;
+}
+
+/* a stripe is write locked while up to n items of each of its LRU lists
+ * are looked at, then the next one. the walk goes on from the cursor
+ * the next time, and from the tail once it reaches the head
+ */
+size_t shmc_crawl(shmc_t *shmc, size_t n)
+{
+    size_t reclaimed = 0;
+    int s, id;
+
+    for (s = 0; s < shmc->attr->nstripes; ++s) {
+        stripe_wrlock(shmc, s);
+        mmap_follow(shmc);
+        seq_write_begin(shmc, s);
+
+        uint32_t now = clock_now();
+        for (id = 0; id < shmc->attr->slabs_count; ++id) {
+            uint32_t next = CRAWL_AT(shmc, s, id);
+            if (!next) next = LRU_TAIL(shmc, s, id);
+
+            size_t i;
+            for (i = 0; next && i < n; ++i) {
+                shmc_item_t *item = R2A(shmc, next, shmc_item_t);
+                next = item->prev;
+                if (!item_expired(shmc, item, now)) continue;
+
+                shmc_bucket_t *bucket = assoc_bucket(shmc, item->hv);
+                item_reclaim(shmc, s, bucket, assoc_ref(shmc, bucket, item_key(item), item->nkey, item->hv), item);
+                reclaimed++;
+            }
+            CRAWL_AT(shmc, s, id) = next;
+        }
+
+        seq_write_end(shmc, s);
+        stripe_unlock(shmc, s);
+    }
+    return reclaimed;
+}
+
+/* no page is left for a class without an eviction, a look without locks */
+static int mem_full(const shmc_t *shmc)
+{
+    const shmc_attr_t *attr = shmc->attr;
+    return !__atomic_load_n(&attr->pages_free, __ATOMIC_RELAXED) &&
+        __atomic_load_n(&attr->mem_used, __ATOMIC_RELAXED) + slab_page_size(attr) >= attr->mem_limit;
+}
+
+/* class id is short of free items with memory full, a wrong guess costs
+ * an eviction or two
+ */
+static int maintain_low(shmc_t *shmc, int id)
+{
+    const shmc_attr_t *attr = shmc->attr;
+    const shmc_slab_t *slab = &shmc->slabs[id];
+    if (!mem_full(shmc)) return 0;
+
+    size_t nfree = __atomic_load_n(&slab->nfree, __ATOMIC_RELAXED);
+    int s;
+    for (s = 0; s < attr->nstripes; ++s) {
+        nfree += __atomic_load_n(&MAG_COUNT(shmc, s, id), __ATOMIC_RELAXED);
+    }
+    return nfree * 100 < (size_t) slab->pages * slab->count * attr->free_watermark;
+}
+
+/* evictions under one stripe lock, the stripes take turns */
+#define MAINTAIN_SLICE 16
+
+size_t shmc_maintain(shmc_t *shmc)
+{
+    size_t evicted = 0;
+    if (!shmc->attr->free_watermark) return evicted;
+
+    int s = 0, id;
+    for (id = 0; id < shmc->attr->slabs_count; ++id) {
+        /* stop once no stripe has an item of the class left */
+        int idle = 0;
+        while (idle < shmc->attr->nstripes && maintain_low(shmc, id)) {
+            stripe_wrlock(shmc, s);
+            mmap_follow(shmc);
+            seq_write_begin(shmc, s);
+
+            int n = 0;
+            while (n < MAINTAIN_SLICE && evict_from(shmc, s, s, id)) n++;
+
+            seq_write_end(shmc, s);
+            stripe_unlock(shmc, s);
+
+            idle = n ? 0 : idle + 1;
+            evicted += n;
+            s = (s + 1) % shmc->attr->nstripes;
+        }
+    }
+
+    __atomic_add_fetch(&shmc->attr->evicted_ahead, evicted, __ATOMIC_RELAXED);
+    return evicted;
+}
+
+void shmc_flush(shmc_t *shmc, uint32_t delay)
+{
+    uint32_t now = clock_now();
+    uint64_t flush = __atomic_load_n(&shmc->attr->flush, __ATOMIC_RELAXED);
+    uint64_t next;
+
+    do {
+        uint32_t gen = gen_of(flush, now);
+        next = delay ? (uint64_t) (now + delay) << 32 | gen : (uint32_t) (gen + 1);
+    } while (!__atomic_compare_exchange_n(&shmc->attr->flush, &flush, next, 0,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* namespace 0 holds a live item of a key "name:...", a namespace of that
+ * name would hide it. the caller holds every stripe
+ */
+static int ns_prefixed(shmc_t *shmc, const char *name, size_t n)
+{
+    uint32_t now = clock_now(), next;
+    int s, id;
+
+    for (s = 0; s < ns_stripes(shmc->attr); ++s) {
+        for (id = 0; id < shmc->attr->slabs_count; ++id) {
+            for (next = LRU_HEAD(shmc, s, id); next; ) {
+                shmc_item_t *item = R2A(shmc, next, shmc_item_t);
+                next = item->next;
+                if (item->nkey > n && item_key(item)[n] == SHMC_NS_SEP &&
+                        memcmp(item_key(item), name, n) == 0 && !item_expired(shmc, item, now)) return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+SHMC_RC shmc_ns_open(shmc_t *shmc, const char *name, size_t quota, int *ns)
+{
+    size_t n = strlen(name);
+    if (n >= SHMC_NS_NAME || memchr(name, SHMC_NS_SEP, n)) return SHMC_ESIZE;
+
+    /* a name moves keys to other stripes, nobody may hold one meanwhile */
+    shmc_wrlock(shmc);
+
+    SHMC_RC rc = SHMC_OK;
+    int open = shmc->attr->ns_open, i = 0;
+    if (n) {
+        for (i = 1; i <= open && strcmp(shmc->spaces[i].name, name) != 0; ++i);
+        if (i == shmc->attr->nspaces) {
+            rc = SHMC_NOMEMORY;
+        } else if (i > open && ns_prefixed(shmc, name, n)) {
+            rc = SHMC_EXIST;
+        } else if (i > open) {
+            /* named before it is seen by shmc_ns_of */
+            memcpy(shmc->spaces[i].name, name, n + 1);
+            __atomic_store_n(&shmc->attr->ns_open, i, __ATOMIC_RELEASE);
+        }
+    }
+    if (rc == SHMC_OK && quota) __atomic_store_n(&shmc->spaces[i].quota, quota, __ATOMIC_RELAXED);
+
+    shmc_unlock(shmc);
+    if (rc == SHMC_OK) *ns = i;
+    return rc;
+}
+
+size_t shmc_ns_used(const shmc_t *shmc, int ns)
+{
+    const int k = ns_stripes(shmc->attr);
+    size_t used = 0;
+
+    int s;
+    for (s = ns * k; s < (ns + 1) * k; ++s) {
+        used += __atomic_load_n(&shmc->stripes[s].used, __ATOMIC_RELAXED);
+    }
+    return used;
+}
+
+void shmc_hit_stats(const shmc_t *shmc, uint64_t *hits, uint64_t *misses)
+{
+    *hits = *misses = 0;
+
+    int s;
+    for (s = 0; s < shmc->attr->nstripes; ++s) {
+        *hits   += __atomic_load_n(&shmc->stripes[s].hits, __ATOMIC_RELAXED);
+        *misses += __atomic_load_n(&shmc->stripes[s].misses, __ATOMIC_RELAXED);
+    }
+}
+
+/* what an item holds against the quota of its namespace, a chain its
+ * head and the bytes of the value
+ */
+static inline size_t item_bytes(const shmc_t *shmc, const shmc_item_t *item)
+{
+    if (item->iflags & ITEM_CHAIN) return sizeof(shmc_item_t) + item->nkey + item->nval;
+    return shmc->slabs[item->clsid].size;
+}
+
+static void item_link(shmc_t *shmc, int stripe, shmc_item_t *item)
+{
+    uint32_t *head = &LRU_HEAD(shmc, stripe, item->clsid);
+    uint32_t *tail = &LRU_TAIL(shmc, stripe, item->clsid);
+    int policy = shmc->attr->evict_policy;
+
+    LRU_COUNT(shmc, stripe, item->clsid)++;
+    shmc->stripes[stripe].used += item_bytes(shmc, item);
+    if (policy == SHMC_EVICT_SAMPLED) item->atime = clock_ms();
+
+    if (policy == SHMC_EVICT_SLRU && !(item->iflags & ITEM_PROT)) {
+        /* in front of the probation items, at the tail if there is none */
+        uint32_t *mid = &LRU_MID(shmc, stripe, item->clsid);
+        shmc_item_t *next = R2A(shmc, *mid, shmc_item_t);
+
+        item->next = *mid;
+        item->prev = next ? next->prev : *tail;
+        if (next) next->prev = A2R(shmc, item);
+        else *tail = A2R(shmc, item);
+        if (item->prev) R2A(shmc, item->prev, shmc_item_t)->next = A2R(shmc, item);
+        else *head = A2R(shmc, item);
+        *mid = A2R(shmc, item);
+        return;
+    }
+    if (item->iflags & ITEM_PROT) LRU_NPROT(shmc, stripe, item->clsid)++;
+
+    item->prev = 0;
+    item->next = *head;
+    if (item->next) R2A(shmc, item->next, shmc_item_t)->prev = A2R(shmc, item);
+    *head = A2R(shmc, item);
+    if (*tail == 0) *tail = A2R(shmc, item);
+
+    shmc_debug("heads[%02d] head %u, next %u\n", item->clsid, *head, item->next);
+    shmc_debug("tails[%02d] tail %u, prev %u\n", item->clsid, *tail, item->prev);
+}
+
+static void item_unlink(shmc_t *shmc, int stripe, shmc_item_t *item)
+{
+    uint32_t *head = &LRU_HEAD(shmc, stripe, item->clsid);
+    uint32_t *tail = &LRU_TAIL(shmc, stripe, item->clsid);
+
+    if (*head == A2R(shmc, item)) {
+        *head = item->next;
+    }
+    if (*tail == A2R(shmc, item)) {
+        *tail = item->prev;
+    }
+    if (CRAWL_AT(shmc, stripe, item->clsid) == A2R(shmc, item)) {
+        CRAWL_AT(shmc, stripe, item->clsid) = item->prev;
+    }
+    if (LRU_MID(shmc, stripe, item->clsid) == A2R(shmc, item)) {
+        LRU_MID(shmc, stripe, item->clsid) = item->next;
+    }
+
+    LRU_COUNT(shmc, stripe, item->clsid)--;
+    shmc->stripes[stripe].used -= item_bytes(shmc, item);
+    if (item->iflags & ITEM_PROT) LRU_NPROT(shmc, stripe, item->clsid)--;
+
+    if (item->next) R2A(shmc, item->next, shmc_item_t)->prev = item->prev;
+    if (item->prev) R2A(shmc, item->prev, shmc_item_t)->next = item->next;
+
+    shmc_debug("heads[%02d] head %u, next %u\n", item->clsid, *head, item->next);
+    shmc_debug("tails[%02d] tail %u, prev %u\n", item->clsid, *tail, item->prev);
+}
+
+static void item_relink(shmc_t *shmc, int stripe, shmc_item_t *item)
+{
+    item_unlink(shmc, stripe, item);
+    item_link(shmc, stripe, item);
+}
+
+/* the last protected items go back to probation while the protected
+ * segment is over its share. it is done by eviction, when the list is as
+ * long as memory lets it be, a short list does not push hits out
+ */
+static void slru_demote(shmc_t *shmc, int stripe, int id)
+{
+    uint32_t *mid = &LRU_MID(shmc, stripe, id);
+    while ((uint64_t) LRU_NPROT(shmc, stripe, id) * 100 > (uint64_t) LRU_COUNT(shmc, stripe, id) * SLRU_PROT_PCT) {
+        shmc_item_t *last = *mid ? R2A(shmc, R2A(shmc, *mid, shmc_item_t)->prev, shmc_item_t) :
+            R2A(shmc, LRU_TAIL(shmc, stripe, id), shmc_item_t);
+        last->iflags &= ~ITEM_PROT;
+        LRU_NPROT(shmc, stripe, id)--;
+        *mid = A2R(shmc, last);
+    }
+}
+
+/* a hit promotes the item to the protected segment */
+static void slru_promote(shmc_t *shmc, int stripe, shmc_item_t *item)
+{
+    item_unlink(shmc, stripe, item);
+    item->iflags |= ITEM_PROT;
+    item_link(shmc, stripe, item);
+}
+
+/* called by readers */
+static void item_hit(shmc_t *shmc, int stripe, shmc_item_t *item)
+{
+    if (shmc->attr->evict_policy == SHMC_EVICT_CLOCK) {
+        /* test first, a hot item is not written again */
+        if (!(__atomic_load_n(&item->iflags, __ATOMIC_RELAXED) & ITEM_REF)) {
+            __atomic_fetch_or(&item->iflags, ITEM_REF, __ATOMIC_RELAXED);
+        }
+    } else {
+        pthread_mutex_lock(&shmc->stripes[stripe].mutex);
+        if (shmc->attr->evict_policy == SHMC_EVICT_SLRU) slru_promote(shmc, stripe, item);
+        else item_relink(shmc, stripe, item);
+        pthread_mutex_unlock(&shmc->stripes[stripe].mutex);
+    }
+}
+
+/* the list tail is the clock hand, a referenced item loses its bit and
+ * goes back to the head, the first unreferenced one is the victim
+ */
+#define CLOCK_SWEEP_MAX 1024
+
+static shmc_item_t *item_victim(shmc_t *shmc, int stripe, int id)
+{
+    if (shmc->attr->evict_policy == SHMC_EVICT_SLRU) slru_demote(shmc, stripe, id);
+
+    shmc_item_t *tail = R2A(shmc, LRU_TAIL(shmc, stripe, id), shmc_item_t);
+    if (shmc->attr->evict_policy != SHMC_EVICT_CLOCK) return tail;
+
+    int sweep;
+    for (sweep = 0; tail && sweep < CLOCK_SWEEP_MAX; ++sweep) {
+        if (!(__atomic_load_n(&tail->iflags, __ATOMIC_RELAXED) & ITEM_REF)) break;
+        __atomic_fetch_and(&tail->iflags, (uint8_t) ~ITEM_REF, __ATOMIC_RELAXED);
+        item_relink(shmc, stripe, tail);
+        tail = R2A(shmc, LRU_TAIL(shmc, stripe, id), shmc_item_t);
+    }
+    return tail;
+}
+
+/* evict from the LRU of stripe from to the magazine of stripe, the caller
+ * holds the write lock of both
+ */
+static int evict_from(shmc_t *shmc, int stripe, int from, int id)
+{
+    uint32_t now = clock_now();
+    shmc_item_t *tail = R2A(shmc, LRU_TAIL(shmc, from, id), shmc_item_t);
+
+    int tries;
+    for (tries = 0; tail && tries < EXPIRED_TRIES; ++tries) {
+        if (item_expired(shmc, tail, now)) break;
+        tail = R2A(shmc, tail->prev, shmc_item_t);
+    }
+
+    int expired = tail && tries < EXPIRED_TRIES;
+    if (!expired) tail = item_victim(shmc, from, id);
+    if (!tail) return 0;
+
+    assoc_delete(shmc, item_key(tail), tail->nkey, tail->hv);
+    item_unlink(shmc, from, tail);
+    item_free(shmc, stripe, tail);
+    if (expired) __atomic_add_fetch(&shmc->attr->reclaimed, 1, __ATOMIC_RELAXED);
+    else __atomic_add_fetch(&shmc->slabs[id].evicted, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* the least recently used of the tails of the own stripe and of a few
+ * others of its namespace picked at random, stripes somebody holds are
+ * left out
+ */
+static int sample_evict(shmc_t *shmc, int stripe, int id)
+{
+    static __thread unsigned seed;
+    if (!seed) seed = clock_ms() ^ (uintptr_t) &seed;
+
+    const int k = ns_stripes(shmc->attr);
+    const int first = stripe - stripe % k;
+    int picked[SAMPLE_STRIPES];
+    int npicked = 0;
+
+    int best = stripe;
+    shmc_item_t *tail = R2A(shmc, LRU_TAIL(shmc, stripe, id), shmc_item_t);
+
+    int i, j;
+    for (i = 0; i < SAMPLE_STRIPES && i < k - 1; ++i) {
+        int other = first + (stripe % k + 1 + rand_r(&seed) % (k - 1)) % k;
+        for (j = 0; j < npicked && picked[j] != other; ++j);
+        if (j < npicked) continue;
+
+        if (!shmc->wrall && stripe_trywrlock(shmc, other) != 0) continue;
+        picked[npicked++] = other;
+
+        shmc_item_t *t = R2A(shmc, LRU_TAIL(shmc, other, id), shmc_item_t);
+        if (t && (!tail || (int32_t) (t->atime - tail->atime) < 0)) {
+            tail = t;
+            best = other;
+        }
+    }
+
+    int evicted = 0;
+    if (tail) {
+        if (best != stripe) seq_write_begin(shmc, best);
+        evicted = evict_from(shmc, stripe, best, id);
+        if (best != stripe) seq_write_end(shmc, best);
+    }
+
+    if (!shmc->wrall) {
+        for (i = 0; i < npicked; ++i) stripe_unlock(shmc, picked[i]);
+    }
+    return evicted;
+}
+
+/* evict from the own stripe first, then from any stripe of its
+ * namespace nobody holds
+ */
+static int item_evict(shmc_t *shmc, int stripe, int id)
+{
+    const int k = ns_stripes(shmc->attr);
+    const int first = stripe - stripe % k;
+
+    if (shmc->attr->evict_policy == SHMC_EVICT_SAMPLED && k > 1 &&
+            sample_evict(shmc, stripe, id)) return 1;
+
+    if (evict_from(shmc, stripe, stripe, id)) return 1;
+
+    int i;
+    for (i = 1; i < k; ++i) {
+        int other = first + (stripe % k + i) % k;
+
+        /* with shmc_wrlock we have them all already */
+        if (!shmc->wrall && stripe_trywrlock(shmc, other) != 0) continue;
+
+        seq_write_begin(shmc, other);
+        int evicted = evict_from(shmc, stripe, other, id);
+        seq_write_end(shmc, other);
+
+        if (!shmc->wrall) stripe_unlock(shmc, other);
+        if (evicted) return 1;
+    }
+    return 0;
+}
+
+/* the counter of hv in a row of the sketch */
+static inline uint8_t *lfu_counter(shmc_t *shmc, size_t width, uint32_t hv, int row)
+{
+    static const uint32_t seeds[LFU_ROWS] = { 0x9e3779b1, 0x85ebca6b, 0xc2b2ae35, 0x27d4eb2f };
+    uint32_t h = hv * seeds[row];
+    h ^= h >> 15;
+    return shmc->sketch + row * width + (h & (width - 1));
+}
+
+static unsigned lfu_estimate(shmc_t *shmc, size_t width, uint32_t hv)
+{
+    unsigned min = LFU_MAX;
+    int row;
+    for (row = 0; row < LFU_ROWS; ++row) {
+        unsigned c = __atomic_load_n(lfu_counter(shmc, width, hv, row), __ATOMIC_RELAXED);
+        if (c < min) min = c;
+    }
+    return min;
+}
+
+/* halve the counters of the next slice of the sketch, a byte at a time
+ * in words. an increment racing with it may be lost, it is only a count
+ */
+#define LFU_SLICES 64
+
+static void lfu_age(shmc_t *shmc, size_t width)
+{
+    size_t slice = LFU_ROWS * width / LFU_SLICES;
+    size_t n = __atomic_fetch_add(&shmc->attr->lfu_aged, 1, __ATOMIC_RELAXED) % LFU_SLICES;
+    uint64_t *w = (uint64_t *) (shmc->sketch + n * slice);
+
+    size_t i;
+    for (i = 0; i < slice / sizeof(uint64_t); ++i) {
+        uint64_t v = __atomic_load_n(&w[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&w[i], (v >> 1) & 0x7f7f7f7f7f7f7f7fULL, __ATOMIC_RELAXED);
+    }
+}
+
+/* a lookup or a write of hv, readers count too, without a lock */
+static void lfu_record(shmc_t *shmc, uint32_t hv)
+{
+    size_t width = lfu_width(shmc->attr);
+    int row;
+    for (row = 0; row < LFU_ROWS; ++row) {
+        uint8_t *c = lfu_counter(shmc, width, hv, row);
+        if (__atomic_load_n(c, __ATOMIC_RELAXED) < LFU_MAX) __atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+    }
+
+    /* the stripes count samples apart, together they age a slice every
+     * LFU_AGE samples per counter of the slice
+     */
+    uint32_t *samples = &shmc->stripes[stripe_of(shmc, hv)].samples;
+    if (__atomic_add_fetch(samples, 1, __ATOMIC_RELAXED) >= LFU_AGE * width / LFU_SLICES) {
+        __atomic_store_n(samples, 0, __ATOMIC_RELAXED);
+        lfu_age(shmc, width);
+    }
+}
+
+/* a new key of class id gets an item if one is free, or if it was asked
+ * for at least as often as the tail it would evict
+ */
+static int lfu_admit(shmc_t *shmc, int stripe, uint32_t hv, int id)
+{
+    /* the free item stays in the magazine for item_alloc. items freed
+     * ahead by shmc_maintain were evicted for new keys, the keys still
+     * have to beat the next victim while memory is full. a namespace
+     * over its quota evicts whether memory is free or not
+     */
+    int over = ns_over(shmc, stripe, id);
+    if (!over && !shmc->attr->free_watermark) {
+        shmc_item_t *item = slab_pop(shmc, stripe, id);
+        if (item) {
+            mag_push(shmc, stripe, item);
+            return 1;
+        }
+    } else if (!over && !mem_full(shmc)) {
+        return 1;
+    }
+    if (!shmc->attr->evict_to_free) return 1;
+
+    shmc_item_t *victim = R2A(shmc, LRU_TAIL(shmc, stripe, id), shmc_item_t);
+    if (!victim || item_expired(shmc, victim, clock_now())) return 1;
+
+    size_t width = lfu_width(shmc->attr);
+    return lfu_estimate(shmc, width, hv) >= lfu_estimate(shmc, width, victim->hv);
+}
+
+/* the cached hash rules out most of the other keys without touching them */
+static inline int item_is(shmc_item_t *item, const char *key, size_t nkey, uint32_t hv)
+{
+    return item->hv == hv && item->nkey == nkey && memcmp(key, item_key(item), nkey) == 0;
+}
+
+/* the link that points to the item of key, a bucket slot or an h_next,
+ * so the caller can unlink or swap it without walking the bucket again
+ */
+static uint32_t *assoc_ref(shmc_t *shmc, shmc_bucket_t *bucket, const char *key, size_t nkey, uint32_t hv)
+{
+    shmc_item_t *item;
+
+    unsigned mask = bucket_match(bucket, tag_of(hv));
+    while (mask) {
+        int i = __builtin_ctz(mask);
+        item = R2A(shmc, bucket->items[i], shmc_item_t);
+        mask &= mask - 1;
+        if (item_is(item, key, nkey, hv)) return &bucket->items[i];
+    }
+
+    /* the bucket is the first step */
+    int depth = 1;
+    uint32_t *ref = &bucket->overflow;
+    while ((item = R2A(shmc, *ref, shmc_item_t))) {
+        if (++depth > shmc->attr->max_depth) {
+            shmc->attr->max_depth = depth;
+        }
+        shmc_debug("assoc[%p]_find item %p item->h_next %u\n", bucket, item, item->h_next);
+        if (item_is(item, key, nkey, hv)) return ref;
+        ref = &item->h_next;
+    }
+    return 0;
+}
+
+/* readers do not see an expired item, it is left to a writer */
+static shmc_item_t *assoc_find(shmc_t *shmc, const char *key, size_t nkey, uint32_t hv)
+{
+    uint32_t *ref = assoc_ref(shmc, assoc_bucket(shmc, hv), key, nkey, hv);
+    shmc_item_t *item = ref ? R2A(shmc, *ref, shmc_item_t) : 0;
+    return item && !item_expired(shmc, item, clock_now()) ? item : 0;
+}
+
+/* drop an expired item, the caller holds the write lock of stripe */
+static void item_reclaim(shmc_t *shmc, int stripe, shmc_bucket_t *bucket, uint32_t *ref, shmc_item_t *item)
+{
+    assoc_unlink(shmc, bucket, ref);
+    item_unlink(shmc, stripe, item);
+    item_free(shmc, stripe, item);
+    __atomic_add_fetch(&shmc->attr->reclaimed, 1, __ATOMIC_RELAXED);
+}
+
+/* assoc_ref for writers, an expired item of key is reclaimed and not found */
+static uint32_t *assoc_ref_live(shmc_t *shmc, shmc_bucket_t *bucket, const char *key, size_t nkey, uint32_t hv)
+{
+    uint32_t *ref = assoc_ref(shmc, bucket, key, nkey, hv);
+    if (ref) {
+        shmc_item_t *item = R2A(shmc, *ref, shmc_item_t);
+        if (item_expired(shmc, item, clock_now())) {
+            item_reclaim(shmc, stripe_of(shmc, hv), bucket, ref, item);
+            return 0;
+        }
+    }
+    return ref;
+}
+
+static void bucket_put(shmc_t *shmc, shmc_bucket_t *bucket, uint8_t tag, shmc_item_t *item)
+{
+    item->h_next = 0;
+
+    int i;
+    for (i = 0; i < BUCKET_SLOTS; ++i) {
+        if (bucket->tags[i] == 0) {
+            bucket->items[i] = A2R(shmc, item);
+            bucket->tags[i] = tag;
+            shmc_debug("assoc[%p]_insert item %p slot %d\n", bucket, item, i);
+            return;
+        }
+    }
+
+    item->h_next = bucket->overflow; /* both of them are R addr */
+    bucket->overflow = A2R(shmc, item);
+    shmc_debug("assoc[%p]_insert item %p item->h_next %u\n", bucket, item, item->h_next);
+}
+
+static void assoc_insert(shmc_t *shmc, uint32_t hv, shmc_item_t *item)
+{
+    __atomic_add_fetch(&shmc->attr->nitems, 1, __ATOMIC_RELAXED);
+    item->hv = hv;
+    bucket_put(shmc, assoc_bucket(shmc, hv), tag_of(hv), item);
+
+    /* callers hold the stripe of hv and are inside its seq_write_begin/end */
+    int stripe = stripe_of(shmc, hv);
+    assoc_migrate(shmc, stripe);
+    assoc_resize(shmc, stripe);
+}
+
+static void assoc_unlink(shmc_t *shmc, shmc_bucket_t *bucket, uint32_t *ref)
+{
+    shmc_item_t *item = R2A(shmc, *ref, shmc_item_t);
+
+    assert(shmc->attr->nitems);
+    __atomic_sub_fetch(&shmc->attr->nitems, 1, __ATOMIC_RELAXED);
+
+    if (ref >= bucket->items && ref < bucket->items + BUCKET_SLOTS) {
+        int i = ref - bucket->items;
+        shmc_debug("assoc[%p]_delete item %p slot %d\n", bucket, item, i);
+
+        /* pull the first overflow item up into the slot */
+        shmc_item_t *up = R2A(shmc, bucket->overflow, shmc_item_t);
+        if (up) {
+            bucket->overflow = up->h_next;
+            up->h_next = 0;
+            bucket->items[i] = A2R(shmc, up);
+            bucket->tags[i] = tag_of(up->hv);
+        } else {
+            bucket->tags[i] = 0;
+            bucket->items[i] = 0;
+        }
+    } else {
+        shmc_debug("assoc[%p]_delete item %p item->h_next %u\n", bucket, item, item->h_next);
+        *ref = item->h_next;  /* both of them are R addr */
+    }
+    item->h_next = 0;
+}
+
+static void assoc_delete(shmc_t *shmc, const char *key, size_t nkey, uint32_t hv)
+{
+    shmc_bucket_t *bucket = assoc_bucket(shmc, hv);
+    uint32_t *ref = assoc_ref(shmc, bucket, key, nkey, hv);
+    if (ref) assoc_unlink(shmc, bucket, ref);
+}
+
+/* put item in the place of the item of the same key and return the old one,
+ * or insert it and return 0. ref is where the caller found the old item, an
+ * alloc in between may have evicted it, so it is checked before it is used
+ */
+static shmc_item_t *assoc_upsert(shmc_t *shmc, uint32_t hv, shmc_item_t *item, uint32_t *ref)
+{
+    const char *key = item_key(item);
+    shmc_item_t *old = ref ? R2A(shmc, *ref, shmc_item_t) : 0;
+
+    if (!old || !item_is(old, key, item->nkey, hv)) {
+        ref = assoc_ref(shmc, assoc_bucket(shmc, hv), key, item->nkey, hv);
+        if (!ref) {
+            assoc_insert(shmc, hv, item);
+            return 0;
+        }
+        old = R2A(shmc, *ref, shmc_item_t);
+    }
+
+    /* same key, same tag */
+    item->hv = hv;
+    item->h_next = old->h_next;
+    *ref = A2R(shmc, item);
+    old->h_next = 0;
+    return old;
+}
+
+/* move the next few old buckets of the stripe to the live index */
+static void assoc_migrate(shmc_t *shmc, int stripe)
+{
+    shmc_attr_t *attr = shmc->attr;
+    uint32_t old = attr->hash_old_nbuckets;
+    uint32_t *cursor = &shmc->stripes[stripe].migrate;
+    if (!old || *cursor >= old) return;
+
+    shmc_bucket_t *from = HASH_TABLE(shmc, !attr->hash_table);
+    shmc_bucket_t *to   = HASH_TABLE(shmc, attr->hash_table);
+
+    int step;
+    for (step = 0; step < MIGRATE_STEP && *cursor < old; ++step) {
+        shmc_bucket_t *bucket = from + *cursor;
+
+        int i;
+        for (i = 0; i < BUCKET_SLOTS; ++i) {
+            if (bucket->tags[i] == 0) continue;
+            shmc_item_t *item = R2A(shmc, bucket->items[i], shmc_item_t);
+            bucket_put(shmc, to + item->hv % attr->hash_nbuckets, bucket->tags[i], item);
+        }
+
+        shmc_item_t *item = R2A(shmc, bucket->overflow, shmc_item_t);
+        while (item) {
+            shmc_item_t *next = R2A(shmc, item->h_next, shmc_item_t);
+            bucket_put(shmc, to + item->hv % attr->hash_nbuckets, tag_of(item->hv), item);
+            item = next;
+        }
+
+        memset(bucket, 0x00, sizeof(shmc_bucket_t));
+        *cursor += attr->nstripes;
+    }
+
+    /* the last stripe done ends the migration */
+    if (*cursor >= old && __atomic_sub_fetch(&attr->hash_pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        attr->hash_old_nbuckets = 0;
+        attr->max_depth = 0;
+    }
+}
+
+/* start a migration if the load is off, the caller holds the stripe and is
+ * inside its seq_write_begin/end. the other stripes are only tried, if one
+ * is busy the next write tries again
+ */
+static void assoc_resize(shmc_t *shmc, int stripe)
+{
+    shmc_attr_t *attr = shmc->attr;
+    if (attr->hash_old_nbuckets || attr->nbuckets_max <= attr->nbuckets) return;
+
+    int n = attr->hash_nbuckets;
+    double slots = (double) n * BUCKET_SLOTS;
+
+    int resize;
+    if ((attr->nitems > attr->load_factor * slots || attr->max_depth > DEPTH_MAX) &&
+            n * 2 <= attr->nbuckets_max) {
+        resize = n * 2;
+    } else if (attr->nitems < attr->load_factor * slots / 4 &&
+            n / 2 >= attr->nbuckets && (n / 2) % attr->nstripes == 0) {
+        resize = n / 2;
+    } else {
+        return;
+    }
+
+    int i;
+    for (i = 0; i < attr->nstripes; ++i) {
+        if (i == stripe || shmc->wrall) continue;
+        if (stripe_trywrlock(shmc, i) != 0) {
+            while (--i >= 0) {
+                if (i != stripe) stripe_unlock(shmc, i);
+            }
+            return;
+        }
+    }
+
+    for (i = 0; i < attr->nstripes; ++i) {
+        if (i != stripe) seq_write_begin(shmc, i);
+    }
+
+    int table = !attr->hash_table;
+    memset(HASH_TABLE(shmc, table), 0x00, sizeof(shmc_bucket_t) * resize);
+    for (i = 0; i < attr->nstripes; ++i) {
+        shmc->stripes[i].migrate = i;
+    }
+    attr->hash_pending = attr->nstripes;
+    attr->hash_old_nbuckets = n;
+    attr->hash_nbuckets = resize;
+    attr->hash_table = table;
+    attr->hash_resizes++;
+
+    for (i = 0; i < attr->nstripes; ++i) {
+        if (i != stripe) seq_write_end(shmc, i);
+    }
+
+    for (i = 0; i < attr->nstripes; ++i) {
+        if (i != stripe && !shmc->wrall) stripe_unlock(shmc, i);
+    }
+}
+
+/* a released page from the pool, or a page never used, the caller holds
+ * shmc->mutex
+ */
+static size_t page_get(shmc_t *shmc)
+{
+    shmc_attr_t *attr = shmc->attr;
+    size_t len = slab_page_size(attr);
+
+    if (attr->pages_free) {
+        uint8_t *p = memchr(shmc->pages, PAGE_FREE, attr->mem_used / len);
+        assert(p);
+        attr->pages_free--;
+        return p - shmc->pages;
+    }
+
+    if (attr->mem_used + len < attr->mem_limit) {
+        size_t page = attr->mem_used / len;
+        attr->mem_used += len;
+        return page;
+    }
+    return PAGE_NONE;
+}
+
+/* take page from its class and release it to the pool */
+static void page_put(shmc_t *shmc, size_t page)
+{
+    shmc->slabs[shmc->pages[page]].pages--;
+    shmc->pages[page] = PAGE_FREE;
+    shmc->attr->pages_free++;
+    mmap_release(shmc->raw + page * slab_page_size(shmc->attr), slab_page_size(shmc->attr));
+}
+
+/* put item in the magazine of stripe */
+static void mag_push(shmc_t *shmc, int stripe, shmc_item_t *item)
+{
+    item->iflags = ITEM_MAG;
+    item->next = MAG_HEAD(shmc, stripe, item->clsid);
+    MAG_HEAD(shmc, stripe, item->clsid) = A2R(shmc, item);
+    MAG_COUNT(shmc, stripe, item->clsid)++;
+}
+
+/* n items of the magazine back to the slab, the caller holds shmc->mutex */
+static void mag_drain(shmc_t *shmc, int stripe, int id, uint32_t n)
+{
+    shmc_slab_t *slab = &shmc->slabs[id];
+    shmc_item_t *item;
+
+    while (n-- && (item = R2A(shmc, MAG_HEAD(shmc, stripe, id), shmc_item_t))) {
+        MAG_HEAD(shmc, stripe, id) = item->next;
+        MAG_COUNT(shmc, stripe, id)--;
+
+        item->iflags = ITEM_FREE;
+        item->next = slab->free_item;
+        slab->free_item = A2R(shmc, item);
+        slab->nfree++;
+    }
+}
+
+/* every magazine back to the slabs, the caller holds all the stripes and
+ * shmc->mutex
+ */
+static void mag_drain_all(shmc_t *shmc)
+{
+    int s, id;
+    for (s = 0; s < shmc->attr->nstripes; ++s) {
+        for (id = 0; id < shmc->attr->slabs_count; ++id) {
+            mag_drain(shmc, s, id, UINT32_MAX);
+        }
+    }
+}
+
+/* pop a free item of slab id from the magazine of stripe. an empty one is
+ * refilled from the slab in one go, a new page is carved if the slab is
+ * empty too
+ */
+static shmc_item_t *slab_pop(shmc_t *shmc, int stripe, int id)
+{
+    if (!MAG_HEAD(shmc, stripe, id)) {
+        pthread_mutex_lock(shmc->mutex);
+
+        /* with shmc_wrlock the other magazines are ours too, they go
+         * before a new page so an atomic batch gets what it counted
+         */
+        if (!shmc->slabs[id].nfree && shmc->wrall) mag_drain_all(shmc);
+
+        if (!shmc->slabs[id].nfree) {
+            /* alloc from mem pool */
+            size_t page = page_get(shmc);
+            if (page != PAGE_NONE) slab_carve(shmc, id, page);
+        }
+
+        int i;
+        shmc_item_t *item;
+        for (i = 0; i < MAG_BATCH && (item = slab_take(shmc, id)); ++i) {
+            mag_push(shmc, stripe, item);
+        }
+
+        pthread_mutex_unlock(shmc->mutex);
+    }
+
+    shmc_item_t *item = R2A(shmc, MAG_HEAD(shmc, stripe, id), shmc_item_t);
+    if (item) {
+        MAG_HEAD(shmc, stripe, id) = item->next;
+        MAG_COUNT(shmc, stripe, id)--;
+        item->iflags = 0;
+    }
+    return item;
+}
+
+/* a class that keeps failing to pop asks the automover for a page */
+#define SLAB_MOVE_PRESSURE 64
+#define SLAB_MOVE_TRIES    4   /* donor pages tried by one move */
+
+static void slab_starve(shmc_t *shmc, int id)
+{
+    if (__atomic_add_fetch(&shmc->slabs[id].pressure, 1, __ATOMIC_RELAXED) >= SLAB_MOVE_PRESSURE) {
+        __atomic_store_n(&shmc->attr->slabs_starving, id + 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* a writer of another stripe may take what we evicted, try a few times */
+#define ALLOC_TRIES 4
+
+/* an item of class id would take the namespace of stripe over its quota */
+static int ns_over(shmc_t *shmc, int stripe, int id)
+{
+    int ns = ns_of_stripe(shmc, stripe);
+    size_t quota = __atomic_load_n(&shmc->spaces[ns].quota, __ATOMIC_RELAXED);
+    return quota && shmc_ns_used(shmc, ns) + shmc->slabs[id].size > quota;
+}
+
+/* a namespace over its quota evicts its own items, of class id or else
+ * of the largest class it has, before it takes more memory. 0 if it can
+ * not get under
+ */
+static int ns_room(shmc_t *shmc, int stripe, int id)
+{
+    shmc_ns_t *space = &shmc->spaces[ns_of_stripe(shmc, stripe)];
+    int tries, c;
+
+    for (tries = 0; ns_over(shmc, stripe, id); ++tries) {
+        if (!shmc->attr->evict_to_free || tries == ALLOC_TRIES) return 0;
+
+        int evicted = item_evict(shmc, stripe, id);
+        for (c = shmc->attr->slabs_count - 1; !evicted && c >= 0; --c) {
+            if (c != id) evicted = item_evict(shmc, stripe, c);
+        }
+        if (!evicted) return 0;
+        __atomic_add_fetch(&space->evicted, 1, __ATOMIC_RELAXED);
     }
-    return value;
+    return 1;
 }
 
-static SHMC_RC shmc_arithmetic(shmc_t *shmc, const char *key, size_t nkey, uint64_t val, int incr,
-        uint64_t *new_val, uint32_t *flags)
+/* pop an item of slab id, evict from its LRU lists if the slab is empty */
+static shmc_item_t *item_pop(shmc_t *shmc, int stripe, int id)
 {
-    uint64_t old_val;
-    uint32_t old_flags = 0;
-    shmc_item_t *new_item;
-    shmc_item_t *old_item;
-    
-    old_item = assoc_find(shmc, key, nkey);
+    if (!ns_room(shmc, stripe, id)) return 0;
 
-    if (old_item) {
-        old_val = safe_strtoull(R2A(shmc, old_item->val, char), old_item->nval);
-        old_flags = old_item->flags;
+    shmc_item_t *item = slab_pop(shmc, stripe, id);
+    if (!item) slab_starve(shmc, id);
 
-        if (old_item->nval == UINT64_SIZE) {
-            new_item = old_item;
-        } else {
-            /* if old item is not digit */
-            new_item = item_alloc(shmc, nkey, UINT64_SIZE);
-            if (new_item) {
-                /* if allow new success, delete old */
-                assoc_delete(shmc, key, nkey);
-                item_unlink(shmc, old_item);
-                item_free(shmc, old_item);
-            }
+    int tries;
+    for (tries = 0; !item && tries < ALLOC_TRIES; ++tries) {
+        /* LRU */
+        if (!shmc->attr->evict_to_free || !item_evict(shmc, stripe, id)) break;
+        item = slab_pop(shmc, stripe, id);
+    }
+
+    if (!item) return item;
+
+    item->clsid  = id;
+    item->iflags = 0;
+    item->exptime = 0;
+    item->gen    = flush_gen(shmc, clock_now());
+    item->next   = item->prev = item->h_next = 0;
+    return item;
+}
+
+/* a head of the last class and the chunks, all or nothing */
+static shmc_item_t *chain_alloc(shmc_t *shmc, int stripe, size_t nkey, size_t nval)
+{
+    shmc_slab_t *last = slab_last(shmc);
+    shmc_item_t *head = item_pop(shmc, stripe, shmc->attr->slabs_count - 1);
+    if (!head) return head;
+
+    head->iflags = ITEM_CHAIN;
+    head->nkey   = nkey;
+    head->nval   = nval;
+
+    uint32_t first = 0;
+    memcpy(item_val(head), &first, sizeof(uint32_t));
+
+    size_t len = last->size - sizeof(shmc_item_t) - nkey - sizeof(uint32_t);
+    size_t left = nval > len ? nval - len : 0;
+
+    shmc_item_t *tail = 0;
+    while (left) {
+        /* chunks are reclaimed only with their head, so the tail takes a
+         * free item of its best fit class but never evicts for it
+         */
+        int id = shmc->attr->slabs_count - 1;
+        shmc_item_t *chunk = 0;
+        if (!item_needs_chain(shmc, 0, left)) {
+            chunk = slab_pop(shmc, stripe, item_clsid(shmc, 0, left));
+            if (chunk) id = item_clsid(shmc, 0, left);
         }
-    } else {
-        if (shmc->attr->default_counter) {
-            old_val = 0;
-            new_item = item_alloc(shmc, nkey, UINT64_SIZE);
+        if (!chunk) chunk = item_pop(shmc, stripe, id);
+        if (!chunk) {
+            item_free(shmc, stripe, head);
+            return 0;
+        }
+
+        chunk->clsid  = id;
+        chunk->iflags = 0;
+        chunk->hv     = 0;
+        chunk->h_next = 0;
+        chunk->nkey = 0;
+        chunk->nval = shmc->slabs[id].size - sizeof(shmc_item_t);
+        if (chunk->nval > left) chunk->nval = left;
+        left -= chunk->nval;
+
+        if (tail) {
+            tail->h_next = A2R(shmc, chunk);
         } else {
-            return SHMC_NOTFOUND;
+            first = A2R(shmc, chunk);
+            memcpy(item_val(head), &first, sizeof(uint32_t));
         }
+        tail = chunk;
     }
+    return head;
+}
 
-    if (!new_item) return SHMC_NOMEMORY;
+/* callers are inside seq_write_begin/end, so is the eviction below */
+static shmc_item_t *item_alloc(shmc_t *shmc, int stripe, size_t nkey, size_t nval)
+{
+    assert(item_size_ok(shmc, nkey, nval));
 
-    /* if new item, initialize */
-    if (new_item != old_item) {
-        assoc_insert(shmc, key, nkey, new_item);
-        item_link(shmc, new_item);
+    if (item_needs_chain(shmc, nkey, nval)) return chain_alloc(shmc, stripe, nkey, nval);
 
-        new_item->flags = old_flags; 
-        memcpy(R2A(shmc, new_item->key, char), key, nkey);
-        memset(R2A(shmc, new_item->val, char), ' ', UINT64_SIZE);
+    shmc_item_t *item = item_pop(shmc, stripe, item_clsid(shmc, nkey, nval));
+    if (!item) return item;
 
-        if (flags) new_item->flags = *flags;
-    }
+    item->nkey   = nkey;
+    item->nval   = nval;
+    return item;
+}
 
-    if (flags) *flags = new_item->flags;
+/* read or write n bytes of the value from off, across the chunks */
+static void item_io(shmc_t *shmc, shmc_item_t *item, size_t off, char *buf, size_t n, int write)
+{
+    char *data = item_val(item);
+    size_t len = item->nval;
+    uint32_t next = 0;
+
+    if (item->iflags & ITEM_CHAIN) {
+        memcpy(&next, data, sizeof(uint32_t));
+        data += sizeof(uint32_t);
+        len = shmc->slabs[item->clsid].size - sizeof(shmc_item_t) - item->nkey - sizeof(uint32_t);
+    }
 
-    if (incr) {
-        *new_val = old_val + val; 
-    } else {
-        if (old_val < val) {
-            *new_val = 0;
+    for (;;) {
+        if (off < len) {
+            size_t k = len - off < n ? len - off : n;
+            if (write) memcpy(data + off, buf, k);
+            else memcpy(buf, data + off, k);
+            buf += k;
+            n -= k;
+            off = 0;
         } else {
-            *new_val = old_val - val;
+            off -= len;
         }
-    }
-    sprintf(R2A(shmc, new_item->val, char), "%"PRIu64, *new_val);
+        if (!n) break;
 
-    return SHMC_OK;
+        shmc_item_t *chunk = R2A(shmc, next, shmc_item_t);
+        assert(chunk);
+        data = chunk->end;
+        len  = chunk->nval;
+        next = chunk->h_next;
+    }
 }
 
-SHMC_RC shmc_incr_nolock(shmc_t *shmc, const char *key, size_t nkey, uint64_t val, uint64_t *new_val, uint32_t *flags)
+static void item_read(shmc_t *shmc, shmc_item_t *item, size_t off, char *buf, size_t n)
 {
-    return shmc_arithmetic(shmc, key, nkey, val, 1, new_val, flags);
+    item_io(shmc, item, off, buf, n, 0);
 }
 
-SHMC_RC shmc_decr_nolock(shmc_t *shmc, const char *key, size_t nkey, uint64_t val, uint64_t *new_val, uint32_t *flags)
+static void item_write(shmc_t *shmc, shmc_item_t *item, size_t off, const char *buf, size_t n)
 {
-    return shmc_arithmetic(shmc, key, nkey, val, 0, new_val, flags);
+    item_io(shmc, item, off, (char *) buf, n, 1);
 }
 
-SHMC_RC shmc_del_nolock(shmc_t *shmc, const char *key, size_t nkey)
+/* a value of compress_min bytes or more is stored as its size, 4 bytes,
+ * and the lz stream if that is smaller. return the packed size and the
+ * malloced *buf, or 0 to store the value as it is
+ */
+static size_t val_pack(shmc_t *shmc, const char *val, size_t nval, char **buf)
 {
-    shmc_item_t *item = assoc_find(shmc, key, nkey);
-    if (!item) return SHMC_NOTFOUND;
-
-    assoc_delete(shmc, key, nkey);
-    item_unlink(shmc, item);
+    *buf = 0;
+    size_t min = shmc->attr->compress_min;
+    if (!min || nval < min || nval <= sizeof(uint32_t) + 1) return 0;
+
+    *buf = malloc(nval - 1);
+    if (!*buf) return 0;
+
+    size_t n = lz_compress(val, nval, *buf + sizeof(uint32_t), nval - 1 - sizeof(uint32_t));
+    if (!n) {
+        free(*buf);
+        *buf = 0;
+        return 0;
+    }
 
-    item_free(shmc, item);
-    return SHMC_OK;
+    uint32_t size = nval;
+    memcpy(*buf, &size, sizeof(uint32_t));
+    return sizeof(uint32_t) + n;
 }
 
-SHMC_RC shmc_dump_nolock(shmc_t *shmc, const char *file)
+/* the size of the value as it was stored */
+static size_t item_nval(shmc_t *shmc, shmc_item_t *item)
 {
-    FILE *fp = fopen(file, "w");
-    if (!fp) {
-        return SHMC_SYSTEM; 
-    }
+    item = item_body(shmc, item);
+    if (!(item->iflags & ITEM_LZ)) return item->nval;
 
-    int i;
-    shmc_item_t *item, *next;
-    for (i = 0; i < shmc->attr->slabs_count; ++i) {
-        for (item = shmc->heads[i]; item; item = next) {
-            shmc_item_t *it = R2A(shmc, item, shmc_item_t);
-            fprintf(fp, "%d %d %.*s %.*s\n", (int) it->nkey, (int) it->nval,
-                    (int) it->nkey, R2A(shmc, it->key, char), (int) it->nval, R2A(shmc, it->val, char));
-            next = it->next;
-        }
-    }
-
-    fclose(fp);
-    return SHMC_OK;
+    uint32_t size;
+    item_read(shmc, item, 0, (char *) &size, sizeof(uint32_t));
+    return size;
 }
 
-SHMC_RC shmc_load_nolock(shmc_t *shmc, const char *file)
+/* the first n bytes of the value, unpacked if it is compressed. -1 if
+ * there is no memory for a chained stream or the stream is broken
+ */
+static int item_value(shmc_t *shmc, shmc_item_t *item, char *buf, size_t n)
 {
-    FILE *fp = fopen(file, "r");
-    if (!fp) {
-        return SHMC_SYSTEM;
+    item = item_body(shmc, item);
+    if (!(item->iflags & ITEM_LZ)) {
+        item_read(shmc, item, 0, buf, n);
+        return 0;
     }
 
-    const size_t BUFFER_SIZE = 1024 * 1024 + 1024;
-    char *buffer = malloc(BUFFER_SIZE);
-    if (!buffer) {
-        fclose(fp);
-        return SHMC_SYSTEM;
+    char *lz = item_val(item);
+    if (item->iflags & ITEM_CHAIN) {
+        lz = malloc(item->nval);
+        if (!lz) return -1;
+        item_read(shmc, item, 0, lz, item->nval);
     }
 
-    SHMC_RC rc = SHMC_OK;
+    size_t m = lz_decompress(lz + sizeof(uint32_t), item->nval - sizeof(uint32_t), buf, n);
+    if (lz != item_val(item)) free(lz);
+    return m == n ? 0 : -1;
+}
 
-    size_t nbuffer, offset = 0;
-    while ((nbuffer = fread(buffer + offset, 1, BUFFER_SIZE - offset, fp))) {
-        nbuffer += offset;
-        offset = 0;
-        while (rc == SHMC_OK) {
-            /* nkey nval key val\n */
-            char *nkeyp = buffer + offset;
+/* the item holding the value bytes, the shared one of a deduped item */
+static shmc_item_t *item_body(shmc_t *shmc, shmc_item_t *item)
+{
+    if (!(item->iflags & ITEM_DEDUP)) return item;
 
-            char *nvalp = memchr(nkeyp, ' ', nbuffer - (nkeyp - buffer));
-            if (!nvalp || nvalp + 1 == buffer + nbuffer) break;
+    uint32_t slot;
+    memcpy(&slot, item_val(item), sizeof(uint32_t));
+    return R2A(shmc, shmc->dedup[slot], shmc_item_t);
+}
 
-            *nvalp = '\0';
-            size_t nkey = atoi(nkeyp);
-            *nvalp = ' ';
-            nvalp += 1;
+/* a value is put at most DEDUP_PROBE slots past where it hashes to, so a
+ * lookup never probes further, however many slots are dead
+ */
+#define DEDUP_PROBE 64
 
-            char *key = memchr(nvalp, ' ', nbuffer - (nvalp - buffer));
-            if (!key || key + 1 == buffer + nbuffer) break;
+/* the slot of the value, or a slot to put it in, -1 if there is none
+ * in reach
+ */
+static long dedup_find(shmc_t *shmc, uint32_t hv, const char *val, size_t nval, int lz)
+{
+    size_t nslots = dedup_nslots(shmc->attr);
+    size_t probe = nslots < DEDUP_PROBE ? nslots : DEDUP_PROBE;
+    size_t i, slot = hv % nslots;
+    long empty = -1;
+
+    for (i = 0; i < probe; ++i, slot = (slot + 1) % nslots) {
+        uint32_t r = shmc->dedup[slot];
+        if (r == 0) return empty >= 0 ? empty : (long) slot;
+        if (r == DEDUP_DEAD) {
+            if (empty < 0) empty = slot;
+            continue;
+        }
 
-            *key = '\0';
-            size_t nval = atoi(nvalp);
-            *key = ' ';
-            key += 1;
+        shmc_item_t *body = R2A(shmc, r, shmc_item_t);
+        if (body->hv == hv && body->nval == nval && !(body->iflags & ITEM_LZ) == !lz &&
+                memcmp(item_val(body), val, nval) == 0) return slot;
+    }
+    return empty;
+}
 
-            if (key + nkey + 1 + nval + 1 > buffer + nbuffer) break;
-            char *val = key + nkey + 1;
+/* clear the dead slots no lookup has to pass any more. a used slot never
+ * moves, its items keep it, so the table is swept backwards keeping the
+ * dead slots between a value and where it hashes to. two rounds, the
+ * first only learns what wraps around
+ */
+static void dedup_purge(shmc_t *shmc)
+{
+    shmc_attr_t *attr = shmc->attr;
+    size_t nslots = dedup_nslots(attr), cover = 0, i;
 
-            rc = shmc_set_nolock(shmc, key, nkey, val, nval, 0);
-            if (rc != SHMC_OK) break;
+    for (i = 2 * nslots; i > 0; --i) {
+        size_t slot = (i - 1) % nslots;
+        uint32_t r = shmc->dedup[slot];
 
-            offset = (key + nkey + 1 + nval + 1) - buffer;
+        if (r == DEDUP_DEAD && !cover && i <= nslots) {
+            shmc->dedup[slot] = 0;
+            attr->dedup_dead--;
         }
-
-        if (rc == SHMC_OK) {
-            if (offset == 0) {
-                rc = SHMC_ESIZE;
-                break;
-            } else if (nbuffer != offset) {
-                memmove(buffer, buffer + offset, nbuffer - offset);
-                offset = nbuffer - offset;
-            }
-        } else {
-            break;
+        if (cover) cover--;
+        if (r && r != DEDUP_DEAD) {
+            /* the slots back to where it hashes to */
+            size_t home = R2A(shmc, r, shmc_item_t)->hv % nslots;
+            size_t d = (slot + nslots - home) % nslots;
+            if (d > cover) cover = d;
         }
     }
-
-    free(buffer);
-    fclose(fp);
-    return rc;
 }
 
-static void shmc_fcntl(shmc_t *shmc, int type)
-{
-    struct flock lock;
-    lock.l_type   = type;
-    lock.l_start  = 0;
-    lock.l_whence = SEEK_SET;
-    lock.l_len    = 0;
-
-    fcntl(shmc->fd, F_SETLKW, &lock);
-}
+#define dedup_live(r) ((r) && (r) != DEDUP_DEAD)
 
-void shmc_rdlock(shmc_t *shmc)
+/* a slot of the shared value, put there if it is new. -1 if it can not
+ * be shared, the table is 3/4 full or there is no memory
+ */
+static long dedup_get(shmc_t *shmc, int stripe, const char *val, size_t nval, int lz)
 {
-    if (shmc->attr->use_flock) {
-        shmc_fcntl(shmc, F_RDLCK);
-    } else {
-        pthread_rwlock_rdlock(shmc->lock); 
+    shmc_attr_t *attr = shmc->attr;
+    uint32_t hv = hash(val, nval, 0);
+    shmc_item_t *body = 0;
+
+    for (;;) {
+        pthread_mutex_lock(shmc->mutex);
+        long slot = dedup_find(shmc, hv, val, nval, lz);
+        if (slot >= 0 && dedup_live(shmc->dedup[slot])) {
+            R2A(shmc, shmc->dedup[slot], shmc_item_t)->next++;
+            pthread_mutex_unlock(shmc->mutex);
+            /* another stripe put it there meanwhile */
+            if (body) item_free(shmc, stripe, body);
+            return slot;
+        }
+
+        int full = slot < 0 || attr->dedup_values >= dedup_nslots(attr) / 4 * 3;
+        if (body && !full) {
+            body->next = 1;
+            body->prev = slot;
+            if (shmc->dedup[slot] == DEDUP_DEAD) attr->dedup_dead--;
+            shmc->dedup[slot] = A2R(shmc, body);
+            attr->dedup_values++;
+            pthread_mutex_unlock(shmc->mutex);
+            return slot;
+        }
+        pthread_mutex_unlock(shmc->mutex);
+
+        if (body) item_free(shmc, stripe, body);
+        if (body || full) return -1;
+
+        /* the alloc may evict, the table is not held meanwhile */
+        body = item_pop(shmc, stripe, item_clsid(shmc, 0, nval));
+        if (!body) return -1;
+
+        body->nkey   = 0;
+        body->nval   = nval;
+        body->hv     = hv;
+        body->flags  = 0;
+        body->h_next = 0;
+        body->iflags = ITEM_SHARED | (lz ? ITEM_LZ : 0);
+        memcpy(item_val(body), val, nval);
     }
-    shmc_debug("enter read lock\n");
 }
 
-void shmc_wrlock(shmc_t *shmc)
+/* drop a user of the shared value in slot, the value if it was the last
+ * one. the caller holds shmc->mutex
+ */
+static shmc_item_t *dedup_unref(shmc_t *shmc, uint32_t slot)
 {
-    if (shmc->attr->use_flock) {
-        shmc_fcntl(shmc, F_WRLCK);
-    } else {
-        pthread_rwlock_wrlock(shmc->lock); 
+    shmc_attr_t *attr = shmc->attr;
+    shmc_item_t *body = R2A(shmc, shmc->dedup[slot], shmc_item_t);
+
+    if (--body->next) return 0;
+
+    shmc->dedup[slot] = DEDUP_DEAD;
+    attr->dedup_dead++;
+    /* no item has a slot any more, clean up the dead ones */
+    if (--attr->dedup_values == 0) {
+        memset(shmc->dedup, 0x00, sizeof(uint32_t) * dedup_nslots(attr));
+        attr->dedup_dead = 0;
+    } else if (attr->dedup_dead > dedup_nslots(attr) / 4) {
+        dedup_purge(shmc);
     }
-    shmc_debug("enter write lock\n");
+    return body;
 }
 
-void shmc_unlock(shmc_t *shmc)
+static void dedup_put(shmc_t *shmc, int stripe, uint32_t slot)
 {
-    if (shmc->attr->use_flock) {
-        shmc_fcntl(shmc, F_UNLCK);
-    } else {
-        pthread_rwlock_unlock(shmc->lock); 
-    }
-    shmc_debug("leave lock\n");
+    pthread_mutex_lock(shmc->mutex);
+    shmc_item_t *body = dedup_unref(shmc, slot);
+    pthread_mutex_unlock(shmc->mutex);
+
+    if (body) item_free(shmc, stripe, body);
 }
 
-static void item_link(shmc_t *shmc, shmc_item_t *item)
+/* a shared value moves to to, its users find it by the slot. readers of
+ * any stripe may be on it, so it moves only when all are held
+ */
+static int dedup_move(shmc_t *shmc, int stripe, shmc_item_t *item)
 {
-    shmc_item_t **head = &shmc->heads[item->clsid];
-    shmc_item_t **tail = &shmc->tails[item->clsid];
+    if (!shmc->wrall) return 0;
 
-    item->prev = 0;
-    item->next = *head;
-    if (item->next) R2A(shmc, item->next, shmc_item_t)->prev = A2R(shmc, item);
-    *head = A2R(shmc, item);
-    if (*tail == 0) *tail = A2R(shmc, item);
+    int s;
+    for (s = 0; s < shmc->attr->nstripes; ++s) {
+        if (s != stripe) seq_write_begin(shmc, s);
+    }
+
+    shmc_item_t *to = slab_take(shmc, item->clsid);
+    assert(to);
+    memcpy(to, item, sizeof(shmc_item_t) + item->nval);
+    shmc->dedup[item->prev] = A2R(shmc, to);
+    item->iflags = ITEM_FREE;
 
-    shmc_debug("heads[%02d] head %p, next %p\n", item->clsid, *head, item->next);
-    shmc_debug("tails[%02d] tail %p, prev %p\n", item->clsid, *tail, item->prev);
+    for (s = 0; s < shmc->attr->nstripes; ++s) {
+        if (s != stripe) seq_write_end(shmc, s);
+    }
+    return 1;
 }
 
-static void item_unlink(shmc_t *shmc, shmc_item_t *item)
+/* give item back to the magazine of stripe, the caller holds its write
+ * lock. half of a full magazine goes back to the slab
+ */
+static void item_free(shmc_t *shmc, int stripe, shmc_item_t *item)
 {
-    shmc_item_t **head = &shmc->heads[item->clsid];
-    shmc_item_t **tail = &shmc->tails[item->clsid];
+    int id = item->clsid;
 
-    if (*head == A2R(shmc, item)) {
-        *head = item->next;
+    if (item->iflags & ITEM_DEDUP) {
+        uint32_t slot;
+        memcpy(&slot, item_val(item), sizeof(uint32_t));
+        dedup_put(shmc, stripe, slot);
     }
-    if (*tail == A2R(shmc, item)) {
-        *tail = item->prev;
+
+    if (item->iflags & ITEM_CHAIN) {
+        uint32_t next;
+        memcpy(&next, item_val(item), sizeof(uint32_t));
+        while (next) {
+            shmc_item_t *chunk = R2A(shmc, next, shmc_item_t);
+            next = chunk->h_next;
+            mag_push(shmc, stripe, chunk);
+            if (MAG_COUNT(shmc, stripe, chunk->clsid) > MAG_MAX) {
+                pthread_mutex_lock(shmc->mutex);
+                mag_drain(shmc, stripe, chunk->clsid, MAG_BATCH);
+                pthread_mutex_unlock(shmc->mutex);
+            }
+        }
     }
 
-    if (item->next) R2A(shmc, item->next, shmc_item_t)->prev = item->prev;
-    if (item->prev) R2A(shmc, item->prev, shmc_item_t)->next = item->next;
+    mag_push(shmc, stripe, item);
+    if (MAG_COUNT(shmc, stripe, id) > MAG_MAX) {
+        pthread_mutex_lock(shmc->mutex);
+        mag_drain(shmc, stripe, id, MAG_BATCH);
+        pthread_mutex_unlock(shmc->mutex);
+    }
+    shmc_debug("stripe %d slabs[%02d] add %u\n", stripe, id, A2R(shmc, item));
+}
+
+/* copy a live item to a free item of its class in another page, the
+ * caller holds shmc->mutex and the free list has one to spare
+ */
+static int item_move(shmc_t *shmc, int stripe, shmc_item_t *item)
+{
+    if (item->iflags & ITEM_SHARED) return dedup_move(shmc, stripe, item);
+
+    int s = stripe_of(shmc, item->hv);
+    int other = s != stripe && !shmc->wrall;
+    if (other && stripe_trywrlock(shmc, s) != 0) return 0;
+    if (s != stripe) seq_write_begin(shmc, s);
+
+    /* an item out of the index is held by a writer between alloc and link */
+    int moved = 0;
+    uint32_t *ref = assoc_ref(shmc, assoc_bucket(shmc, item->hv), item_key(item), item->nkey, item->hv);
+    if (ref && *ref == A2R(shmc, item)) {
+        shmc_slab_t *slab = &shmc->slabs[item->clsid];
+        shmc_item_t *to = slab_take(shmc, item->clsid);
+        assert(to);
+
+        memcpy(to, item, (item->iflags & ITEM_CHAIN) ? slab->size : sizeof(shmc_item_t) + item->nkey + item->nval);
+        *ref = A2R(shmc, to);
+
+        /* same place in the LRU list */
+        if (to->prev) R2A(shmc, to->prev, shmc_item_t)->next = A2R(shmc, to);
+        else LRU_HEAD(shmc, s, to->clsid) = A2R(shmc, to);
+        if (to->next) R2A(shmc, to->next, shmc_item_t)->prev = A2R(shmc, to);
+        else LRU_TAIL(shmc, s, to->clsid) = A2R(shmc, to);
+        if (CRAWL_AT(shmc, s, to->clsid) == A2R(shmc, item)) CRAWL_AT(shmc, s, to->clsid) = A2R(shmc, to);
+        if (LRU_MID(shmc, s, to->clsid) == A2R(shmc, item)) LRU_MID(shmc, s, to->clsid) = A2R(shmc, to);
+
+        item->iflags = ITEM_FREE;
+        moved = 1;
+    }
 
-    shmc_debug("heads[%02d] head %p, next %p\n", item->clsid, *head, item->next);
-    shmc_debug("tails[%02d] tail %p, prev %p\n", item->clsid, *tail, item->prev);
+    if (s != stripe) seq_write_end(shmc, s);
+    if (other) stripe_unlock(shmc, s);
+    return moved;
 }
 
-static void item_relink(shmc_t *shmc, shmc_item_t *item)
+/* move the chunks of slab id in [low, high) to free items of the class
+ * elsewhere and point the link before each to the copy, the first chunk
+ * is linked from the value of the head. chunks are not in the index, the
+ * chains are found from the heads on the LRU lists of the last class.
+ * the caller holds shmc->mutex, 0 if a stripe or a free item is missing
+ */
+static int chunk_move(shmc_t *shmc, int stripe, int id, char *low, char *high)
 {
-    item_unlink(shmc, item);
-    item_link(shmc, item);
+    int last = shmc->attr->slabs_count - 1, s, moved = 1;
+
+    for (s = 0; s < shmc->attr->nstripes && moved; ++s) {
+        int other = s != stripe && !shmc->wrall;
+        if (other && stripe_trywrlock(shmc, s) != 0) return 0;
+        if (s != stripe) seq_write_begin(shmc, s);
+
+        uint32_t next = LRU_HEAD(shmc, s, last);
+        while (next && moved) {
+            shmc_item_t *head = R2A(shmc, next, shmc_item_t);
+            next = head->next;
+            if (!(head->iflags & ITEM_CHAIN)) continue;
+
+            char *link = item_val(head);
+            uint32_t r;
+            for (memcpy(&r, link, sizeof(uint32_t)); r; memcpy(&r, link, sizeof(uint32_t))) {
+                shmc_item_t *chunk = R2A(shmc, r, shmc_item_t);
+                if (chunk->clsid == id && (char *) chunk >= low && (char *) chunk < high) {
+                    shmc_item_t *to = slab_take(shmc, id);
+                    if (!to) {
+                        moved = 0;
+                        break;
+                    }
+                    memcpy(to, chunk, sizeof(shmc_item_t) + chunk->nval);
+                    chunk->iflags = ITEM_FREE;
+                    chunk = to;
+                    r = A2R(shmc, to);
+                    memcpy(link, &r, sizeof(uint32_t));
+                }
+                link = (char *) &chunk->h_next;
+            }
+        }
+
+        if (s != stripe) seq_write_end(shmc, s);
+        if (other) stripe_unlock(shmc, s);
+    }
+    return moved;
 }
 
-static shmc_item_t *assoc_find(shmc_t *shmc, const char *key, size_t nkey)
+/* empty a page of slab id, its free items leave the free list and the
+ * live ones move out. on failure the page is given back as it is now
+ */
+static int slab_drain(shmc_t *shmc, int stripe, int id, size_t page)
 {
-    int depth = 0;
-    uint32_t hv = hash(key, nkey, 0);
-    shmc_item_t *item = R2A(shmc, shmc->buckets[hv % shmc->attr->nbuckets], shmc_item_t);
-    while (item) {
-        if (++depth > shmc->attr->max_depth) {
-            shmc->attr->max_depth = depth;
+    shmc_slab_t *slab = &shmc->slabs[id];
+    char *low  = shmc->raw + page * slab_page_size(shmc->attr);
+    char *high = low + slab->size * slab->count;
+    shmc_item_t *item;
+    char *p;
+
+    /* items past end_item were never used */
+    uint32_t nend = 0;
+    if (slab->nend && R2A(shmc, slab->end_item, char) >= low && R2A(shmc, slab->end_item, char) < high) {
+        high = R2A(shmc, slab->end_item, char);
+        nend = slab->nend;
+        slab->nfree -= nend;
+        slab->nend = 0;
+    }
+
+    uint32_t *link = &slab->free_item;
+    while ((item = R2A(shmc, *link, shmc_item_t))) {
+        if ((char *) item >= low && (char *) item < high) {
+            *link = item->next;
+            slab->nfree--;
+        } else {
+            link = &item->next;
         }
-        shmc_debug("assoc[%d]_find item %p item->h_next %p\n", hv % shmc->attr->nbuckets, item, item->h_next);
-        if (item->nkey == nkey && memcmp(key, R2A(shmc, item->key, char), nkey) == 0) {
-            return item; 
-        } 
-        item = R2A(shmc, item->h_next, shmc_item_t);
+    }
+
+    int chunks = 0;
+    for (p = low; p < high; p += slab->size) {
+        item = (shmc_item_t *) p;
+        if (item->iflags & ITEM_MAG) break;
+        if ((item->iflags & ITEM_FREE) || item_move(shmc, stripe, item)) continue;
+
+        /* out of the index, a chunk maybe. the chunks of the page all
+         * move in one walk of the chains
+         */
+        if (chunks++ || !chunk_move(shmc, stripe, id, low, high) || !(item->iflags & ITEM_FREE)) break;
+    }
+    if (p >= high) return 1;
+
+    for (p = low; p < high; p += slab->size) {
+        item = (shmc_item_t *) p;
+        if (item->iflags & ITEM_FREE) {
+            item->next = slab->free_item;
+            slab->free_item = A2R(shmc, item);
+            slab->nfree++;
+        }
+    }
+    if (nend) {
+        slab->nend = nend;
+        slab->nfree += nend;
     }
     return 0;
 }
 
-static void assoc_insert(shmc_t *shmc, const char *key, size_t nkey, shmc_item_t *item)
+/* the class with the most free memory, if it is a page worth at least */
+static int slab_donor(shmc_t *shmc, int to)
 {
-    shmc->attr->nitems++;
-    uint32_t hv = hash(key, nkey, 0);
-    uint32_t slot = hv % shmc->attr->nbuckets;
-    item->h_next = shmc->buckets[slot]; /* both of them are R addr */
-    shmc->buckets[slot] = A2R(shmc, item);
-    shmc_debug("assoc[%d]_insert item %p item->h_next %p\n", (int) slot, item, item->h_next);
+    int id, donor = -1;
+    size_t best = 0;
+
+    for (id = 0; id < shmc->attr->slabs_count; ++id) {
+        shmc_slab_t *slab = &shmc->slabs[id];
+        if (id == to || slab->nfree < slab->count) continue;
+        if (slab->nfree * slab->size > best) {
+            best = slab->nfree * slab->size;
+            donor = id;
+        }
+    }
+    return donor;
 }
 
-static void assoc_delete(shmc_t *shmc, const char *key, size_t nkey)
+/* a chained item with the head or a chunk in pages from high on */
+static int chain_above(shmc_t *shmc, shmc_item_t *item, char *high)
 {
-    uint32_t hv = hash(key, nkey, 0);
-    uint32_t slot = hv % shmc->attr->nbuckets;
-    shmc_item_t **item = &shmc->buckets[slot];
-
-    while (R2A(shmc, *item, shmc_item_t)) {
-        if (R2A(shmc, *item, shmc_item_t)->nkey == nkey &&
-                memcmp(key, R2A(shmc, R2A(shmc, *item, shmc_item_t)->key, char), nkey) == 0) {
-            assert(shmc->attr->nitems);
-            shmc->attr->nitems--;
-            shmc_item_t *nxt = R2A(shmc, *item, shmc_item_t)->h_next;
-            shmc_debug("assoc[%d]_delete item %p item->h_next %p\n", slot, *item, nxt);
-            R2A(shmc, *item, shmc_item_t)->h_next = 0;
-            *item = nxt;  /* both of them are R addr */
-            break;
-        } 
-        item = &(R2A(shmc, *item, shmc_item_t)->h_next); 
+    if ((char *) item >= high) return 1;
+
+    uint32_t next;
+    memcpy(&next, item_val(item), sizeof(uint32_t));
+    while (next) {
+        shmc_item_t *chunk = R2A(shmc, next, shmc_item_t);
+        if ((char *) chunk >= high) return 1;
+        next = chunk->h_next;
     }
+    return 0;
 }
 
-static shmc_item_t *item_alloc(shmc_t *shmc, size_t nkey, size_t nval)
+/* empty the pages from npages on for a smaller mem_limit, the caller
+ * holds all the stripes. live items move to free items below, or are
+ * evicted if their class has none
+ */
+static void slab_shrink(shmc_t *shmc, size_t npages)
 {
-    assert(item_size_ok(shmc, nkey, nval));
-
-    shmc_item_t *item = 0;
-
-    /* find slot */
-    int id = item_clsid(shmc, nkey, nval);
+    shmc_attr_t *attr = shmc->attr;
     shmc_slab_t *slabs = shmc->slabs;
+    size_t page_size = slab_page_size(attr);
+    char *high = shmc->raw + npages * page_size;
+    int id, s;
 
-    /* alloc from slabs */
-    if (slabs[id].free_item) {
-        item = R2A(shmc, slabs[id].free_item, shmc_item_t);
-        slabs[id].free_item = item->next;  /* both of them are R addr */
-        shmc_debug("slabs[%02d] remove %p, next %p\n", id, A2R(shmc, item), slabs[id].free_item);
+    /* chunks can not move alone, their item goes as a whole. so do the
+     * items of a shared value above
+     */
+    for (s = 0; s < attr->nstripes; ++s) {
+        for (id = 0; id < attr->slabs_count; ++id) {
+            uint32_t next = LRU_HEAD(shmc, s, id);
+            while (next) {
+                shmc_item_t *item = R2A(shmc, next, shmc_item_t);
+                next = item->next;
+                if (!((item->iflags & ITEM_CHAIN) && chain_above(shmc, item, high)) &&
+                        !((item->iflags & ITEM_DEDUP) && (char *) item_body(shmc, item) >= high)) continue;
+
+                seq_write_begin(shmc, s);
+                assoc_delete(shmc, item_key(item), item->nkey, item->hv);
+                item_unlink(shmc, s, item);
+                item_free(shmc, s, item);
+                seq_write_end(shmc, s);
+                slabs[id].evicted++;
+            }
+        }
     }
 
-    if (!item) {
-        /* alloc from mem pool */
-        size_t len = slabs[id].size * slabs[id].count;
-        if (shmc->attr->mem_used + len < shmc->attr->mem_limit) {
-            void *raw = shmc->raw + shmc->attr->mem_used;
-            shmc->attr->mem_used += len;
+    pthread_mutex_lock(shmc->mutex);
+    mag_drain_all(shmc);
+
+    /* nothing above is handed out any more */
+    char *ends[UINT8_MAX + 1];
+    for (id = 0; id < attr->slabs_count; ++id) {
+        shmc_slab_t *slab = &slabs[id];
+        ends[id] = slab->nend ? R2A(shmc, slab->end_item, char) : 0;
+        if (ends[id] >= high) {
+            slab->nfree -= slab->nend;
+            slab->nend = 0;
+        }
 
-            size_t i;
-            for (i = 0; i < slabs[id].count; ++i) {
-                shmc_item_t *item = raw;
-                item->next = slabs[id].free_item;
-                slabs[id].free_item = A2R(shmc, item);
-                raw += slabs[id].size;
-                shmc_debug("slabs[%02d] add    %p, next %p\n", id, slabs[id].free_item, item->next);
-            }
-        } else {
-            /* LRU */
-            if (shmc->attr->evict_to_free) {
-                shmc_item_t *tail = R2A(shmc, shmc->tails[id], shmc_item_t);
-                if (tail) {
-                    assoc_delete(shmc, R2A(shmc, tail->key, char), tail->nkey);
-                    item_unlink(shmc, tail);
-                    item_free(shmc, tail);
-                }
+        uint32_t *link = &slab->free_item;
+        shmc_item_t *item;
+        while ((item = R2A(shmc, *link, shmc_item_t))) {
+            if ((char *) item >= high) {
+                *link = item->next;
+                slab->nfree--;
+            } else {
+                link = &item->next;
             }
         }
+    }
 
-        /* try again */
-        if (slabs[id].free_item) {
-            item = R2A(shmc, slabs[id].free_item, shmc_item_t); 
-            slabs[id].free_item = item->next; /* both of them are R addr */
-            shmc_debug("slabs[%02d] remove %p, next %p\n", id, A2R(shmc, item), slabs[id].free_item);
+    size_t page;
+    for (page = npages; page < attr->mem_used / page_size; ++page) {
+        if (shmc->pages[page] == PAGE_FREE) {
+            attr->pages_free--;
+            continue;
+        }
+        id = shmc->pages[page];
+        shmc_slab_t *slab = &slabs[id];
+        char *low = shmc->raw + page * page_size;
+        char *end = low + slab->size * slab->count;
+        if (ends[id] >= low && ends[id] < end) end = ends[id];
+
+        char *p;
+        for (p = low; p < end; p += slab->size) {
+            shmc_item_t *item = (shmc_item_t *) p;
+            if (item->iflags & ITEM_FREE) continue;
+            if (slab->nfree && item_move(shmc, -1, item)) continue;
+
+            s = stripe_of(shmc, item->hv);
+            shmc_bucket_t *bucket = assoc_bucket(shmc, item->hv);
+            uint32_t *ref = assoc_ref(shmc, bucket, item_key(item), item->nkey, item->hv);
+            if (ref && *ref == A2R(shmc, item)) {
+                seq_write_begin(shmc, s);
+                assoc_unlink(shmc, bucket, ref);
+                item_unlink(shmc, s, item);
+                seq_write_end(shmc, s);
+                slab->evicted++;
+            }
+            if (item->iflags & ITEM_DEDUP) {
+                uint32_t slot;
+                memcpy(&slot, item_val(item), sizeof(uint32_t));
+                shmc_item_t *body = dedup_unref(shmc, slot);
+                if (body) mag_push(shmc, 0, body);
+            }
+            item->iflags = ITEM_FREE;
         }
+        slab->pages--;
     }
 
-    if (!item) return item;
+    if (attr->mem_used > npages * page_size) attr->mem_used = npages * page_size;
+    pthread_mutex_unlock(shmc->mutex);
+}
 
-    item->clsid = id;
-    item->next  = item->prev = item->h_next = 0;
-    item->nkey  = nkey;
-    item->nval  = nval;
-    item->key   = (void *) A2R(shmc, &item->end[0]);
-    item->val   = (void *) A2R(shmc, &item->end[0]) + nkey;
-    return item;
+/* empty the pages of each class with the most free items while the
+ * class has a page worth of free items elsewhere, and release them. the
+ * caller holds all the stripes
+ */
+static void slab_compact(shmc_t *shmc)
+{
+    shmc_attr_t *attr = shmc->attr;
+    size_t page_size = slab_page_size(attr);
+    size_t page, npages = attr->mem_used / page_size;
+    int id;
+
+    uint32_t *nfrees = malloc(sizeof(uint32_t) * (npages ? npages : 1));
+    if (!nfrees) return;
+
+    pthread_mutex_lock(shmc->mutex);
+    mag_drain_all(shmc);
+
+    for (id = 0; id < attr->slabs_count; ++id) {
+        shmc_slab_t *slab = &shmc->slabs[id];
+        if (slab->nfree < slab->count) continue;
+
+        /* free items of each page, a tried page is set to 0 */
+        memset(nfrees, 0x00, sizeof(uint32_t) * npages);
+        shmc_item_t *item;
+        uint32_t next = slab->free_item;
+        while ((item = R2A(shmc, next, shmc_item_t))) {
+            nfrees[((char *) item - (char *) shmc->raw) / page_size]++;
+            next = item->next;
+        }
+        if (slab->nend) {
+            nfrees[(R2A(shmc, slab->end_item, char) - (char *) shmc->raw) / page_size] += slab->nend;
+        }
+
+        while (slab->nfree >= slab->count) {
+            size_t best = PAGE_NONE;
+            for (page = 0; page < npages; ++page) {
+                if (shmc->pages[page] != id || !nfrees[page]) continue;
+                if (best == PAGE_NONE || nfrees[page] > nfrees[best]) best = page;
+            }
+            if (best == PAGE_NONE) break;
+
+            nfrees[best] = 0;
+            if (slab_drain(shmc, -1, id, best)) page_put(shmc, best);
+        }
+    }
+
+    pthread_mutex_unlock(shmc->mutex);
+    free(nfrees);
 }
 
-static void item_free(shmc_t *shmc, shmc_item_t *item)
+/* give a page of an idle class to the starving one. writers call it
+ * before they touch any item, the items of other stripes are only
+ * moved if their stripe can be taken
+ */
+static void slab_automove(shmc_t *shmc, int stripe)
 {
-    /* find slab */
-    int id = item_clsid(shmc, item->nkey, item->nval);
-    shmc_slab_t *slabs = shmc->slabs;
+    shmc_attr_t *attr = shmc->attr;
+    if (!__atomic_load_n(&attr->slabs_starving, __ATOMIC_RELAXED)) return;
+
+    pthread_mutex_lock(shmc->mutex);
+
+    int to = attr->slabs_starving - 1;
+    attr->slabs_starving = 0;
+    if (to < 0) goto unlock;
+    shmc->slabs[to].pressure = 0;
+
+    int from = slab_donor(shmc, to);
+    if (from < 0) goto unlock;
+    mag_drain(shmc, stripe, from, UINT32_MAX);
+
+    size_t page, npages = attr->mem_used / slab_page_size(attr);
+    int tries = 0;
+    for (page = 0; page < npages && tries < SLAB_MOVE_TRIES; ++page) {
+        if (shmc->pages[page] != from) continue;
+        tries++;
+        if (slab_drain(shmc, stripe, from, page)) {
+            shmc->slabs[from].pages--;
+            slab_carve(shmc, to, page);
+            attr->slabs_moved++;
+            break;
+        }
+    }
 
-    item->next= slabs[id].free_item;
-    slabs[id].free_item = A2R(shmc, item);
-    shmc_debug("slabs[%02d] add    %p, next %p\n", id, slabs[id].free_item, item->next);
+unlock:
+    pthread_mutex_unlock(shmc->mutex);
 }
@@ -4,21 +4,77 @@
 #include <stdint.h>
 #include <pthread.h>
 
-#define SHMC_VERSION 10101012
+#define SHMC_VERSION 10101037
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef enum { SHMC_OK, SHMC_NOTFOUND, SHMC_EXIST, SHMC_ESIZE, SHMC_ESPACE,
-    SHMC_NOMEMORY, SHMC_ETOKEN, SHMC_ECREATE, SHMC_EVERSION, SHMC_SYSTEM } SHMC_RC;
+    SHMC_NOMEMORY, SHMC_ETOKEN, SHMC_ECREATE, SHMC_EVERSION, SHMC_SYSTEM, SHMC_EABORT } SHMC_RC;
+
+/* which item to drop when a slab is full
+ * LRU     move item to list head on every hit
+ * CLOCK   set a reference bit on hit, eviction gives referenced items
+ *         a second chance, hits do not take the LRU mutex
+ * SLRU    new items start in the probation segment, a hit promotes them
+ *         to the protected one, so a scan of cold keys evicts only cold keys
+ * SAMPLED LRU of the stripe, but the victim is the least recently used of
+ *         the list tails of a few stripes sampled at random
+ */
+typedef enum { SHMC_EVICT_LRU, SHMC_EVICT_CLOCK, SHMC_EVICT_SLRU, SHMC_EVICT_SAMPLED } SHMC_EVICT;
+typedef enum { SHMC_PREFAULT_NONE, SHMC_PREFAULT_POPULATE, SHMC_PREFAULT_MLOCK } SHMC_PREFAULT;
+
+/* exptime 0 never expires, up to 30 days it is seconds from now, beyond
+ * that a unix time, as memcached takes it
+ */
+#define SHMC_EXPTIME_REL (60 * 60 * 24 * 30)
 
 typedef struct shmc_s           shmc_t;
 typedef struct shmc_attr_s      shmc_attr_t;
 
 typedef struct shmc_item_s      shmc_item_t;
 typedef struct shmc_assoc_s     shmc_assoc_t;
+typedef struct shmc_bucket_s    shmc_bucket_t;
 typedef struct shmc_slab_s      shmc_slab_t;
+typedef struct shmc_stripe_s    shmc_stripe_t;
+typedef struct shmc_ref_s       shmc_ref_t;
+typedef struct shmc_op_s        shmc_op_t;
+typedef struct shmc_batch_s     shmc_batch_t;
+typedef struct shmc_ns_s        shmc_ns_t;
+
+/* val points into the share memory, valid only inside the callback */
+typedef void (*shmc_visit_t)(const char *val, size_t nval, uint32_t flags, void *ctx);
+
+/* a value pinned in place by shmc_get_ref */
+struct shmc_ref_s {
+    const char *val;
+    size_t      nval;
+    uint32_t    flags;
+    int         stripe;
+};
+
+/* write batch, ops live in caller memory and are applied under one shmc_wrlock */
+typedef enum { SHMC_OP_SET, SHMC_OP_ADD, SHMC_OP_REPLACE, SHMC_OP_DEL,
+    SHMC_OP_INCR, SHMC_OP_DECR } SHMC_OP;
+
+struct shmc_op_s {
+    SHMC_OP     op;
+    const char *key;
+    size_t      nkey;
+    const char *val;
+    size_t      nval;
+    uint32_t    flags;
+    uint32_t    exptime;  /* of set, add and replace, shmc_batch_push makes it 0 */
+    uint64_t    num;  /* incr/decr delta in, new value out */
+    SHMC_RC     rc;
+};
+
+struct shmc_batch_s {
+    shmc_op_t *ops;
+    size_t     nops;
+    size_t     size;
+};
 
 uint32_t shmc_version();
 
@@ -30,100 +86,310 @@ void shmc_destroy(shmc_t *shmc);
 const char *shmc_error(SHMC_RC rc);
 
 SHMC_RC shmc_get_nolock (shmc_t *shmc, const char *key, size_t nkey, char **val, size_t *nval, uint32_t *flags);
+/* on SHMC_ESPACE *nval is set to the size needed */
 SHMC_RC shmc_getf_nolock(shmc_t *shmc, const char *key, size_t nkey, char *val,  size_t *nval, uint32_t *flags);
 
+/* get n keys at once, rcs[i] is the result of keys[i], vals[i] is malloced
+ * like shmc_get, flags may be null. return SHMC_OK, look at rcs
+ */
+SHMC_RC shmc_mget_nolock(shmc_t *shmc, size_t n, const char **keys, const size_t *nkeys,
+                         char **vals, size_t *nvals, uint32_t *flags, SHMC_RC *rcs);
+
+/* zero copy, the value is visited or referenced in place,
+ * SHMC_ESIZE if it is chained over pages. a compressed value is visited
+ * unpacked in a buffer of its own, it can not be referenced
+ */
+SHMC_RC shmc_get_visit_nolock(shmc_t *shmc, const char *key, size_t nkey, shmc_visit_t visit, void *ctx);
+SHMC_RC shmc_get_ref_nolock  (shmc_t *shmc, const char *key, size_t nkey, shmc_ref_t *ref);
+
 SHMC_RC shmc_set_nolock    (shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags);
 SHMC_RC shmc_add_nolock    (shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags);
 SHMC_RC shmc_replace_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags);
 SHMC_RC shmc_prepend_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags);
 SHMC_RC shmc_append_nolock (shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags);
 
+/* with an exptime, see SHMC_EXPTIME_REL. the others store items that never
+ * expire, append, prepend, incr and decr keep the exptime of the item
+ */
+SHMC_RC shmc_set_exp_nolock    (shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval,
+                                uint32_t flags, uint32_t exptime);
+SHMC_RC shmc_add_exp_nolock    (shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval,
+                                uint32_t flags, uint32_t exptime);
+SHMC_RC shmc_replace_exp_nolock(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval,
+                                uint32_t flags, uint32_t exptime);
+SHMC_RC shmc_touch_nolock      (shmc_t *shmc, const char *key, size_t nkey, uint32_t exptime);
+
 SHMC_RC shmc_incr_nolock(shmc_t *shmc, const char *key, size_t nkey, uint64_t val, uint64_t *new_val, uint32_t *flags);
 SHMC_RC shmc_decr_nolock(shmc_t *shmc, const char *key, size_t nkey, uint64_t val, uint64_t *new_val, uint32_t *flags);
 
 SHMC_RC shmc_del_nolock(shmc_t *shmc, const char *key, size_t nkey);
 
+/* apply the ops in order, ops[i].rc is the result of each. if atomic,
+ * the items of all the ops are counted first, on SHMC_NOMEMORY or
+ * SHMC_ESIZE no op is applied, their rc is SHMC_EABORT, SHMC_ESIZE of the
+ * op too large. if free memory is short an atomic batch evicts what it
+ * needs first, but none of its own keys, unless evict_to_free is off
+ */
+SHMC_RC shmc_batch_apply_nolock(shmc_t *shmc, shmc_batch_t *batch, int atomic);
+
 SHMC_RC shmc_dump_nolock(shmc_t *shmc, const char *file);
 SHMC_RC shmc_load_nolock(shmc_t *shmc, const char *file);
 
+/* reclaim expired items, up to n items of each LRU list are looked at
+ * with one stripe write locked at a time. do not hold a lock meanwhile.
+ * return the items reclaimed
+ */
+size_t shmc_crawl(shmc_t *shmc, size_t n);
+
+/* evict ahead of writers, every class holding pages is given free items
+ * up to free_watermark percent of its items while memory is full. a stripe
+ * is write locked for a few evictions at a time, writers rarely have to
+ * evict themselves. do not hold a lock meanwhile. return the items evicted
+ */
+size_t shmc_maintain(shmc_t *shmc);
+
+/* every item stored up to delay seconds from now is gone then, at once if
+ * delay is 0. it is one store whatever the number of items, no lock is
+ * taken. the items are reclaimed later like expired ones, meanwhile they
+ * are still counted in nitems
+ */
+void shmc_flush(shmc_t *shmc, uint32_t delay);
+
+/* namespaces, see shmc_attr_set_nspaces. a key "name:rest" lives in the
+ * namespace open by that name, any other key in namespace 0. names are
+ * up to SHMC_NS_NAME - 1 bytes without SHMC_NS_SEP
+ */
+#define SHMC_NS_NAME 32
+#define SHMC_NS_SEP  ':'
+
+/* the namespace of name, a free one is given the name if there is none
+ * yet, "" is namespace 0. its quota is set to quota bytes unless quota is
+ * 0. SHMC_NOMEMORY if all are taken. SHMC_EXIST if a key "name:..." is
+ * stored in namespace 0 already, it would be lost, delete such keys or
+ * open the namespace before they are stored. the whole table is write
+ * locked meanwhile, do not hold a lock
+ */
+SHMC_RC shmc_ns_open(shmc_t *shmc, const char *name, size_t quota, int *ns);
+
+/* the namespace key lives in */
+int shmc_ns_of(const shmc_t *shmc, const char *key, size_t nkey);
+
+/* bytes held by the items of namespace ns */
+size_t shmc_ns_used(const shmc_t *shmc, int ns);
+
+/* lookups that found the key and that did not, of all the processes,
+ * counted only if use_hit_stats
+ */
+void shmc_hit_stats(const shmc_t *shmc, uint64_t *hits, uint64_t *misses);
+
+/* change mem_limit of a live mapping, up to mem_limit_max */
+SHMC_RC shmc_resize_nolock(shmc_t *shmc, size_t mem_limit);
+
+/* move live items out of mostly free slab pages, the pages emptied are
+ * given back to the kernel and kept in a pool for any class. chunks of
+ * chained items move too, a page holding some costs a walk of the chains
+ */
+SHMC_RC shmc_compact_nolock(shmc_t *shmc);
+
+/* lock the whole table */
 void shmc_rdlock(shmc_t *shmc);
 void shmc_wrlock(shmc_t *shmc);
 void shmc_unlock(shmc_t *shmc);
 
+/* lock the stripe the key lives in, return the stripe for shmc_unlock_stripe */
+int  shmc_rdlock_key(shmc_t *shmc, const char *key, size_t nkey);
+int  shmc_wrlock_key(shmc_t *shmc, const char *key, size_t nkey);
+void shmc_unlock_stripe(shmc_t *shmc, int stripe);
+int  shmc_lockfree(const shmc_t *shmc);
+
+/* with seqlock_read, readers take no lock, shmc_get*_nolock validate and retry */
 static inline
 SHMC_RC shmc_get(shmc_t *shmc, const char *key, size_t nkey, char **val, size_t *nval, uint32_t *flags) {
-    shmc_rdlock(shmc);
+    if (shmc_lockfree(shmc)) return shmc_get_nolock(shmc, key, nkey, val, nval, flags);
+    int stripe = shmc_rdlock_key(shmc, key, nkey);
     SHMC_RC rc = shmc_get_nolock(shmc, key, nkey, val, nval, flags);
-    shmc_unlock(shmc);
+    shmc_unlock_stripe(shmc, stripe);
     return rc;
 }
 
 static inline
 SHMC_RC shmc_getf(shmc_t *shmc, const char *key, size_t nkey, char *val, size_t *nval, uint32_t *flags) {
-    shmc_rdlock(shmc);
+    if (shmc_lockfree(shmc)) return shmc_getf_nolock(shmc, key, nkey, val, nval, flags);
+    int stripe = shmc_rdlock_key(shmc, key, nkey);
     SHMC_RC rc = shmc_getf_nolock(shmc, key, nkey, val, nval, flags);
-    shmc_unlock(shmc);
+    shmc_unlock_stripe(shmc, stripe);
     return rc;
 }
 
+/* the stripes of the keys are read locked one at a time, do not hold a
+ * lock meanwhile. like shmc_get, keys of different stripes are not read
+ * at one point in time
+ */
+SHMC_RC shmc_mget(shmc_t *shmc, size_t n, const char **keys, const size_t *nkeys,
+                  char **vals, size_t *nvals, uint32_t *flags, SHMC_RC *rcs);
+
+/* the stripe is read locked while visit runs, even with seqlock_read */
+static inline
+SHMC_RC shmc_get_visit(shmc_t *shmc, const char *key, size_t nkey, shmc_visit_t visit, void *ctx) {
+    int stripe = shmc_rdlock_key(shmc, key, nkey);
+    SHMC_RC rc = shmc_get_visit_nolock(shmc, key, nkey, visit, ctx);
+    shmc_unlock_stripe(shmc, stripe);
+    return rc;
+}
+
+/* on SHMC_OK the stripe stays read locked until shmc_ref_release,
+ * release it soon and from the same thread, do not write the stripe meanwhile
+ */
+static inline
+SHMC_RC shmc_get_ref(shmc_t *shmc, const char *key, size_t nkey, shmc_ref_t *ref) {
+    int stripe = shmc_rdlock_key(shmc, key, nkey);
+    SHMC_RC rc = shmc_get_ref_nolock(shmc, key, nkey, ref);
+    if (rc == SHMC_OK) ref->stripe = stripe;
+    else shmc_unlock_stripe(shmc, stripe);
+    return rc;
+}
+
+static inline void shmc_ref_release(shmc_t *shmc, shmc_ref_t *ref) {
+    shmc_unlock_stripe(shmc, ref->stripe);
+    ref->val = 0;
+}
+
 static inline
 SHMC_RC shmc_set(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags) {
-    shmc_wrlock(shmc);
+    int stripe = shmc_wrlock_key(shmc, key, nkey);
     SHMC_RC rc = shmc_set_nolock(shmc, key, nkey, val, nval, flags);
-    shmc_unlock(shmc);
+    shmc_unlock_stripe(shmc, stripe);
     return rc;
 }
 
 static inline
 SHMC_RC shmc_add(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags) {
-    shmc_wrlock(shmc);
+    int stripe = shmc_wrlock_key(shmc, key, nkey);
     SHMC_RC rc = shmc_add_nolock(shmc, key, nkey, val, nval, flags);
-    shmc_unlock(shmc);
+    shmc_unlock_stripe(shmc, stripe);
     return rc;
 }
 
 static inline
 SHMC_RC shmc_replace(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags) {
-    shmc_wrlock(shmc);
+    int stripe = shmc_wrlock_key(shmc, key, nkey);
     SHMC_RC rc = shmc_replace_nolock(shmc, key, nkey, val, nval, flags);
-    shmc_unlock(shmc);
+    shmc_unlock_stripe(shmc, stripe);
     return rc;
 }
 
 static inline
 SHMC_RC shmc_prepend(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags) {
-    shmc_wrlock(shmc);
+    int stripe = shmc_wrlock_key(shmc, key, nkey);
     SHMC_RC rc = shmc_prepend_nolock(shmc, key, nkey, val, nval, flags);
-    shmc_unlock(shmc);
+    shmc_unlock_stripe(shmc, stripe);
     return rc;
 }
 static inline
 SHMC_RC shmc_append(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags) {
-    shmc_wrlock(shmc);
+    int stripe = shmc_wrlock_key(shmc, key, nkey);
     SHMC_RC rc = shmc_append_nolock(shmc, key, nkey, val, nval, flags);
-    shmc_unlock(shmc);
+    shmc_unlock_stripe(shmc, stripe);
     return rc;
 }
 
 static inline
 SHMC_RC shmc_incr(shmc_t *shmc, const char *key, size_t nkey, uint64_t val, uint64_t *new_val, uint32_t *flags) {
-    shmc_wrlock(shmc);
+    int stripe = shmc_wrlock_key(shmc, key, nkey);
     SHMC_RC rc = shmc_incr_nolock(shmc, key, nkey, val, new_val, flags);
-    shmc_unlock(shmc);
+    shmc_unlock_stripe(shmc, stripe);
     return rc;
 }
 
 static inline
 SHMC_RC shmc_decr(shmc_t *shmc, const char *key, size_t nkey, uint64_t val, uint64_t *new_val, uint32_t *flags) {
-    shmc_wrlock(shmc);
+    int stripe = shmc_wrlock_key(shmc, key, nkey);
     SHMC_RC rc = shmc_decr_nolock(shmc, key, nkey, val, new_val, flags);
-    shmc_unlock(shmc);
+    shmc_unlock_stripe(shmc, stripe);
+    return rc;
+}
+
+static inline
+SHMC_RC shmc_set_exp(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval,
+                     uint32_t flags, uint32_t exptime) {
+    int stripe = shmc_wrlock_key(shmc, key, nkey);
+    SHMC_RC rc = shmc_set_exp_nolock(shmc, key, nkey, val, nval, flags, exptime);
+    shmc_unlock_stripe(shmc, stripe);
+    return rc;
+}
+
+static inline
+SHMC_RC shmc_add_exp(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval,
+                     uint32_t flags, uint32_t exptime) {
+    int stripe = shmc_wrlock_key(shmc, key, nkey);
+    SHMC_RC rc = shmc_add_exp_nolock(shmc, key, nkey, val, nval, flags, exptime);
+    shmc_unlock_stripe(shmc, stripe);
+    return rc;
+}
+
+static inline
+SHMC_RC shmc_replace_exp(shmc_t *shmc, const char *key, size_t nkey, const char *val, size_t nval,
+                         uint32_t flags, uint32_t exptime) {
+    int stripe = shmc_wrlock_key(shmc, key, nkey);
+    SHMC_RC rc = shmc_replace_exp_nolock(shmc, key, nkey, val, nval, flags, exptime);
+    shmc_unlock_stripe(shmc, stripe);
+    return rc;
+}
+
+static inline SHMC_RC shmc_touch(shmc_t *shmc, const char *key, size_t nkey, uint32_t exptime) {
+    int stripe = shmc_wrlock_key(shmc, key, nkey);
+    SHMC_RC rc = shmc_touch_nolock(shmc, key, nkey, exptime);
+    shmc_unlock_stripe(shmc, stripe);
     return rc;
 }
 
 static inline SHMC_RC shmc_del(shmc_t *shmc, const char *key, size_t nkey) {
-    shmc_wrlock(shmc);
+    int stripe = shmc_wrlock_key(shmc, key, nkey);
     SHMC_RC rc = shmc_del_nolock(shmc, key, nkey);
+    shmc_unlock_stripe(shmc, stripe);
+    return rc;
+}
+
+static inline void shmc_batch_init(shmc_batch_t *batch, shmc_op_t *ops, size_t size) {
+    batch->ops  = ops;
+    batch->nops = 0;
+    batch->size = size;
+}
+
+/* SHMC_ESPACE if the batch is full */
+static inline
+SHMC_RC shmc_batch_push(shmc_batch_t *batch, SHMC_OP op, const char *key, size_t nkey,
+                        const char *val, size_t nval, uint32_t flags, uint64_t num) {
+    if (batch->nops == batch->size) return SHMC_ESPACE;
+    shmc_op_t *o = &batch->ops[batch->nops++];
+    o->op   = op;
+    o->key  = key;
+    o->nkey = nkey;
+    o->val  = val;
+    o->nval = nval;
+    o->flags = flags;
+    o->exptime = 0;
+    o->num  = num;
+    o->rc   = SHMC_OK;
+    return SHMC_OK;
+}
+
+#define shmc_batch_set(batch, key, nkey, val, nval, flags) \
+    shmc_batch_push(batch, SHMC_OP_SET, key, nkey, val, nval, flags, 0)
+#define shmc_batch_add(batch, key, nkey, val, nval, flags) \
+    shmc_batch_push(batch, SHMC_OP_ADD, key, nkey, val, nval, flags, 0)
+#define shmc_batch_replace(batch, key, nkey, val, nval, flags) \
+    shmc_batch_push(batch, SHMC_OP_REPLACE, key, nkey, val, nval, flags, 0)
+#define shmc_batch_del(batch, key, nkey) \
+    shmc_batch_push(batch, SHMC_OP_DEL, key, nkey, 0, 0, 0, 0)
+#define shmc_batch_incr(batch, key, nkey, delta) \
+    shmc_batch_push(batch, SHMC_OP_INCR, key, nkey, 0, 0, 0, delta)
+#define shmc_batch_decr(batch, key, nkey, delta) \
+    shmc_batch_push(batch, SHMC_OP_DECR, key, nkey, 0, 0, 0, delta)
+
+static inline SHMC_RC shmc_batch_apply(shmc_t *shmc, shmc_batch_t *batch, int atomic) {
+    shmc_wrlock(shmc);
+    SHMC_RC rc = shmc_batch_apply_nolock(shmc, batch, atomic);
     shmc_unlock(shmc);
     return rc;
 }
@@ -142,21 +408,51 @@ static inline SHMC_RC shmc_load(shmc_t *shmc, const char *file) {
     return rc;
 }
 
+static inline SHMC_RC shmc_resize(shmc_t *shmc, size_t mem_limit) {
+    shmc_wrlock(shmc);
+    SHMC_RC rc = shmc_resize_nolock(shmc, mem_limit);
+    shmc_unlock(shmc);
+    return rc;
+}
+
+static inline SHMC_RC shmc_compact(shmc_t *shmc) {
+    shmc_wrlock(shmc);
+    SHMC_RC rc = shmc_compact_nolock(shmc);
+    shmc_unlock(shmc);
+    return rc;
+}
+
 struct shmc_s {
     /* fix addr in share memory */
     unsigned int     *version;
 	shmc_attr_t      *attr;
-    /* pthread lock */
-    pthread_rwlock_t *lock;
+    /* slab allocator lock */
     pthread_mutex_t  *mutex;
-	shmc_item_t     **heads;
-	shmc_item_t     **tails;
-	shmc_item_t     **buckets;
+    /* rwlock, LRU mutex and seqlock of each stripe */
+    shmc_stripe_t    *stripes;
+	uint32_t         *heads;  /* LRU lists, items by offset */
+	uint32_t         *tails;
+	uint32_t         *mags;   /* free items kept by each stripe */
+	uint32_t         *nmags;
+	uint32_t         *crawls; /* where the crawler goes on in each LRU list */
+	uint32_t         *mids;   /* first probation item of SLRU lists */
+	uint32_t         *nprots; /* protected items of SLRU lists */
+	uint32_t         *counts; /* items of the lists */
+	shmc_bucket_t    *buckets;
 	shmc_slab_t      *slabs;
+    uint8_t          *pages;  /* slab class of each page of raw */
+    uint32_t         *dedup;  /* slots of shared values */
+    uint8_t          *sketch; /* access frequency of keys, for admission */
+    shmc_ns_t        *spaces; /* namespaces by id */
     void             *raw;
+    size_t            size;     /* bytes mapped by this process */
+    size_t            resizes;  /* mem_resizes this process has followed */
 
     /* file lock */ 
     int               fd;
+    /* this process holds all stripes by shmc_wrlock */
+    int               wrall;
+    int               shift;  /* of item offsets, attr->offset_shift */
 };
 
 struct shmc_attr_s {
@@ -170,14 +466,69 @@ struct shmc_attr_s {
     float item_size_factor;
 
     int evict_to_free;
+    int evict_policy;
 	int default_counter;
     int use_flock;
+    int use_futex;
+    int seqlock_read;
+    int nstripes;
+    int nbuckets_max;
+    float load_factor;
+    size_t slab_page_size;
+    int use_hugepage;
+    int prefault;
+    size_t mem_limit_max;
+    size_t compress_min;
+    size_t dedup_min;
+    int dedup_slots;
+    int use_tinylfu;
+    int free_watermark;
+    int nspaces;
+    int use_hit_stats;
 
     /* runtime info, read only for user */
     size_t mem_used;
     int slabs_count;
 	int max_depth;
     size_t nitems; 
+    int hash_nbuckets;      /* buckets of the live index */
+    int hash_old_nbuckets;  /* buckets of the index being migrated, 0 if none */
+    int hash_table;         /* which of the two index areas is live */
+    int hash_pending;       /* stripes not done with the migration */
+    size_t hash_resizes;
+    int slabs_starving;     /* class id + 1 that wants a page, 0 if none */
+    size_t slabs_moved;     /* pages the automover gave to another class */
+    size_t mem_resizes;     /* mem_limit changes, processes follow on lock */
+    size_t pages_free;      /* pages below mem_used released to the pool */
+    size_t dedup_values;    /* values shared by equal items */
+    size_t dedup_dead;      /* slots of the dedup table freed, not cleared */
+    size_t reclaimed;       /* expired items freed */
+    size_t lfu_rejected;    /* new items refused by the admission sketch */
+    size_t lfu_aged;        /* slices of the sketch halved */
+    size_t evicted_ahead;   /* items evicted or reclaimed by shmc_maintain */
+    uint64_t flush;         /* time a flush is due << 32 | generation */
+    int ns_open;            /* namespaces named, they are 1 to ns_open */
+    int offset_shift;       /* items link by offsets of 1 << offset_shift bytes */
+};
+
+/* a namespace, read only for user */
+struct shmc_ns_s {
+    char     name[SHMC_NS_NAME];
+    size_t   quota;     /* bytes its items may hold, 0 no limit */
+    uint64_t evicted;   /* items evicted to keep the quota */
+};
+
+/* a slab class, read only for user */
+struct shmc_slab_s {
+    uint32_t free_item;
+    uint32_t nfree;     /* items on the free list or never used */
+    uint32_t end_item;  /* the next never used item of the last page */
+    uint32_t nend;
+    size_t   size;      /* item size */
+    size_t   count;     /* items of a page */
+    uint32_t pages;
+    uint32_t pressure;  /* evictions since the class last got a page */
+    uint64_t evicted;
 };
 
 #define shmc_attr_set_mem_limit(attr, limit) \
@@ -201,6 +552,9 @@ struct shmc_attr_s {
 #define shmc_attr_set_evict_to_free(attr, on_off) \
 	(attr)->evict_to_free = (on_off)
 
+#define shmc_attr_set_evict_policy(attr, policy) \
+	(attr)->evict_policy = (policy)
+
 #define shmc_attr_set_default_counter(attr, on_off) \
     (attr)->default_counter = (on_off)
 
@@ -208,11 +562,113 @@ struct shmc_attr_s {
 #define shmc_attr_use_flock(attr, on_off) \
 	(attr)->use_flock = (on_off)
 
-#define SHMC_ATTR_INITIALIZER     \
- { 64 * 1024 * 1024, 65536, 0644, \
-   64, 1024 * 1024, 2,            \
-   1, 1, 0,                       \
-   0, 0, 0, 0 }
+/* futex rwlock with sharded reader counts instead of pthread rwlock,
+ * for read mostly workloads, writers are preferred. use_flock wins if both set
+ */
+#define shmc_attr_use_futex(attr, on_off) \
+	(attr)->use_futex = (on_off)
+
+/* readers never lock, they retry if a writer changed the table
+ * meanwhile. LRU is not updated on hit, only the reference bit of CLOCK,
+ * the hit counts if use_hit_stats and the admission sketch are written
+ */
+#define shmc_attr_use_seqlock(attr, on_off) \
+	(attr)->seqlock_read = (on_off)
+
+/* count hits and misses for shmc_hit_stats. every lookup then adds to a
+ * counter of its stripe shared by all the processes, a cache line write
+ * on the read path that readers of one stripe fight over. off by default
+ */
+#define shmc_attr_use_hit_stats(attr, on_off) \
+	(attr)->use_hit_stats = (on_off)
+
+/* keys are hashed to n stripes, each has its own lock and LRU lists,
+ * writers of different stripes do not wait for each other
+ */
+#define shmc_attr_set_nstripes(attr, n) \
+	(attr)->nstripes = (n)
+
+/* the index grows by doubling up to n buckets, or shrinks back to nbuckets,
+ * when items per bucket slot pass load_factor, buckets are migrated a few
+ * at a time by writers. space for two indexes of n buckets is reserved,
+ * n <= nbuckets turns it off
+ */
+#define shmc_attr_set_nbuckets_max(attr, n) \
+	(attr)->nbuckets_max = (n)
+
+#define shmc_attr_set_load_factor(attr, f) \
+	(attr)->load_factor = (f)
+
+/* slabs grow by pages of n bytes, items larger than a page, up to
+ * item_size_max, are chained over items of the largest class
+ */
+#define shmc_attr_set_slab_page_size(attr, n) \
+	(attr)->slab_page_size = (n)
+
+/* back the mapping by huge pages, put the token on hugetlbfs or turn
+ * on shmem THP (shmem_enabled advise) for a token under /dev/shm
+ */
+#define shmc_attr_use_hugepage(attr, on_off) \
+	(attr)->use_hugepage = (on_off)
+
+/* SHMC_PREFAULT_POPULATE faults the whole mapping in at create and at
+ * every attach, SHMC_PREFAULT_MLOCK also locks it in memory, shmc_init
+ * fails if RLIMIT_MEMLOCK does not allow it
+ */
+#define shmc_attr_set_prefault(attr, how) \
+	(attr)->prefault = (how)
+
+/* room for mem_limit to grow up to n bytes by shmc_resize, the address
+ * space is reserved at attach, memory is used only up to mem_limit. a
+ * mapping of 32G or more rounds items up to 16 bytes or more, a
+ * SHMC_FAST build does not take it
+ */
+#define shmc_attr_set_mem_limit_max(attr, n) \
+	(attr)->mem_limit_max = (n)
+
+/* values of n bytes or more are stored lz compressed if they get
+ * smaller, readers get them back unpacked. 0 turns it off
+ */
+#define shmc_attr_set_compress_min(attr, n) \
+	(attr)->compress_min = (n)
+
+/* values of n bytes or more are stored once for all items holding the
+ * same bytes, writes copy them. 0 turns it off
+ */
+#define shmc_attr_set_dedup_min(attr, n) \
+	(attr)->dedup_min = (n)
+
+/* most distinct shared values, the table is sized for it */
+#define shmc_attr_set_dedup_slots(attr, n) \
+	(attr)->dedup_slots = (n)
+
+/* a new key is stored only if it was asked for more often than the item
+ * it would evict, by a count-min sketch of recent lookups and writes.
+ * one-hit wonders do not push hot items out
+ */
+#define shmc_attr_use_tinylfu(attr, on_off) \
+	(attr)->use_tinylfu = (on_off)
+
+/* free items shmc_maintain keeps for each class, in percent of the items
+ * of its pages. 0 turns it off, writers evict when they run out
+ */
+#define shmc_attr_set_free_watermark(attr, pct) \
+	(attr)->free_watermark = (pct)
+
+/* n namespaces in the table, 0 and 1 are one. each has its own share of
+ * the stripes, so its own buckets, locks and LRU lists, a writer evicts
+ * only from its own namespace. nstripes is rounded up to a multiple of n
+ */
+#define shmc_attr_set_nspaces(attr, n) \
+	(attr)->nspaces = (n)
+
+#define SHMC_ATTR_INITIALIZER        \
+ { 64 * 1024 * 1024, 65536, 0644,    \
+   64, 1024 * 1024, 2,               \
+   1, SHMC_EVICT_LRU, 1, 0, 0, 0, 1, \
+   0, 0.75, 1024 * 1024, 0,          \
+   SHMC_PREFAULT_NONE, 0, 0, 0, 65536, 0, 0, 1, 0, \
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
 
 #ifdef __cplusplus
 }
@@ -29,6 +29,44 @@ char *x(char c, size_t len)
     return memset(malloc(len), c, len);
 }
 
+/* count the bytes equal to *ctx */
+void count_char(const char *val, size_t nval, uint32_t flags, void *ctx)
+{
+    size_t i, n = 0;
+    for (i = 0; i < nval; ++i) {
+        if (val[i] == *(char *) ctx) n++;
+    }
+    *(size_t *) ctx = n;
+}
+
+/* the token of the table of test name */
+const char *token_of(const char *name)
+{
+    static char token[64];
+    snprintf(token, sizeof(token), "/tmp/shmc.%s.mmap", name);
+    return token;
+}
+
+/* a fresh table of attr for test name */
+shmc_t *open_table(const char *name, shmc_attr_t *attr)
+{
+    char ok[64], error[64];
+    snprintf(ok, sizeof(ok), "shmc_init %s ok", name);
+    snprintf(error, sizeof(error), "shmc_init %s error", name);
+
+    shmc_t *shmc;
+    unlink(token_of(name));
+    SHMC_RC rc = shmc_init(token_of(name), attr, &shmc);
+    test(rc == SHMC_OK, ok, error, shmc_error(rc));
+    return shmc;
+}
+
+void close_table(shmc_t *shmc, const char *name)
+{
+    shmc_destroy(shmc);
+    unlink(token_of(name));
+}
+
 int main(int argc, char *argv[])
 {
     const char *token = "/tmp/shmc.mmap";
@@ -191,12 +229,1036 @@ int main(int argc, char *argv[])
             "shmc replace error", shmc_error(rc));
 
     char buffer[32];
+    nval = sizeof(buffer);
     rc = shmc_getf(shmc, key, nkey, buffer, &nval, &flags);
-    test(rc == SHMC_OK && nval == 16 && flags == 64,
+    test(rc == SHMC_OK && nval == 16 && flags == 0,
          "shmc_getf ok", "shmc_getf error", shmc_error(rc));
 
+    nval = 8;
+    rc = shmc_getf(shmc, key, nkey, buffer, &nval, &flags);
+    test(rc == SHMC_ESPACE && nval == 16, "shmc_getf espace report size ok",
+         "shmc_getf espace report size error", shmc_error(rc));
+
+    size_t ctx = x16[0];
+    rc = shmc_get_visit(shmc, key, nkey, count_char, &ctx);
+    test(rc == SHMC_OK && ctx == 16, "shmc_get_visit ok",
+         "shmc_get_visit error", shmc_error(rc));
+
+    shmc_ref_t ref;
+    rc = shmc_get_ref(shmc, key, nkey, &ref);
+    test(rc == SHMC_OK && ref.nval == 16 && memcmp(ref.val, x16, 16) == 0,
+         "shmc_get_ref ok", "shmc_get_ref error", shmc_error(rc));
+    shmc_ref_release(shmc, &ref);
+
+    {
+        const char *keys[] = { key, "mget.none", key };
+        size_t nkeys[] = { nkey, 9, nkey };
+        char *vals[3];
+        size_t nvals[3];
+        uint32_t fs[3];
+        SHMC_RC rcs[3];
+        rc = shmc_mget(shmc, 3, keys, nkeys, vals, nvals, fs, rcs);
+        test(rc == SHMC_OK && rcs[0] == SHMC_OK && rcs[1] == SHMC_NOTFOUND && rcs[2] == SHMC_OK &&
+             nvals[0] == 16 && memcmp(vals[0], x16, 16) == 0 && nvals[2] == 16 && fs[2] == 0,
+             "shmc_mget ok", "shmc_mget error", shmc_error(rc));
+        free(vals[0]);
+        free(vals[2]);
+
+        /* more keys than a batch, over the stripes, every other one set */
+        const char *mkeys[40];
+        size_t mnkeys[40];
+        char *mvals[40], names[40][16];
+        size_t mnvals[40];
+        SHMC_RC mrcs[40];
+        int i, n = 0;
+        for (i = 0; i < 40; ++i) {
+            mnkeys[i] = sprintf(names[i], "mget.%d", i);
+            mkeys[i] = names[i];
+            if (i % 2 == 0) shmc_set(shmc, mkeys[i], mnkeys[i], x16, 16, i);
+        }
+        rc = shmc_mget(shmc, 40, mkeys, mnkeys, mvals, mnvals, 0, mrcs);
+        for (i = 0; i < 40; ++i) {
+            if (i % 2 == 0 && mrcs[i] == SHMC_OK && mnvals[i] == 16 && memcmp(mvals[i], x16, 16) == 0) n++;
+            if (i % 2 == 1 && mrcs[i] == SHMC_NOTFOUND) n++;
+            if (mrcs[i] == SHMC_OK) free(mvals[i]);
+        }
+        test(rc == SHMC_OK && n == 40, "shmc_mget stripes ok", "shmc_mget stripes error", shmc_error(rc));
+    }
+
     shmc_destroy(shmc);
 
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_use_seqlock(&attr, 1);
+
+        shmc = open_table("seqlock", &attr);
+
+        rc = shmc_set(shmc, key, nkey, x64, 64, 7);
+        rc = shmc_get(shmc, key, nkey, &val, &nval, &flags);
+        test(rc == SHMC_OK && nval == 64 && memcmp(val, x64, 64) == 0 && flags == 7,
+                "shmc_get lock free ok", "shmc_get lock free error", shmc_error(rc));
+        free(val);
+        val = 0;
+
+        nval = 16;
+        rc = shmc_getf(shmc, key, nkey, buffer, &nval, &flags);
+        test(rc == SHMC_ESPACE && nval == 64, "shmc_getf lock free expect espace ok",
+                "shmc_getf lock free error", shmc_error(rc));
+
+        rc = shmc_del(shmc, key, nkey);
+        rc = shmc_get(shmc, key, nkey, &val, &nval, &flags);
+        test(rc == SHMC_NOTFOUND, "shmc_get lock free expect notfound ok",
+                "shmc_get lock free error", shmc_error(rc));
+
+        close_table(shmc, "seqlock");
+    }
+
+    {
+        /* small enough to evict, all the items are in the first class */
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 32 * 1024 * 1024);
+        shmc_attr_set_evict_policy(&attr, SHMC_EVICT_CLOCK);
+
+        shmc = open_table("clock", &attr);
+
+        char k[32];
+        int i, n = 0;
+        /* key 0 is hit all the time, it should survive the evictions */
+        for (i = 0; i < 400000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            rc = shmc_set(shmc, k, nk, x16, 16, 0);
+            if (rc != SHMC_OK) break;
+            rc = shmc_get(shmc, "0", 1, &val, &nval, 0);
+            if (rc != SHMC_OK) break;
+            free(val);
+            n++;
+        }
+        val = 0;
+        test(n == 400000 && shmc->attr->nitems < 400000, "hot key survive clock eviction ok",
+                "hot key survive clock eviction error", shmc_error(rc));
+
+        close_table(shmc, "clock");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 32 * 1024 * 1024);
+        shmc_attr_set_nbuckets(&attr, 1000);
+        shmc_attr_set_nstripes(&attr, 3);
+
+        shmc = open_table("stripes", &attr);
+
+        char k[32];
+        int i, n = 0;
+        for (i = 0; i < 400000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            rc = shmc_set(shmc, k, nk, x16, 16, i);
+            if (rc != SHMC_OK) break;
+            n++;
+        }
+        rc = shmc_get(shmc, k, strlen(k), &val, &nval, &flags);
+        test(n == 400000 && rc == SHMC_OK && flags == 399999 && shmc->attr->nitems < 400000 &&
+                shmc->attr->nbuckets % 3 == 0,
+                "shmc_set evict with stripes ok", "shmc_set evict with stripes error", shmc_error(rc));
+        free(val);
+        val = 0;
+
+        close_table(shmc, "stripes");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_use_futex(&attr, 1);
+        shmc_attr_set_nstripes(&attr, 2);
+
+        shmc = open_table("futex", &attr);
+
+        /* a writer process and a reader process on the same keys */
+        char k[32];
+        int i, n = 0;
+        if ((pid = fork()) == 0) {
+            for (i = 0; i < 100000; ++i) {
+                size_t nk = sprintf(k, "%d", i % 100);
+                shmc_set(shmc, k, nk, x16, 16, i % 100);
+            }
+            exit(0);
+        }
+        for (i = 0; i < 100000; ++i) {
+            size_t nk = sprintf(k, "%d", i % 100);
+            nval = sizeof(buffer);
+            rc = shmc_getf(shmc, k, nk, buffer, &nval, &flags);
+            if (rc == SHMC_NOTFOUND) continue;
+            if (rc != SHMC_OK || nval != 16 || flags != (uint32_t) i % 100) break;
+            n++;
+        }
+        waitpid(pid, 0, 0);
+
+        shmc_wrlock(shmc);
+        shmc_unlock(shmc);
+
+        test(i == 100000 && n > 0, "shmc_getf with futex lock ok",
+                "shmc_getf with futex lock error", shmc_error(rc));
+
+        close_table(shmc, "futex");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 32 * 1024 * 1024);
+        shmc_attr_set_evict_to_free(&attr, 0);
+
+        shmc = open_table("batch", &attr);
+
+        shmc_op_t ops[8];
+        shmc_batch_t batch;
+        shmc_batch_init(&batch, ops, 8);
+        shmc_batch_set(&batch, "a", 1, x16, 16, 1);
+        shmc_batch_set(&batch, "b", 1, x32, 32, 2);
+        shmc_batch_add(&batch, "a", 1, x16, 16, 3);
+        shmc_batch_del(&batch, "b", 1);
+        shmc_batch_incr(&batch, "c", 1, 5);
+        shmc_batch_incr(&batch, "c", 1, 5);
+
+        rc = shmc_batch_apply(shmc, &batch, 0);
+        test(rc == SHMC_OK && ops[0].rc == SHMC_OK && ops[2].rc == SHMC_EXIST &&
+             ops[3].rc == SHMC_OK && ops[5].rc == SHMC_OK && ops[5].num == 10,
+             "shmc_batch_apply ok", "shmc_batch_apply error", shmc_error(rc));
+
+        /* an op too large, none is applied */
+        char *big = malloc(shmc->attr->item_size_max);
+        shmc_batch_init(&batch, ops, 8);
+        shmc_batch_set(&batch, "d", 1, x16, 16, 0);
+        shmc_batch_set(&batch, "e", 1, big, shmc->attr->item_size_max, 0);
+        rc = shmc_batch_apply(shmc, &batch, 1);
+        nval = sizeof(buffer);
+        test(rc == SHMC_ESIZE && ops[0].rc == SHMC_EABORT && ops[1].rc == SHMC_ESIZE &&
+             shmc_getf(shmc, "d", 1, buffer, &nval, 0) == SHMC_NOTFOUND,
+             "shmc_batch_apply atomic expect esize ok", "shmc_batch_apply atomic error", shmc_error(rc));
+        free(big);
+
+        /* fill the memory, then an atomic batch must not apply the del */
+        char k[32];
+        int i;
+        for (i = 0; ; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            if (shmc_set(shmc, k, nk, x16, 16, 0) != SHMC_OK) break;
+        }
+
+        shmc_batch_init(&batch, ops, 8);
+        shmc_batch_del(&batch, "0", 1);
+        shmc_batch_set(&batch, "x", 1, x16, 16, 0);
+        shmc_batch_set(&batch, "y", 1, x16, 16, 0);
+        rc = shmc_batch_apply(shmc, &batch, 1);
+        nval = sizeof(buffer);
+        test(rc == SHMC_NOMEMORY && ops[0].rc == SHMC_EABORT && ops[2].rc == SHMC_EABORT &&
+             shmc_getf(shmc, "0", 1, buffer, &nval, 0) != SHMC_NOTFOUND,
+             "shmc_batch_apply atomic expect nomemory ok",
+             "shmc_batch_apply atomic error", shmc_error(rc));
+
+        close_table(shmc, "batch");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 256 * 1024);
+        shmc_attr_set_slab_page_size(&attr, 64 * 1024);
+        shmc_attr_set_nstripes(&attr, 1);
+
+        shmc = open_table("batch_evict", &attr);
+
+        shmc_op_t ops[4];
+        shmc_batch_t batch;
+        shmc_batch_init(&batch, ops, 4);
+        shmc_batch_set(&batch, "a", 1, x16, 16, 0);
+        shmc_batch_incr(&batch, "c", 1, 5);
+        rc = shmc_batch_apply(shmc, &batch, 1);
+        test(rc == SHMC_OK && ops[0].rc == SHMC_OK && ops[1].rc == SHMC_OK && ops[1].num == 5,
+             "shmc_batch_apply atomic ok", "shmc_batch_apply atomic error", shmc_error(rc));
+
+        /* memory is full, the batch evicts the oldest keys of one LRU but
+         * not its own. shmc_touch does not move a key in the LRU
+         */
+        char k[32];
+        int i, old;
+        for (i = 10000; i < 20000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_set(shmc, k, nk, x16, 16, 0);
+        }
+        for (old = 10000; old < 20000; ++old) {
+            size_t nk = sprintf(k, "%d", old);
+            if (shmc_touch(shmc, k, nk, 0) == SHMC_OK) break;
+        }
+        uint64_t evicted = 0;
+        for (i = 0; i < shmc->attr->slabs_count; ++i) evicted += shmc->slabs[i].evicted;
+
+        shmc_batch_init(&batch, ops, 4);
+        shmc_batch_replace(&batch, k, 5, x16, 16, 0);
+        shmc_batch_set(&batch, "xxxxx", 5, x16, 16, 0);
+        shmc_batch_set(&batch, "yyyyy", 5, x16, 16, 0);
+        rc = shmc_batch_apply(shmc, &batch, 1);
+        for (i = 0; i < shmc->attr->slabs_count; ++i) evicted -= shmc->slabs[i].evicted;
+
+        char next[32];
+        size_t nnext = sprintf(next, "%d", old + 1);
+        test(rc == SHMC_OK && ops[0].rc == SHMC_OK && ops[2].rc == SHMC_OK && evicted != 0 &&
+             shmc_touch(shmc, k, 5, 0) == SHMC_OK && shmc_touch(shmc, next, nnext, 0) == SHMC_NOTFOUND,
+             "shmc_batch_apply atomic evict ok", "shmc_batch_apply atomic evict error", shmc_error(rc));
+
+        close_table(shmc, "batch_evict");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 32 * 1024 * 1024);
+
+        shmc = open_table("automove", &attr);
+
+        /* no page is given before the first alloc of its class */
+        test(shmc->attr->mem_used == 0, "slab lazy ok", "slab lazy error", 0);
+
+        /* all the memory goes to the smallest class, then it is left idle */
+        char k[32];
+        int i, n = 0;
+        for (i = 0; i < 200000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_set(shmc, k, nk, x16, 16, i);
+        }
+        for (i = 0; i < 200000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_del(shmc, k, nk);
+        }
+
+        char *x300 = x('e', 300);
+        int id = 2;
+        for (i = 0; i < 60000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            if (shmc_set(shmc, k, nk, x300, 300, i) == SHMC_OK) n++;
+        }
+        free(x300);
+        test(n == 60000 && shmc->attr->nitems > 20000 && shmc->attr->slabs_moved > 0 &&
+                shmc->slabs[id].pages > 1 && shmc->slabs[id].evicted > 0 && shmc->slabs[0].nfree > 0,
+                "slab automove ok", "slab automove error", 0);
+
+        close_table(shmc, "automove");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 8 * 1024 * 1024);
+        shmc_attr_set_mem_limit_max(&attr, 32 * 1024 * 1024);
+
+        shmc = open_table("resize", &attr);
+
+        char k[32];
+        char *x300 = x('r', 300);
+        int i, n = 0;
+        for (i = 0; i < 50000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_set(shmc, k, nk, x300, 300, i);
+        }
+        size_t small = shmc->attr->nitems;
+
+        rc = shmc_resize(shmc, 32 * 1024 * 1024);
+        for (i = 0; rc == SHMC_OK && i < 50000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_set(shmc, k, nk, x300, 300, i);
+        }
+        test(rc == SHMC_OK && shmc->attr->nitems == 50000 && small < 50000 &&
+                shmc_resize(shmc, 64 * 1024 * 1024) == SHMC_ESIZE,
+                "shmc_resize grow ok", "shmc_resize grow error", shmc_error(rc));
+
+        /* items above the new limit move down or are evicted */
+        rc = shmc_resize(shmc, 4 * 1024 * 1024);
+        for (i = 0; i < 50000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            size_t nv = 300;
+            uint32_t f;
+            char buf[300];
+            if (shmc_getf(shmc, k, nk, buf, &nv, &f) == SHMC_OK) {
+                if (nv == 300 && f == (uint32_t) i && memcmp(buf, x300, 300) == 0) n++;
+                else n = -1000000;
+            }
+        }
+        test(rc == SHMC_OK && n > 0 && (size_t) n == shmc->attr->nitems &&
+                shmc->attr->mem_used <= 4 * 1024 * 1024,
+                "shmc_resize shrink ok", "shmc_resize shrink error", shmc_error(rc));
+        free(x300);
+
+        close_table(shmc, "resize");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 16 * 1024 * 1024);
+
+        shmc = open_table("compact", &attr);
+
+        /* nine of ten items go, the rest are spread over every page */
+        char k[32];
+        char *x300 = x('c', 300);
+        int i, n = 0;
+        for (i = 0; i < 30000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_set(shmc, k, nk, x300, 300, i);
+        }
+        for (i = 0; i < 30000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            if (i % 10) shmc_del(shmc, k, nk);
+        }
+
+        /* a stripe keeps a magazine of freed items, the rest go back */
+        size_t id, nfree = 0;
+        for (id = 0; id < (size_t) shmc->attr->slabs_count; ++id) nfree += shmc->slabs[id].nfree;
+        test(nfree + shmc->attr->nstripes * 16 >= 27000, "slab magazine ok", "slab magazine error", 0);
+
+        rc = shmc_compact(shmc);
+        size_t released = shmc->attr->pages_free;
+        for (i = 0; i < 30000; i += 10) {
+            size_t nk = sprintf(k, "%d", i);
+            size_t nv = 300;
+            uint32_t f;
+            char buf[300];
+            if (shmc_getf(shmc, k, nk, buf, &nv, &f) == SHMC_OK && f == (uint32_t) i &&
+                    memcmp(buf, x300, 300) == 0) n++;
+        }
+        test(rc == SHMC_OK && released > 0 && n == 3000, "shmc_compact ok",
+                "shmc_compact error", shmc_error(rc));
+
+        /* any class takes the released pages first */
+        for (i = 0; i < 2000; ++i) {
+            size_t nk = sprintf(k, "big%d", i);
+            shmc_set(shmc, k, nk, x300, 100, i);
+        }
+        test(shmc->attr->pages_free < released, "slab page pool ok", "slab page pool error", 0);
+        free(x300);
+
+        close_table(shmc, "compact");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 8 * 1024 * 1024);
+        shmc_attr_use_hugepage(&attr, 1);
+        shmc_attr_set_prefault(&attr, SHMC_PREFAULT_POPULATE);
+
+        shmc = open_table("prefault", &attr);
+        rc = shmc_set(shmc, "hp", 2, x16, 16, 0);
+
+        /* an attacher follows the creator's setting */
+        shmc_t *attached;
+        if (rc == SHMC_OK) rc = shmc_init(token_of("prefault"), 0, &attached);
+        if (rc == SHMC_OK) {
+            size_t nv = 16;
+            uint32_t f;
+            char buf[16];
+            rc = shmc_getf(attached, "hp", 2, buf, &nv, &f);
+            shmc_destroy(attached);
+        }
+        test(rc == SHMC_OK, "shmc prefault ok", "shmc prefault error", shmc_error(rc));
+
+        close_table(shmc, "prefault");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_slab_page_size(&attr, 64 * 1024);
+
+        shmc = open_table("chain", &attr);
+
+        /* the value spans a head and a few chunks of 64k pages */
+        size_t i, n = 200 * 1024;
+        char *big = malloc(n + 1000);
+        for (i = 0; i < n + 1000; ++i) big[i] = i % 251;
+
+        rc = shmc_set(shmc, "chain", 5, big, n, 7);
+        test(rc == SHMC_OK, "shmc_set chain ok", "shmc_set chain error", shmc_error(rc));
+
+        char *v;
+        size_t nv;
+        uint32_t f;
+        rc = shmc_get(shmc, "chain", 5, &v, &nv, &f);
+        test(rc == SHMC_OK && nv == n && f == 7 && memcmp(v, big, n) == 0,
+                "shmc_get chain ok", "shmc_get chain error", shmc_error(rc));
+        free(v);
+
+        size_t ctx = 0;
+        rc = shmc_get_visit(shmc, "chain", 5, count_char, &ctx);
+        test(rc == SHMC_ESIZE, "shmc_get_visit chain ok", "shmc_get_visit chain error", shmc_error(rc));
+
+        rc = shmc_append(shmc, "chain", 5, big + n, 1000, 8);
+        char *buf = malloc(n + 1000);
+        nv = n + 1000;
+        if (rc == SHMC_OK) rc = shmc_getf(shmc, "chain", 5, buf, &nv, &f);
+        test(rc == SHMC_OK && nv == n + 1000 && f == 8 && memcmp(buf, big, n + 1000) == 0,
+                "shmc_append chain ok", "shmc_append chain error", shmc_error(rc));
+        free(buf);
+
+        /* the chunks are taken again, no new page */
+        size_t used = shmc->attr->mem_used;
+        rc = shmc_del(shmc, "chain", 5);
+        if (rc == SHMC_OK) rc = shmc_set(shmc, "chain", 5, big, n + 1000, 9);
+        test(rc == SHMC_OK && shmc->attr->mem_used == used,
+                "shmc_del chain ok", "shmc_del chain error", shmc_error(rc));
+
+        /* a head, two full chunks and a tail of about 3k, the tails share
+         * pages of a small class. one in four chains stays, compaction
+         * packs their tails into as few pages as they fit
+         */
+        char k[32];
+        int j, tail = -1, last = shmc->attr->slabs_count - 1;
+        size_t nbig = 160 * 1024;
+        for (j = 0; j < 64; ++j) {
+            sprintf(k, "t%03d", j);
+            shmc_set(shmc, k, 4, big + j, nbig, j);
+        }
+        for (j = 0; j < last; ++j) {
+            if (shmc->slabs[j].pages) tail = j;
+        }
+        for (j = 0; j < 64; ++j) {
+            sprintf(k, "t%03d", j);
+            if (j % 4) shmc_del(shmc, k, 4);
+        }
+
+        rc = shmc_compact(shmc);
+        buf = malloc(nbig);
+        for (j = 0; j < 64 && rc == SHMC_OK; j += 4) {
+            sprintf(k, "t%03d", j);
+            nv = nbig;
+            rc = shmc_getf(shmc, k, 4, buf, &nv, &f);
+            if (rc == SHMC_OK && (nv != nbig || f != (uint32_t) j || memcmp(buf, big + j, nbig) != 0)) {
+                rc = SHMC_SYSTEM;
+            }
+        }
+        test(rc == SHMC_OK && tail >= 0 &&
+                shmc->slabs[tail].pages <= (16 + shmc->slabs[tail].count - 1) / shmc->slabs[tail].count,
+                "shmc_compact chain ok", "shmc_compact chain error", shmc_error(rc));
+        free(buf);
+        free(big);
+
+        close_table(shmc, "chain");
+    }
+
+    {
+        int seqlock;
+        for (seqlock = 0; seqlock < 2; ++seqlock) {
+            shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+            shmc_attr_set_slab_page_size(&attr, 64 * 1024);
+            shmc_attr_set_compress_min(&attr, 1024);
+            shmc_attr_use_seqlock(&attr, seqlock);
+
+            shmc = open_table("lz", &attr);
+
+            /* 200k of text fits in one page instead of a chain */
+            size_t i, n = 200 * 1024, used = shmc->attr->mem_used;
+            char *text = malloc(n + 4);
+            for (i = 0; i < n; ++i) text[i] = "shmc compress "[i % 14];
+            memcpy(text + n, "tail", 4);
+
+            char *v = 0;
+            size_t nv;
+            uint32_t f;
+            rc = shmc_set(shmc, "lz", 2, text, n, 3);
+            if (rc == SHMC_OK) rc = shmc_get(shmc, "lz", 2, &v, &nv, &f);
+            test(rc == SHMC_OK && nv == n && f == 3 && memcmp(v, text, n) == 0 &&
+                    shmc->attr->mem_used - used <= 64 * 1024,
+                    "shmc_set lz ok", "shmc_set lz error", shmc_error(rc));
+            free(v);
+
+            rc = shmc_append(shmc, "lz", 2, "tail", 4, 4);
+            nv = n;
+            if (rc == SHMC_OK) rc = shmc_getf(shmc, "lz", 2, text, &nv, &f);
+            test(rc == SHMC_ESPACE && nv == n + 4, "shmc_getf lz ok", "shmc_getf lz error", shmc_error(rc));
+
+            char *buf = malloc(n + 4);
+            nv = n + 4;
+            rc = shmc_getf(shmc, "lz", 2, buf, &nv, &f);
+            test(rc == SHMC_OK && nv == n + 4 && f == 4 && memcmp(buf, text, n + 4) == 0,
+                    "shmc_append lz ok", "shmc_append lz error", shmc_error(rc));
+            free(buf);
+
+            size_t ctx = 'c', nc = 0;
+            for (i = 0; i < n; ++i) nc += text[i] == 'c';
+            shmc_ref_t ref;
+            rc = shmc_get_visit(shmc, "lz", 2, count_char, &ctx);
+            if (rc == SHMC_OK) rc = shmc_get_ref(shmc, "lz", 2, &ref);
+            test(rc == SHMC_ESIZE && ctx == nc, "shmc_get_visit lz ok",
+                    "shmc_get_visit lz error", shmc_error(rc));
+            free(text);
+
+            close_table(shmc, "lz");
+        }
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_slab_page_size(&attr, 64 * 1024);
+        shmc_attr_set_dedup_min(&attr, 256);
+        shmc_attr_set_dedup_slots(&attr, 64);
+
+        shmc = open_table("dedup", &attr);
+
+        /* a thousand items of the same 4k share one copy */
+        char val[4096], k[32];
+        int i, n = 0;
+        for (i = 0; i < 4096; ++i) val[i] = 'a' + i % 26;
+        for (i = 0; i < 1000; ++i) {
+            size_t nk = sprintf(k, "dedup%d", i);
+            if (shmc_set(shmc, k, nk, val, sizeof(val), i) == SHMC_OK) n++;
+        }
+        test(n == 1000 && shmc->attr->dedup_values == 1 && shmc->attr->mem_used < 1000 * 4096 / 4,
+                "shmc_set dedup ok", "shmc_set dedup error", 0);
+
+        char *v = 0;
+        size_t nv, ctx = 'a', nc = 0;
+        uint32_t f;
+        shmc_ref_t ref;
+        for (i = 0; i < 4096; ++i) nc += val[i] == 'a';
+        rc = shmc_get(shmc, "dedup7", 6, &v, &nv, &f);
+        if (rc == SHMC_OK) rc = shmc_get_visit(shmc, "dedup8", 6, count_char, &ctx);
+        if (rc == SHMC_OK) rc = shmc_get_ref(shmc, "dedup9", 6, &ref);
+        test(rc == SHMC_OK && nv == sizeof(val) && f == 7 && memcmp(v, val, nv) == 0 && ctx == nc &&
+                ref.nval == sizeof(val) && memcmp(ref.val, val, sizeof(val)) == 0,
+                "shmc_get dedup ok", "shmc_get dedup error", shmc_error(rc));
+        if (rc == SHMC_OK) shmc_ref_release(shmc, &ref);
+        free(v);
+
+        /* a write gets its own copy, the others keep the shared one */
+        rc = shmc_append(shmc, "dedup1", 6, "tail", 4, 1);
+        char *buf = malloc(sizeof(val) + 4);
+        nv = sizeof(val) + 4;
+        if (rc == SHMC_OK) rc = shmc_getf(shmc, "dedup1", 6, buf, &nv, &f);
+        test(rc == SHMC_OK && nv == sizeof(val) + 4 && memcmp(buf + sizeof(val), "tail", 4) == 0 &&
+                shmc->attr->dedup_values == 2, "shmc_append dedup ok", "shmc_append dedup error", shmc_error(rc));
+        nv = sizeof(val) + 4;
+        rc = shmc_getf(shmc, "dedup2", 6, buf, &nv, &f);
+        test(rc == SHMC_OK && nv == sizeof(val) && memcmp(buf, val, nv) == 0,
+                "shmc_getf dedup ok", "shmc_getf dedup error", shmc_error(rc));
+        free(buf);
+
+        /* values come and go while others stay, the dead slots are cleared */
+        char cv[4096];
+        memcpy(cv, val, sizeof(cv));
+        for (i = 0; i < 1000; ++i) {
+            sprintf(cv, "%d", i);
+            shmc_set(shmc, "churn", 5, cv, sizeof(cv), 0);
+        }
+        rc = shmc_set(shmc, "churn2", 6, cv, sizeof(cv), 0);
+        test(rc == SHMC_OK && shmc->attr->dedup_values == 3 && shmc->attr->dedup_dead <= 64 / 4,
+                "shmc_set dedup churn ok", "shmc_set dedup churn error", shmc_error(rc));
+        shmc_del(shmc, "churn", 5);
+        shmc_del(shmc, "churn2", 6);
+
+        for (i = 0; i < 1000; ++i) {
+            size_t nk = sprintf(k, "dedup%d", i);
+            shmc_del(shmc, k, nk);
+        }
+        test(shmc->attr->dedup_values == 0 && shmc->attr->nitems == 0,
+                "shmc_del dedup ok", "shmc_del dedup error", 0);
+
+        close_table(shmc, "dedup");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 1024 * 1024);
+        shmc_attr_set_slab_page_size(&attr, 64 * 1024);
+
+        shmc = open_table("ttl", &attr);
+
+        /* a unix time long past expires at once */
+        const uint32_t past = SHMC_EXPTIME_REL + 1;
+
+        rc = shmc_set_exp(shmc, "ttl", 3, x16, 16, 1, past);
+        if (rc == SHMC_OK) rc = shmc_get(shmc, "ttl", 3, &val, &nval, &flags);
+        test(rc == SHMC_NOTFOUND, "shmc_set_exp expired ok", "shmc_set_exp expired error", shmc_error(rc));
+
+        rc = shmc_add_exp(shmc, "ttl", 3, x16, 16, 2, 100);
+        nval = sizeof(buffer);
+        if (rc == SHMC_OK) rc = shmc_getf(shmc, "ttl", 3, buffer, &nval, &flags);
+        test(rc == SHMC_OK && flags == 2 && shmc->attr->reclaimed == 1,
+                "shmc_add_exp over expired ok", "shmc_add_exp over expired error", shmc_error(rc));
+
+        rc = shmc_touch(shmc, "ttl", 3, past);
+        if (rc == SHMC_OK) rc = shmc_replace(shmc, "ttl", 3, x16, 16, 3);
+        SHMC_RC rc2 = shmc_touch(shmc, "none", 4, 100);
+        test(rc == SHMC_NOTFOUND && rc2 == SHMC_NOTFOUND, "shmc_touch ok", "shmc_touch error", shmc_error(rc));
+
+        /* the crawler finds them all, then nothing more */
+        char k[32];
+        int i;
+        for (i = 0; i < 100; ++i) {
+            size_t nk = sprintf(k, "ttl%d", i);
+            shmc_set_exp(shmc, k, nk, x16, 16, i, i % 2 ? past : 0);
+        }
+        size_t n = shmc_crawl(shmc, 1000);
+        test(n == 50 && shmc->attr->nitems == 50 && shmc_crawl(shmc, 1000) == 0,
+                "shmc_crawl ok", "shmc_crawl error", 0);
+
+        /* expired items make room before live ones are evicted */
+        char v[1000];
+        memset(v, 'v', sizeof(v));
+        for (i = 0; i < 2000; ++i) {
+            size_t nk = sprintf(k, "old%d", i);
+            shmc_set_exp(shmc, k, nk, v, sizeof(v), i, past);
+        }
+        uint64_t evicted = 0;
+        for (i = 0; i < shmc->attr->slabs_count; ++i) evicted += shmc->slabs[i].evicted;
+        test(evicted == 0 && shmc->attr->reclaimed > 1000, "reclaim before evict ok",
+                "reclaim before evict error", 0);
+
+        close_table(shmc, "ttl");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 1024 * 1024);
+        shmc_attr_set_slab_page_size(&attr, 64 * 1024);
+        shmc_attr_set_evict_policy(&attr, SHMC_EVICT_SLRU);
+        shmc_attr_use_hit_stats(&attr, 1);
+
+        shmc = open_table("slru", &attr);
+
+        /* keys hit once are protected from a scan of keys never hit */
+        char k[32];
+        int i, n = 0;
+        for (i = 0; i < 100; ++i) {
+            size_t nk = sprintf(k, "hot%d", i);
+            shmc_set(shmc, k, nk, x16, 16, i);
+            nval = sizeof(buffer);
+            shmc_getf(shmc, k, nk, buffer, &nval, 0);
+        }
+        for (i = 0; i < 50000; ++i) {
+            size_t nk = sprintf(k, "cold%d", i);
+            shmc_set(shmc, k, nk, x16, 16, i);
+        }
+        for (i = 0; i < 100; ++i) {
+            size_t nk = sprintf(k, "hot%d", i);
+            nval = sizeof(buffer);
+            if (shmc_getf(shmc, k, nk, buffer, &nval, 0) == SHMC_OK) n++;
+        }
+        uint64_t hits, misses;
+        shmc_hit_stats(shmc, &hits, &misses);
+        test(n == 100 && shmc->attr->nitems < 50100 && hits == 200 && misses == 0,
+                "slru scan resistance ok", "slru scan resistance error", 0);
+
+        close_table(shmc, "slru");
+
+        /* one-hit wonders do not push out keys read again and again */
+        shmc_attr_set_evict_policy(&attr, SHMC_EVICT_SAMPLED);
+        shmc_attr_set_nstripes(&attr, 4);
+        shmc_attr_use_tinylfu(&attr, 1);
+
+        shmc = open_table("tinylfu", &attr);
+
+        for (i = 0; i < 20000; ++i) {
+            size_t nk = sprintf(k, "hot%d", i);
+            shmc_set(shmc, k, nk, x16, 16, i);
+            int j;
+            for (j = 0; j < 3; ++j) {
+                nval = sizeof(buffer);
+                shmc_getf(shmc, k, nk, buffer, &nval, 0);
+            }
+        }
+        size_t nitems = shmc->attr->nitems;
+        for (n = 0, i = 0; i < 1000; ++i) {
+            size_t nk = sprintf(k, "cold%d", i);
+            if (shmc_set(shmc, k, nk, x16, 16, i) == SHMC_NOMEMORY) n++;
+        }
+        test(n > 900 && shmc->attr->lfu_rejected >= (size_t) n && shmc->attr->nitems == nitems,
+                "tinylfu admission ok", "tinylfu admission error", 0);
+
+        close_table(shmc, "tinylfu");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 1024 * 1024);
+        shmc_attr_set_slab_page_size(&attr, 64 * 1024);
+        shmc_attr_set_nstripes(&attr, 2);
+        shmc_attr_set_free_watermark(&attr, 10);
+
+        shmc = open_table("maintain", &attr);
+
+        char k[32];
+        int i;
+        for (i = 0; i < 20000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_set(shmc, k, nk, x16, 16, i);
+        }
+        size_t n = shmc_maintain(shmc);
+        test(n > 0 && shmc->attr->evicted_ahead == n && shmc->slabs[0].nfree * 100 >=
+                shmc->slabs[0].pages * shmc->slabs[0].count * 9, "shmc_maintain ok", "shmc_maintain error", 0);
+
+        /* the writes pop what was freed ahead, none of them evicts */
+        uint64_t evicted = shmc->slabs[0].evicted;
+        for (i = 0; i < 100; ++i) {
+            size_t nk = sprintf(k, "new%d", i);
+            rc = shmc_set(shmc, k, nk, x16, 16, i);
+            if (rc != SHMC_OK) break;
+        }
+        test(rc == SHMC_OK && shmc->slabs[0].evicted == evicted, "shmc_set without eviction ok",
+                "shmc_set without eviction error", shmc_error(rc));
+
+        close_table(shmc, "maintain");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 1024 * 1024);
+        shmc_attr_set_slab_page_size(&attr, 64 * 1024);
+        shmc_attr_use_seqlock(&attr, 1);
+
+        shmc = open_table("flush", &attr);
+
+        char k[32];
+        int i;
+        for (i = 0; i < 100; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_set(shmc, k, nk, x16, 16, i);
+        }
+
+        /* a delayed flush leaves the items until it is due */
+        shmc_flush(shmc, 100);
+        nval = sizeof(buffer);
+        rc = shmc_getf(shmc, "0", 1, buffer, &nval, &flags);
+        test(rc == SHMC_OK, "shmc_flush delay ok", "shmc_flush delay error", shmc_error(rc));
+
+        shmc_flush(shmc, 0);
+        nval = sizeof(buffer);
+        rc = shmc_getf(shmc, "0", 1, buffer, &nval, &flags);
+        SHMC_RC rc2 = shmc_add(shmc, "1", 1, x16, 16, 1);
+        test(rc == SHMC_NOTFOUND && rc2 == SHMC_OK && shmc->attr->nitems == 100,
+                "shmc_flush ok", "shmc_flush error", shmc_error(rc));
+
+        size_t n = shmc_crawl(shmc, 1000);
+        nval = sizeof(buffer);
+        rc = shmc_getf(shmc, "1", 1, buffer, &nval, &flags);
+        test(n == 99 && shmc->attr->nitems == 1 && rc == SHMC_OK, "shmc_crawl flushed ok",
+                "shmc_crawl flushed error", shmc_error(rc));
+
+        close_table(shmc, "flush");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 256 * 1024);
+        shmc_attr_set_slab_page_size(&attr, 64 * 1024);
+
+        shmc = open_table("incr", &attr);
+
+        char k[32];
+        int i;
+        for (i = 0; i < 10000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_set(shmc, k, nk, "abc", 3, 0);
+        }
+
+        /* the counter is the LRU tail, the alloc of its new item must
+         * not evict it
+         */
+        size_t nitems = shmc->attr->nitems;
+        shmc_set(shmc, "c", 1, "ab", 2, 0);
+        for (i = 0; i < (int) nitems - 1; ++i) {
+            size_t nk = sprintf(k, "new%d", i);
+            shmc_set(shmc, k, nk, "abc", 3, 0);
+        }
+        uint64_t n;
+        rc = shmc_incr(shmc, "c", 1, 1, &n, 0);
+        nval = sizeof(buffer);
+        SHMC_RC rc2 = shmc_getf(shmc, "c", 1, buffer, &nval, &flags);
+        test(rc == SHMC_OK && n == 1 && rc2 == SHMC_OK && strncmp(buffer, "1", 1) == 0,
+                "shmc_incr of the LRU tail ok", "shmc_incr of the LRU tail error",
+                shmc_error(rc2));
+
+        /* nothing is counted on the read path by default */
+        uint64_t hits, misses;
+        shmc_hit_stats(shmc, &hits, &misses);
+        test(hits == 0 && misses == 0, "hit stats off ok", "hit stats off error", 0);
+
+        close_table(shmc, "incr");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 1024 * 1024);
+        shmc_attr_set_slab_page_size(&attr, 64 * 1024);
+        shmc_attr_set_nstripes(&attr, 2);
+        shmc_attr_set_nspaces(&attr, 3);
+
+        shmc = open_table("ns", &attr);
+
+        int dns, acl, again, full;
+
+        /* a key of the name stored before the namespace is open would be
+         * hidden by it
+         */
+        shmc_set(shmc, "dns:old", 7, x16, 16, 0);
+        rc = shmc_ns_open(shmc, "dns", 16 * 1024, &dns);
+        test(rc == SHMC_EXIST && shmc_ns_of(shmc, "dns:old", 7) == 0 && shmc_del(shmc, "dns:old", 7) == SHMC_OK,
+                "shmc_ns_open expect exist ok", "shmc_ns_open error", shmc_error(rc));
+
+        rc = shmc_ns_open(shmc, "dns", 16 * 1024, &dns);
+        SHMC_RC rc2 = shmc_ns_open(shmc, "acl", 0, &acl);
+        SHMC_RC rc3 = shmc_ns_open(shmc, "dns", 0, &again);
+        SHMC_RC rc4 = shmc_ns_open(shmc, "flag", 0, &full);
+        test(shmc->attr->nstripes == 3 &&
+                rc == SHMC_OK && rc2 == SHMC_OK && rc3 == SHMC_OK && dns == 1 && acl == 2 && again == dns &&
+                rc4 == SHMC_NOMEMORY && shmc_ns_open(shmc, "a:b", 0, &full) == SHMC_ESIZE &&
+                shmc_ns_of(shmc, "dns:x", 5) == dns && shmc_ns_of(shmc, "acl:", 4) == acl &&
+                shmc_ns_of(shmc, "x", 1) == 0 && shmc_ns_of(shmc, "foo:x", 5) == 0,
+                "shmc_ns_open ok", "shmc_ns_open error", 0);
+
+        char k[32];
+        int i;
+        for (i = 0; i < 100; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_set(shmc, k, nk, x16, 16, i);
+        }
+        size_t used = shmc_ns_used(shmc, 0);
+
+        /* the same key in another namespace is another item, a namespace
+         * over its quota evicts its own items only
+         */
+        for (i = 0; i < 2000; ++i) {
+            size_t nk = sprintf(k, "dns:%d", i);
+            rc = shmc_set(shmc, k, nk, x16, 16, i + 1);
+            if (rc != SHMC_OK) break;
+        }
+        nval = sizeof(buffer);
+        rc2 = shmc_getf(shmc, "dns:0", 5, buffer, &nval, &flags);
+        int n = 0;
+        for (i = 0; i < 100; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            nval = sizeof(buffer);
+            if (shmc_getf(shmc, k, nk, buffer, &nval, &flags) == SHMC_OK && flags == (uint32_t) i) n++;
+        }
+        test(rc == SHMC_OK && rc2 == SHMC_NOTFOUND && n == 100 && shmc_ns_used(shmc, 0) == used &&
+                shmc_ns_used(shmc, dns) <= 16 * 1024 && shmc->spaces[dns].evicted > 0 &&
+                shmc_ns_used(shmc, acl) == 0, "namespace quota ok", "namespace quota error", 0);
+
+        close_table(shmc, "ns");
+    }
+
+    {
+        /* items link by 32 bit offsets, past 32G in units of 16 bytes. the
+         * file backs only mem_limit
+         */
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_mem_limit(&attr, 16 * 1024 * 1024);
+        shmc_attr_set_mem_limit_max(&attr, 40ULL * 1024 * 1024 * 1024);
+
+        shmc = open_table("big", &attr);
+
+        char k[32];
+        int i, n = 0;
+        for (i = 0; i < 1000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_set(shmc, k, nk, x32, 32, i);
+        }
+
+        shmc_t *attached = 0;
+        rc = shmc_init(token_of("big"), 0, &attached);
+        for (i = 0; rc == SHMC_OK && i < 1000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            nval = sizeof(buffer);
+            if (shmc_getf(attached, k, nk, buffer, &nval, &flags) == SHMC_OK && flags == (uint32_t) i) n++;
+        }
+        test(rc == SHMC_OK && shmc->attr->offset_shift == 4 && n == 1000, "shmc_init over 32G ok",
+                "shmc_init over 32G error", shmc_error(rc));
+        if (attached) shmc_destroy(attached);
+
+        close_table(shmc, "big");
+    }
+
+    {
+        /* far more keys than slots, most of them overflow */
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_nbuckets(&attr, 16);
+
+        shmc = open_table("bucket", &attr);
+
+        char k[32];
+        int i, n = 0;
+        for (i = 0; i < 1000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_set(shmc, k, nk, x16, 16, i);
+        }
+        for (i = 0; i < 1000; i += 2) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_del(shmc, k, nk);
+        }
+        for (i = 0; i < 1000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            nval = sizeof(buffer);
+            rc = shmc_getf(shmc, k, nk, buffer, &nval, &flags);
+            if (i % 2 == 0 && rc == SHMC_NOTFOUND) n++;
+            if (i % 2 == 1 && rc == SHMC_OK && flags == (uint32_t) i) n++;
+        }
+        test(n == 1000 && shmc->attr->nitems == 500, "bucket overflow ok",
+                "bucket overflow error", 0);
+
+        /* rewrite the chained items, in place and into other classes */
+        for (i = 1; i < 1000; i += 2) {
+            size_t nk = sprintf(k, "%d", i);
+            if (i % 3 == 0) shmc_set(shmc, k, nk, x96, 96, i);
+            else if (i % 3 == 1) shmc_append(shmc, k, nk, x64, 64, i);
+            else shmc_set(shmc, k, nk, x32, 16, i);
+        }
+        for (i = 1, n = 0; i < 1000; i += 2) {
+            size_t nk = sprintf(k, "%d", i);
+            char *v;
+            rc = shmc_get(shmc, k, nk, &v, &nval, &flags);
+            if (rc != SHMC_OK) continue;
+            if (flags == (uint32_t) i && nval == (size_t) (i % 3 == 0 ? 96 : i % 3 == 1 ? 80 : 16)) n++;
+            free(v);
+        }
+        test(n == 500 && shmc->attr->nitems == 500, "bucket rewrite ok",
+                "bucket rewrite error", 0);
+
+        close_table(shmc, "bucket");
+    }
+
+    {
+        shmc_attr_t attr = SHMC_ATTR_INITIALIZER;
+        shmc_attr_set_nbuckets(&attr, 16);
+        shmc_attr_set_nbuckets_max(&attr, 4096);
+        shmc_attr_set_nstripes(&attr, 2);
+
+        shmc = open_table("index", &attr);
+
+        char k[32];
+        int i, n = 0;
+        for (i = 0; i < 10000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            shmc_set(shmc, k, nk, x16, 16, i);
+        }
+        for (i = 0; i < 10000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            nval = sizeof(buffer);
+            rc = shmc_getf(shmc, k, nk, buffer, &nval, &flags);
+            if (rc == SHMC_OK && flags == (uint32_t) i) n++;
+        }
+        test(n == 10000 && shmc->attr->hash_nbuckets > 16 && shmc->attr->hash_resizes > 0,
+                "index grow ok", "index grow error", 0);
+
+        int grown = shmc->attr->hash_nbuckets;
+        for (i = 0; i < 10000; ++i) {
+            size_t nk = sprintf(k, "%d", i);
+            if (i % 100) shmc_del(shmc, k, nk);
+            else shmc_set(shmc, k, nk, x16, 16, i);
+        }
+        for (i = n = 0; i < 10000; i += 100) {
+            size_t nk = sprintf(k, "%d", i);
+            nval = sizeof(buffer);
+            rc = shmc_getf(shmc, k, nk, buffer, &nval, &flags);
+            if (rc == SHMC_OK && flags == (uint32_t) i) n++;
+        }
+        test(n == 100 && shmc->attr->hash_nbuckets < grown, "index shrink ok",
+                "index shrink error", 0);
+
+        close_table(shmc, "index");
+    }
+
     if ((pid = fork()) == 0) {
         shmc_t *shmc_reader;
         rc = shmc_init(token, 0, &shmc_reader);